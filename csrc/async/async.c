@@ -21,6 +21,7 @@
    SOFTWARE.
    */
 
+#define _GNU_SOURCE
 #include "async.h"
 
 #include "../utils/alloc.h"
@@ -28,71 +29,124 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <stdatomic.h>
 #include <pthread.h>
 #include <errno.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/shm.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <liburing.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
 #include <time.h>
 #include <linux/fs.h>
 #include <linux/fiemap.h>
-
-/* Insert ELEM into a doubly linked list, maintaining FIFO order. */
+#include <linux/mempolicy.h>
+#include <linux/futex.h>
+
+/* Round SIZE up to a multiple of 4K. */
+#define PAGE_ROUND(size) ((((size) - 1) | 0xFFF) + 1)
+
+/* Most CQEs a responder reaps at once. */
+#define REAP_BATCH (64)
+
+/* Most entries moved through a worker's ring at once by the batch interfaces,
+   whose indices are kept on the stack; larger batches are moved in chunks. */
+#define RING_BATCH (256)
+
+/* Most SQEs the kernel allows in a ring (IORING_MAX_ENTRIES). */
+#define RING_MAX_ENTRIES (32768)
+
+/* Milliseconds a reader's kernel poller (with ASYNC_SQPOLL) spins without
+   finding IO before it sleeps, until the reader next submits. */
+#define SQPOLL_IDLE_MS (100)
+
+/* Entries must each fill a single cache line. */
+_Static_assert(sizeof(entry_t) == CACHE_LINE, "entry_t must fill one cache line");
+
+/* What a CQE is the completion of. Kept in the low bits of its user data,
+   beside its entry, which is cache line aligned. */
+typedef enum cqe_kind {
+    CQE_READ,           /* The entry's read, which completes it. */
+    CQE_READ_LINKED,    /* The entry's read, followed by closing its direct
+                           descriptor, which completes it. */
+    CQE_DONE,           /* Completes the entry as it is (e.g., failed). */
+    CQE_OPEN,           /* Opening the entry's file as a direct descriptor. */
+    CQE_STATX,          /* Getting the size of the entry's file. */
+} cqe_kind_t;
+
+/* State of an entry while its file is opened through a reader's ring. Private
+   to the loader's threads. */
+typedef struct open_state {
+    struct statx stx;       /* Written by the entry's IORING_OP_STATX. */
+    int          open_res;  /* Result of its IORING_OP_OPENAT; 0, or negative
+                               ERRNO value. The direct descriptor is only
+                               held if it succeeded. */
+    int          stx_res;   /* Result of its IORING_OP_STATX. */
+    int          n_pending; /* CQEs to reap before it's passed back to the
+                               reader. */
+} open_state_t;
+
+/* Push E to RING, by its index in its worker's queue. Every ring can hold all
+   of the worker's entries, so this can't fail. */
 static void
-fifo_push(entry_t **head, pthread_spinlock_t *lock, entry_t *elem)
-{
-    /* Handle case of empty list. */
-    pthread_spin_lock(lock);
-    if (*head == NULL) {
-        *head = elem;
-        elem->prev = elem;
-        elem->next = elem;
-        pthread_spin_unlock(lock);
-        return;
-    }
-
-    /* Otherwise, insert into back of list. */
-    elem->prev = (*head)->prev;
-    elem->next = (*head)->next;
-
-    /* Place this element behind the current tail. */
-    (*head)->prev->next = elem;
-    (*head)->prev = elem;
-
-    pthread_spin_unlock(lock);
+async_push(ring_t *ring, entry_t *e)
+{
+    bool pushed = ring_push(ring, e - e->worker->queue);
+    assert(pushed);
+    (void) pushed;
 }
 
-/* Pop from a doubly linked list, maintaining FIFO order. */
+/* Pop one of STATE's entries from RING. Returns NULL if RING is empty. */
 static entry_t *
-fifo_pop(entry_t **head, pthread_spinlock_t *lock)
+async_pop(wstate_t *state, ring_t *ring)
 {
-    pthread_spin_lock(lock);
-    entry_t *out = *head;
-    if (out == NULL) {
-        pthread_spin_unlock(lock);
+    size_t index;
+    if (!ring_pop(ring, &index)) {
         return NULL;
     }
 
-    (*head)->next->prev = (*head)->prev;
-    (*head)->prev->next = (*head)->next;
+    return &state->queue[index];
+}
 
-    /* Handle case of resulting list being empty. */
-    *head = (*head)->next;
-    if (*head == out) {
-        *head = NULL;
-    }
-    pthread_spin_unlock(lock);
+/* Bytes of a worker's queue of DEPTH entries, followed by the cells of its
+   three rings and then the entries' paths, rounded up to 4K. The worker's
+   inline areas follow. */
+static size_t
+async_queue_bytes(size_t depth)
+{
+    return PAGE_ROUND(depth * sizeof(entry_t) +
+                      3 * ring_capacity(depth) * sizeof(ring_cell_t) +
+                      depth * (MAX_PATH_LEN + 1));
+}
+
+/* Index of E among all of its loader's entries; its worker's index, times the
+   queue depth, plus its index in its worker's queue. Entries opened through
+   io_uring use it as the slot of their direct descriptor. */
+static size_t
+async_entry_index(lstate_t *ld, entry_t *e)
+{
+    wstate_t *st = e->worker;
+
+    return (size_t) (st - ld->states) * st->capacity + (size_t) (e - st->queue);
+}
 
-    return out;
+/* The entry at INDEX among all of LD's entries, as ASYNC_ENTRY_INDEX. */
+static entry_t *
+async_entry_at(lstate_t *ld, size_t index)
+{
+    size_t capacity = ld->states[0].capacity;
+
+    return &ld->states[index / capacity].queue[index % capacity];
 }
 
 /* ------------- */
@@ -104,43 +158,188 @@ fifo_pop(entry_t **head, pthread_spinlock_t *lock)
 bool
 async_try_request(wstate_t *state, char *path)
 {
-    /* Get a free entry. Return false if none available. */
-    entry_t *e = fifo_pop(&state->free, &state->free_lock);
-    if (e == NULL) {
-        fprintf(stderr, "free list is empty.\n");
+    if (async_request_many(state, &path, NULL, 1) == 0) {
+        fprintf(stderr, "free ring is empty.\n");
         return false;
     }
 
-    /* Configure the entry and move it into the ready list. */
-    strncpy(e->path, path, MAX_PATH_LEN);
-    fifo_push(&state->ready, &state->ready_lock, e);
-
     return true;
 }
 
+/* Worker interface to input queue, for a batch of requests. Takes up to N free
+   entries, RING_BATCH at a time, fills them with PATHS (and IDS if non-NULL,
+   or zero IDs if not), and moves each chunk into the ready ring at once.
+   Returns the number of requests made, which is less than N if the queue
+   fills; the first that many of PATHS were requested. */
+size_t
+async_request_many(wstate_t *state, char **paths, const uint64_t *ids, size_t n)
+{
+    size_t n_requested = 0;
+    while (n_requested < n) {
+        /* Get free entries. */
+        size_t indices[RING_BATCH];
+        size_t want = n - n_requested < RING_BATCH ? n - n_requested : RING_BATCH;
+        size_t k = ring_pop_many(&state->free, indices, want);
+
+        /* Configure the entries and move them into the ready ring. */
+        for (size_t i = 0; i < k; i++) {
+            entry_t *e = &state->queue[indices[i]];
+            strncpy(e->path, paths[n_requested + i], MAX_PATH_LEN);
+            e->id = ids != NULL ? ids[n_requested + i] : 0;
+            e->status = 0;
+        }
+        atomic_fetch_add(&state->n_pending, k);
+        size_t pushed = ring_push_many(&state->ready, indices, k);
+        assert(pushed == k);
+        (void) pushed;
+
+        n_requested += k;
+        if (k < want) {
+            break;
+        }
+    }
+
+    return n_requested;
+}
+
 /* Worker interface to output queue. On success, pops an entry from the
-   completed queue and returns a pointer to it. On failure (e.g., list empty),
-   NULL is returned. */
+   completed queue and returns a pointer to it. On failure (e.g., ring empty),
+   NULL is returned. The entry's STATUS must be checked; if negative, the file
+   couldn't be loaded, but the entry must still be released. */
 entry_t *
 async_try_get(wstate_t *state)
+{
+    return async_pop(state, &state->completed);
+}
+
+/* Worker interface to output queue, for a batch of entries. Pops up to N
+   entries from the completed ring, RING_BATCH at a time, writing pointers to
+   them to ENTRIES. Returns the number popped, which is zero if the ring is
+   empty. As with ASYNC_TRY_GET, each entry's STATUS must be checked. */
+size_t
+async_try_get_many(wstate_t *state, entry_t **entries, size_t n)
+{
+    size_t n_popped = 0;
+    while (n_popped < n) {
+        size_t indices[RING_BATCH];
+        size_t want = n - n_popped < RING_BATCH ? n - n_popped : RING_BATCH;
+        size_t k = ring_pop_many(&state->completed, indices, want);
+        for (size_t i = 0; i < k; i++) {
+            entries[n_popped + i] = &state->queue[indices[i]];
+        }
+
+        n_popped += k;
+        if (k < want) {
+            break;
+        }
+    }
+
+    return n_popped;
+}
+
+/* Wait for STATE's completed ring to hold an entry, without popping it. The
+   ring is checked SPIN times before sleeping on STATE's completion futex until
+   the responder wakes it, or until DEADLINE (CLOCK_MONOTONIC) if non-NULL. On
+   success, returns 0. On failure, returns -ETIMEDOUT if DEADLINE passed, or
+   -EINTR if interrupted by a signal. */
+int
+async_wait(wstate_t *state, size_t spin, const struct timespec *deadline)
+{
+    for (size_t i = 0; i < spin; i++) {
+        if (!ring_empty(&state->completed)) {
+            return 0;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    /* Announce ourselves before reading the counter, so that the responder
+       either sees us and wakes us, or pushed before we check the ring. */
+    int status = 0;
+    atomic_fetch_add(&state->n_waiters, 1);
+    while (true) {
+        uint32_t completions = atomic_load(&state->completions);
+        if (!ring_empty(&state->completed)) {
+            break;
+        }
+
+        /* Memory is shared between processes, so the futex can't be private.
+           FUTEX_WAIT_BITSET takes an absolute timeout. */
+        if (syscall(SYS_futex,
+                    &state->completions,
+                    FUTEX_WAIT_BITSET,
+                    completions,
+                    deadline,
+                    NULL,
+                    FUTEX_BITSET_MATCH_ANY) < 0 &&
+            errno != EAGAIN) {
+            status = -errno;
+            break;
+        }
+    }
+    atomic_fetch_sub(&state->n_waiters, 1);
+
+    return status;
+}
+
+/* Blocking version of ASYNC_TRY_GET, waiting as ASYNC_WAIT does. Returns NULL
+   if DEADLINE passes (or a signal arrives) first. Only one thread may wait on
+   STATE at a time, unless the loader has ASYNC_THREADED_WORKERS set. */
+entry_t *
+async_wait_get(wstate_t *state, size_t spin, const struct timespec *deadline)
 {
     entry_t *e;
+    while ((e = async_try_get(state)) == NULL) {
+        if (async_wait(state, spin, deadline) < 0) {
+            return NULL;
+        }
+    }
+
+    return e;
+}
+
+/* Arm STATE's event fd, so that the responder signals it when it next completes
+   an entry for STATE. Returns true if armed. Returns false if completed entries
+   are already waiting, for which the fd may never be signalled. The fd is
+   only signalled when armed, so that completions cost no system calls while
+   workers keep up without waiting. Signals may be spurious (e.g., an earlier
+   completion may take the signal meant for the next), so callers must check
+   for completed entries after each, and re-arm if there are none. */
+bool
+async_arm(wstate_t *state)
+{
+    /* Arm before checking the ring, so that the responder either sees us armed,
+       or pushed before we check. */
+    atomic_store(&state->armed, 1);
+    atomic_thread_fence(memory_order_seq_cst);
 
-    /* Try to get an entry from the completed list. Return NULL if empty. This
-       read is racy, but the only goal is to prevent hogging the lock when the
-       list is empty. */
-    if (state->completed != NULL) {
-        e = fifo_pop(&state->completed, &state->completed_lock);
-        /* Acquire shm object and mmap it so data may be accessed. */
-        e->shm_wfd = shm_open(e->shm_fp, O_RDWR, S_IRUSR | S_IWUSR);
-        assert(e->shm_wfd >= 0);
-        e->shm_wdata = mmap(NULL, e->size, PROT_WRITE, MAP_SHARED, e->shm_wfd, 0);
-        assert(e->shm_wdata != NULL);
+    return ring_empty(&state->completed);
+}
 
-        return e;
+/* Reset STATE's event fd after it has been signalled. */
+void
+async_drain(wstate_t *state)
+{
+    uint64_t count;
+    if (read(state->event_fd, &count, sizeof(count)) < 0) {
+        /* Not signalled; nothing to drain. */
+        assert(errno == EAGAIN);
     }
-    
-    return NULL;
+}
+
+/* Returns a pointer to the data loaded for E. The data arena and inline areas
+   are mapped once, before workers are created, so this is only a translation;
+   no memory is mapped or unmapped per entry. */
+uint8_t *
+async_data(entry_t *e)
+{
+    if (e->inlined) {
+        return e->worker->inline_data +
+               (e - e->worker->queue) * e->worker->loader->inline_size;
+    }
+
+    return e->worker->loader->arena + e->offset;
 }
 
 /* Marks an entry in the output queue as complete (reclaimable). Pending flag
@@ -148,13 +347,144 @@ async_try_get(wstate_t *state)
 void
 async_release(entry_t *e)
 {
-    /* Unlink the shm object, and unmap the worker-side mmap. */
-    shm_unlink(e->shm_fp);
-    close(e->shm_wfd);
-    munmap(e->shm_wdata, e->size);
+    async_release_many(&e, 1);
+}
+
+/* Return E's block of LD's arena to its allocator, if E holds one. */
+static void
+async_free_block(lstate_t *ld, entry_t *e)
+{
+    if (ld->buddy != NULL && e->offset != ASYNC_NO_BLOCK) {
+        buddy_free(ld->buddy, ld->arena + e->offset);
+        e->offset = ASYNC_NO_BLOCK;
+    }
+}
 
-    /* Insert into the free list. */
-    fifo_push(&e->worker->free, &e->worker->free_lock, e);
+/* Release the N entries in ENTRIES, which must all belong to the same worker,
+   returning them to its free ring RING_BATCH at a time. */
+void
+async_release_many(entry_t **entries, size_t n)
+{
+    if (n == 0) {
+        return;
+    }
+
+    wstate_t *state = entries[0]->worker;
+    for (size_t done = 0; done < n; ) {
+        size_t indices[RING_BATCH];
+        size_t k = n - done < RING_BATCH ? n - done : RING_BATCH;
+        for (size_t i = 0; i < k; i++) {
+            entry_t *e = entries[done + i];
+            assert(e->worker == state);
+
+            /* Return the entry's block to the arena's allocator. Fixed slots
+               and inline areas stay with their entry. */
+            async_free_block(state->loader, e);
+            indices[i] = e - state->queue;
+        }
+
+        /* Insert into the free ring. */
+        size_t pushed = ring_push_many(&state->free, indices, k);
+        assert(pushed == k);
+        (void) pushed;
+        done += k;
+    }
+}
+
+/* Reclaim STATE, a worker no longer used by any process (e.g., because its
+   process exited), returning all of its entries to its free ring, and any
+   arena blocks they hold to the arena. Must wait for every request it made to
+   complete. Returns 0 once the worker has been reclaimed, and -EBUSY if its
+   requests are still outstanding. */
+int
+async_reclaim(wstate_t *state)
+{
+    if (atomic_load(&state->n_pending) > 0) {
+        return -EBUSY;
+    }
+
+    /* Entries in neither ring were taken by the worker, and never released.
+       Released entries gave their blocks back, so every entry's block (if it
+       still holds one) can be returned, and all of them freed, RING_BATCH at a
+       time. */
+    lstate_t *ld = state->loader;
+    size_t indices[RING_BATCH];
+    size_t k;
+    while (ring_pop_many(&state->completed, indices, RING_BATCH) > 0) {}
+    while ((k = ring_pop_many(&state->free, indices, RING_BATCH)) > 0) {
+        for (size_t i = 0; i < k; i++) {
+            assert(ld->buddy == NULL || state->queue[indices[i]].offset == ASYNC_NO_BLOCK);
+        }
+    }
+    for (size_t i = 0; i < state->capacity; i += k) {
+        k = state->capacity - i < RING_BATCH ? state->capacity - i : RING_BATCH;
+        for (size_t j = 0; j < k; j++) {
+            async_free_block(ld, &state->queue[i + j]);
+            indices[j] = i + j;
+        }
+        size_t pushed = ring_push_many(&state->free, indices, k);
+        assert(pushed == k);
+        (void) pushed;
+    }
+
+    return 0;
+}
+
+/* Binds the calling thread to the CPUs of STATE's NUMA node, and has memory it
+   allocates come from that node where possible. Does nothing if STATE hasn't
+   been placed on a node. On success, returns 0. On failure, returns negative
+   ERRNO value. */
+int
+async_worker_bind(wstate_t *state)
+{
+    if (state->node < 0) {
+        return 0;
+    }
+
+    /* Parse the node's CPU list (e.g., "0-3,8-11"). */
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", state->node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -errno;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    unsigned int lo, hi;
+    while (fscanf(f, "%u", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &hi) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (unsigned int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    if (CPU_COUNT(&cpus) == 0) {
+        return -ENODEV;
+    }
+
+    /* Bind. */
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        return -errno;
+    }
+    unsigned long nodemask = 1UL << state->node;
+    if (syscall(SYS_set_mempolicy,
+                MPOL_PREFERRED,
+                &nodemask,
+                8 * sizeof(nodemask) + 1) < 0) {
+        return -errno;
+    }
+
+    return 0;
 }
 
 
@@ -162,18 +492,17 @@ async_release(entry_t *e)
 /*   BACKEND   */
 /* ----------- */
 
-/* On success, returns the size of a file in bytes. On failure, returns negative
-   ERRNO value. */
+/* On success, returns the size of a file in bytes, having stat'd it into ST.
+   On failure, returns negative ERRNO value. */
 static off_t
-file_get_size(int fd)
+file_get_size(int fd, struct stat *st)
 {
-    struct stat st;
-    if (fstat(fd, &st) < 0) {
+    if (fstat(fd, st) < 0) {
         return -errno;
     }
 
     /* Check device type. */
-    if (S_ISBLK(st.st_mode)) {
+    if (S_ISBLK(st->st_mode)) {
         /* Block device. */
         uint64_t bytes;
         if (ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
@@ -181,17 +510,19 @@ file_get_size(int fd)
         }
         
         return bytes;
-    } else if (S_ISREG(st.st_mode)) {
-        return st.st_size;
+    } else if (S_ISREG(st->st_mode)) {
+        return st->st_size;
     }
     
     /* Unknown device type. */
     return -1;
 }
 
-/* Get the logical block address for the first exent of the given FD. */
-static uint64_t
-file_get_lba(int fd)
+/* Get the logical block address for the first exent of the given FD, into
+   LBA. On success, returns 0. On failure (e.g., on tmpfs or overlayfs, which
+   don't map extents), returns negative ERRNO value. */
+static int
+file_get_lba(int fd, uint64_t *lba)
 {
     /* Get fiemap with first extent. */
     uint8_t stack_mem[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
@@ -200,263 +531,1236 @@ file_get_lba(int fd)
     fiemap->fm_length = ~0;
     fiemap->fm_extent_count = 1;
     if (ioctl(fd, FS_IOC_FIEMAP, fiemap) < 0) {
-        fprintf(stderr, "ioctl failed (fd = %d); %s\n", fd, strerror(errno));
-    } else {
-        return fiemap->fm_extents[0].fe_physical;
+        return -errno;
     }
+    *lba = fiemap->fm_mapped_extents > 0 ? fiemap->fm_extents[0].fe_physical : 0;
 
     return 0;
 }
 
-/* Submits an AIO for the file at PATH, allocating an shm object of equal size
-   to the file for the data to be read into. Assumes FD is already valid. On
-   success, returns 0. On failure, returns negative ERRNO value. 
-   */
+/* Whether DEV is a rotational disk, as its request queue's attribute in sysfs
+   says; a partition has its disk's. Returns 1 if so, 0 if not, or negative
+   ERRNO value if DEV has no queue (e.g., isn't a block device). */
 static int
-async_perform_io(lstate_t *ld, entry_t *e)
+device_rotational(dev_t dev)
 {
-    /* Unmap any previous mmap. */
-    if (e->shm_lmapped) {
-        munmap(e->shm_ldata, e->size);
-        close(e->shm_lfd);
-        e->shm_lmapped = false;
+    const char *formats[] = {
+        "/sys/dev/block/%u:%u/queue/rotational",
+        "/sys/dev/block/%u:%u/../queue/rotational",
+    };
+    int fd = -1;
+    for (size_t i = 0; i < 2 && fd < 0; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), formats[i], major(dev), minor(dev));
+        fd = open(path, O_RDONLY);
+    }
+    if (fd < 0) {
+        return -errno;
     }
 
-    /* Get the file's size. */
-    off_t size = file_get_size(e->fd);
-    if (size < 0) {
-        return (int) size;
+    char c = '0';
+    int status = read(fd, &c, 1) < 0 ? -errno : c == '1';
+    close(fd);
+
+    return status;
+}
+
+/* Whether RD sorts requests for files on DEV before issuing them (by LBA, or
+   by inode if opened through its ring), rather than issuing each as soon as
+   it's opened. Sorting pays off only on rotational disks whose files' extents
+   can be mapped (tried on FD, unless negative); on solid state drives, tmpfs
+   and the like, it only delays IO. Decided at the first file seen on each
+   device, and cached. If sorted, and FD isn't negative, also gets the LBA of
+   FD's first extent into LBA (0 if it can't be mapped), so that the file used
+   to decide isn't mapped twice. */
+static bool
+async_device_sorted(rstate_t *rd, dev_t dev, int fd, uint64_t *lba)
+{
+    bool sorted = rd->loader->always_sort;
+    bool known = sorted;
+    size_t n = rd->n_devices < ASYNC_MAX_DEVICES ? rd->n_devices : ASYNC_MAX_DEVICES;
+    for (size_t i = 0; i < n && !known; i++) {
+        if (rd->devices[i].dev == dev) {
+            sorted = rd->devices[i].sorted;
+            known = true;
+        }
+    }
+    if (!known) {
+        sorted = device_rotational(dev) == 1;
     }
-    e->size = (((size_t) size) | 0xFFF) + 1;
 
-    /* Prepare the filepath according to shm requirements. */
-    e->shm_fp[0] = '/';
-    for (int i = 0; i < MAX_PATH_LEN + 1; i++) {
-        /* Replace all occurences of '/' with '_'. */
-        e->shm_fp[i + 1] = e->path[i] == '/' ? '_' : e->path[i];
-        if (e->path[i] == '\0') {
-            break;
+    int status;
+    if (sorted && fd >= 0 && (status = file_get_lba(fd, lba)) < 0) {
+        *lba = 0;
+        if (!known) {
+            fprintf(stderr,
+                    "can't map extents on device %u:%u; %s; issuing its IO unsorted.\n",
+                    major(dev),
+                    minor(dev),
+                    strerror(-status));
+            sorted = false;
         }
     }
 
-    /* Allocate shm object. It will be the responsibility of the worker to call
-       ASYNC_RELEASE in order to unlink this shm object. */
-    e->shm_lfd = shm_open(e->shm_fp, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (e->shm_lfd < 0) {
-        fprintf(stderr, "failed to shm_open %s\n", e->shm_fp);
-        return -errno;
+    if (!known) {
+        device_policy_t *policy = &rd->devices[rd->n_devices++ % ASYNC_MAX_DEVICES];
+        policy->dev = dev;
+        policy->sorted = sorted;
     }
 
-    /* Appropriately size the shm object. */
-    if (ftruncate(e->shm_lfd, e->size) < 0) {
-        shm_unlink(e->shm_fp);
-        close(e->shm_lfd);
-        return -errno;
+    return sorted;
+}
+
+/* Associate SQE with E, as a CQE of KIND. */
+static void
+async_sqe_set_entry(struct io_uring_sqe *sqe, entry_t *e, cqe_kind_t kind)
+{
+    io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) e | kind));
+}
+
+/* SQEs each entry in flight may have unreaped at once; its read (or a no-op),
+   and closing its direct descriptor, or opening and stat'ing its file. */
+static size_t
+async_sqes_per_entry(lstate_t *ld)
+{
+    return ld->uring_open ? 2 : 1;
+}
+
+/* Number of SQEs RD may prepare before the IO it has in flight (whose CQEs its
+   responder hasn't yet reaped) reaches the loader's MAX_INFLIGHT entries. */
+static size_t
+async_sq_room(rstate_t *rd)
+{
+    size_t in_flight = rd->n_sqes - atomic_load(&rd->n_cqes);
+    size_t max_sqes = rd->loader->max_inflight * async_sqes_per_entry(rd->loader);
+
+    return in_flight < max_sqes ? max_sqes - in_flight : 0;
+}
+
+/* Get an SQE from RD's ring, counting it as in flight until its CQE is reaped.
+   The reader only prepares SQEs there's room for, so the ring has a free one;
+   but with a kernel poller, it may not have consumed earlier SQEs yet, and so
+   those are submitted until it has. */
+static struct io_uring_sqe *
+async_get_sqe(rstate_t *rd)
+{
+    struct io_uring_sqe *sqe;
+    while ((sqe = io_uring_get_sqe(&rd->ring)) == NULL) {
+        io_uring_submit(&rd->ring);
     }
+    rd->n_sqes++;
 
-    /* Create mmap for the shm object. */
-    e->shm_ldata = mmap(NULL, e->size, PROT_WRITE, MAP_SHARED, e->shm_lfd, 0);
-    if (e->shm_ldata == NULL) {
-        shm_unlink(e->shm_fp);
-        close(e->shm_lfd);
-        return -ENOMEM;
+    return sqe;
+}
+
+/* Finish preparing SQE, reading E's file, which was prepared with E's FD. If
+   the file was opened through RD's ring, it's read through its direct
+   descriptor instead, and then closed by a hard-linked SQE, which runs even if
+   the read fails. */
+static void
+async_prep_file(rstate_t *rd, entry_t *e, struct io_uring_sqe *sqe)
+{
+    if (!rd->loader->uring_open) {
+        async_sqe_set_entry(sqe, e, CQE_READ);
+        return;
     }
-    e->shm_lmapped = true;
 
-    /* Create and submit the uring AIO request. */
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ld->ring);
-    io_uring_prep_read(sqe, e->fd, e->shm_ldata, e->size, 0);
-    io_uring_sqe_set_data(sqe, e);  /* Associate request with this entry. */
+    unsigned slot = (unsigned) async_entry_index(rd->loader, e);
+    sqe->fd = (int) slot;
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+    async_sqe_set_entry(sqe, e, CQE_READ_LINKED);
+
+    sqe = async_get_sqe(rd);
+    io_uring_prep_close_direct(sqe, slot);
+    async_sqe_set_entry(sqe, e, CQE_DONE);
+}
+
+/* Submits an AIO for the file at PATH to RD's ring, reading it into the
+   entry's inline area if it fits, and otherwise into the entry's slot in the
+   data arena, or into a block allocated from the arena. Assumes FD is already
+   valid, and FILE_SIZE set. On success, returns 0. On failure, returns negative ERRNO value. 
+   */
+static int
+async_perform_io(rstate_t *rd, entry_t *e)
+{
+    lstate_t *ld = rd->loader;
+
+    /* The file was stat'd when it was opened. */
+    off_t size = (off_t) e->file_size;
+    e->size = size == 0 ? 0x1000 : ((((size_t) size) - 1) | 0xFFF) + 1;
+
+    /* Find somewhere to put the data. */
+    if (ld->max_file_size > 0 && (size_t) size > ld->max_file_size) {
+        return -EFBIG;
+    }
+    e->inlined = e->size <= ld->inline_size;
+    if (e->inlined) {
+        /* Read straight into the entry's inline area. */
+        struct io_uring_sqe *sqe = async_get_sqe(rd);
+        io_uring_prep_read(sqe, e->fd, async_data(e), e->size, 0);
+        async_prep_file(rd, e, sqe);
+
+        return 0;
+    } else if (ld->buddy != NULL) {
+        /* Files larger than any block would otherwise wait for room forever. */
+        if (e->size > buddy_max_block(ld->buddy)) {
+            return -EFBIG;
+        }
+        uint8_t *block;
+        if ((block = buddy_alloc(ld->buddy, size)) == NULL) {
+            return -ENOMEM;
+        }
+        e->offset = block - ld->arena;
+    } else if (e->size > ld->slot_size) {
+        return -EFBIG;
+    }
+
+    /* Create and submit the uring AIO request. Reads into registered buffers
+       avoid pinning the pages for each IO, but can't span two buffers. */
+    struct io_uring_sqe *sqe = async_get_sqe(rd);
+    if (ld->fixed_buffers &&
+        e->offset / FIXED_BUFFER_MAX ==
+        (e->offset + e->size - 1) / FIXED_BUFFER_MAX) {
+        io_uring_prep_read_fixed(sqe,
+                                 e->fd,
+                                 ld->arena + e->offset,
+                                 e->size,
+                                 0,
+                                 e->offset / FIXED_BUFFER_MAX);
+    } else {
+        io_uring_prep_read(sqe, e->fd, ld->arena + e->offset, e->size, 0);
+    }
+    async_prep_file(rd, e, sqe);
 
     return 0;
 }
 
+/* Fail the request in E with STATUS (a negative ERRNO value), without reading
+   anything. The entry is passed to RD's responder through its ring as a no-op
+   (or by closing its direct descriptor), so that responders remain the only
+   threads which complete entries. */
+static void
+async_fail(rstate_t *rd, entry_t *e, int status)
+{
+    fprintf(stderr,
+            "reader failed to issue IO; %s; %s.\n",
+            e->path,
+            strerror(-status));
+    if (e->fd >= 0) {
+        close(e->fd);
+        e->fd = -1;
+    }
+    e->status = status;
+    e->size = 0;
+    e->file_size = 0;
+    e->inlined = false;
+
+    /* A direct descriptor is closed instead of the no-op. */
+    lstate_t *ld = rd->loader;
+    struct io_uring_sqe *sqe = async_get_sqe(rd);
+    size_t index = async_entry_index(ld, e);
+    if (ld->uring_open && ld->opens[index].open_res >= 0) {
+        io_uring_prep_close_direct(sqe, (unsigned) index);
+    } else {
+        io_uring_prep_nop(sqe);
+    }
+    async_sqe_set_entry(sqe, e, CQE_DONE);
+}
+
+/* Issue E's IO without sorting it, to be submitted with RD's next batch,
+   leaving RESERVE SQEs of room under MAX_INFLIGHT. If there's not enough room,
+   or in the arena, it's queued to be sorted (ahead of the others) instead, and
+   retried with them. */
+static void
+async_issue(rstate_t *rd, entry_t *e, size_t reserve)
+{
+    lstate_t *ld = rd->loader;
+    bool room = async_sq_room(rd) >= async_sqes_per_entry(ld) + reserve;
+    int status = room ? async_perform_io(rd, e) : 0;
+    if (!room || (status == -ENOMEM && ld->buddy != NULL)) {
+        sort_wrapper_t *w = rd->sortable[rd->n_queued++];
+        w->data = (void *) e;
+        w->key = 0;
+        return;
+    } else if (status < 0) {
+        async_fail(rd, e, status);
+    }
+    rd->n_unsubmitted++;
+}
+
+/* Tell RD's responder to exit, once all IO submitted so far has completed, by
+   submitting a drained no-op without an entry. */
+static void
+async_stop_responder(rstate_t *rd)
+{
+    struct io_uring_sqe *sqe = async_get_sqe(rd);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, NULL);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_DRAIN);
+    io_uring_submit(&rd->ring);
+}
+
+/* Pop a ready request for RD, or return NULL if none was found. RD's own
+   workers are visited round-robin, one per call, from position *NEXT. Once a
+   whole pass over them finds nothing (counted by *MISSES), one other worker
+   is visited instead, from position *VICTIM, to steal its request. */
+static entry_t *
+async_reader_pop(rstate_t *rd, size_t *next, size_t *victim, size_t *misses)
+{
+    lstate_t *ld = rd->loader;
+    size_t n_own = (ld->n_states - rd->id + ld->n_readers - 1) / ld->n_readers;
+
+    wstate_t *st;
+    if (*misses < n_own) {
+        st = &ld->states[rd->id + (*next)++ % n_own * ld->n_readers];
+    } else {
+        st = &ld->states[(*victim)++ % ld->n_states];
+        *misses = 0;
+    }
+
+    entry_t *e = async_pop(st, &st->ready);
+    *misses = e == NULL ? *misses + 1 : 0;
+
+    return e;
+}
+
+/* Open E's file through RD's ring, as a direct descriptor, and get its size.
+   Neither blocks the reader. Once both complete, the responder passes E back
+   through RD's OPENED ring. Submitted with the next batch. */
+static void
+async_open(rstate_t *rd, entry_t *e)
+{
+    lstate_t *ld = rd->loader;
+    size_t index = async_entry_index(ld, e);
+    open_state_t *op = &ld->opens[index];
+    op->open_res = 0;
+    op->stx_res = 0;
+    op->n_pending = 2;
+
+    struct io_uring_sqe *sqe = async_get_sqe(rd);
+    io_uring_prep_openat_direct(sqe, AT_FDCWD, e->path, ld->oflags, 0, (unsigned) index);
+    async_sqe_set_entry(sqe, e, CQE_OPEN);
+
+    sqe = async_get_sqe(rd);
+    io_uring_prep_statx(sqe, AT_FDCWD, e->path, 0, STATX_TYPE | STATX_SIZE | STATX_INO, &op->stx);
+    async_sqe_set_entry(sqe, e, CQE_STATX);
+
+    rd->n_opening++;
+    rd->n_unsubmitted++;
+}
+
+/* Record RES, the result of opening (or stat'ing) E's file, as KIND. Once both
+   have completed, pass E back to RD's reader. Run by the responder. */
+static void
+async_opened(rstate_t *rd, entry_t *e, cqe_kind_t kind, int res)
+{
+    size_t index = async_entry_index(rd->loader, e);
+    open_state_t *op = &rd->loader->opens[index];
+    if (kind == CQE_OPEN) {
+        op->open_res = res < 0 ? res : 0;
+    } else {
+        op->stx_res = res;
+    }
+    if (--op->n_pending == 0) {
+        bool pushed = ring_push(&rd->opened, index);
+        assert(pushed);
+        (void) pushed;
+    }
+}
+
+/* Issue (or queue) the entries whose files RD's responder has finished
+   opening, as files opened by the reader are; those queued are sorted by
+   inode number, as the blocks of their data can't be found without blocking.
+   No more are taken than there's room under MAX_INFLIGHT to fail. Returns the
+   number of entries taken. */
+static size_t
+async_reader_opened(rstate_t *rd)
+{
+    lstate_t *ld = rd->loader;
+    size_t indices[64];
+    size_t room = async_sq_room(rd);
+    size_t n = ring_pop_many(&rd->opened, indices, room < 64 ? room : 64);
+    bool submit = false;
+    for (size_t i = 0; i < n; i++) {
+        entry_t *e = async_entry_at(ld, indices[i]);
+        open_state_t *op = &ld->opens[indices[i]];
+        rd->n_opening--;
+
+        int status = op->open_res < 0 ? op->open_res : op->stx_res;
+        if (status == 0 && !S_ISREG(op->stx.stx_mode)) {
+            status = -EINVAL;
+        }
+        if (status < 0) {
+            async_fail(rd, e, status);
+            submit = true;
+            continue;
+        }
+        e->file_size = op->stx.stx_size;
+        if (!async_device_sorted(rd, makedev(op->stx.stx_dev_major, op->stx.stx_dev_minor), -1, NULL)) {
+            async_issue(rd, e, n - i - 1);
+            submit = true;
+            continue;
+        }
+
+        sort_wrapper_t *w = rd->sortable[rd->n_queued++];
+        w->data = (void *) e;
+        w->key = op->stx.stx_ino;
+    }
+    if (submit) {
+        io_uring_submit(&rd->ring);
+        rd->n_unsubmitted = 0;
+    }
+
+    return n;
+}
+
 /* Loop for reader thread. */
 static void *
 async_reader_loop(void *arg)
 {
-    lstate_t *ld = (lstate_t *) arg;
+    rstate_t *rd = (rstate_t *) arg;
+    lstate_t *ld = rd->loader;
 
-    /* Loop through the outer states array round-robin style, issuing one IO per
+    /* Loop through this reader's workers round-robin style, issuing one IO per
        visit to each worker's queue, if that queue has a valid request. */
-    size_t i = 0;
+    size_t next = 0, victim = rd->id + 1, misses = 0;
     entry_t *e = NULL;
     while (true) {
         /* Check if we need to submit to io_uring. We submit when we've either
            filled the LBA sorting queue, or when we've not received any new
            requests in a while; if we've had [MAX_IDLE_ITERS * N_STATES]
            iterations without finding any new requests, then we submit the IO we
-           currently have. */
-        if (ld->n_queued == ld->dispatch_n ||
-            ld->idle_iters > (ld->max_idle_iters * ld->n_states)) {
+           currently have. Everything queued is also submitted before stopping.
+           Either way, only as much is issued as fits under MAX_INFLIGHT, which
+           is topped up in batches (of up to half of it) rather than an entry
+           at a time, so that the queue isn't sorted for each completion. */
+        bool stopping = atomic_load_explicit(&ld->stopping, memory_order_relaxed);
+        size_t per_entry = async_sqes_per_entry(ld);
+        size_t batch = rd->n_queued < ld->dispatch_n ? rd->n_queued : ld->dispatch_n;
+        batch = batch < ld->max_inflight / 2 ? batch : ld->max_inflight / 2;
+        if ((rd->n_queued >= ld->dispatch_n ||
+             rd->idle_iters > (ld->max_idle_iters * ld->n_states) ||
+             (stopping && rd->n_queued > 0)) &&
+            async_sq_room(rd) >= (batch > 0 ? batch : 1) * per_entry) {
 
             /* Sort the request queue by LBA. */
-            sort(ld->sortable, ld->n_queued);
-
-            /* Issue IO for each queued request. */
-            for (size_t i = 0; i < ld->n_queued; i++) {
-                e = (entry_t *) ld->sortable[i]->data;
-
-                int status = async_perform_io(ld, e);
-                if (status < 0) {
-                    fprintf(stderr,
-                            "reader failed to issue IO; %s; %s; %s.\n",
-                            e->path,
-                            e->shm_fp,
-                            strerror(-status));
-                    close(e->fd);
-                    fifo_push(&e->worker->ready, &e->worker->ready_lock, e);
+            sort(rd->sortable, rd->n_queued);
+
+            /* Issue IO for each queued request. Requests which don't fit in
+               the arena right now, or beyond MAX_INFLIGHT, are kept (in order)
+               at the front of the queue, to retry in the next submission once
+               entries have been released or completed. */
+            size_t n_deferred = 0;
+            for (size_t i = 0; i < rd->n_queued; i++) {
+                sort_wrapper_t *w = rd->sortable[i];
+                e = (entry_t *) w->data;
+
+                bool room = async_sq_room(rd) >= per_entry;
+                int status = room ? async_perform_io(rd, e) : 0;
+                if (!room || (status == -ENOMEM && ld->buddy != NULL)) {
+                    rd->sortable[i] = rd->sortable[n_deferred];
+                    rd->sortable[n_deferred++] = w;
+                } else if (status < 0) {
+                    async_fail(rd, e, status);
                 }
             }
 
             /* Explicitly tell io_uring to begin processing. */
-            io_uring_submit(&ld->ring);
+            io_uring_submit(&rd->ring);
+            rd->n_unsubmitted = 0;
 
             /* Reset submission requirements. */
-            ld->idle_iters = 0;
-            ld->n_queued = 0;
+            rd->idle_iters = 0;
+            rd->n_queued = n_deferred;
         }
 
-        /* Pop an item from the ready list. Racy check to avoid hogging lock. */
-        wstate_t *st = &ld->states[i++ % ld->n_states];
-        if ((e = fifo_pop(&st->ready, &st->ready_lock)) == NULL) {
-            /* Increment the idle counter if the queue is not empty. */
-            if (ld->n_queued > 0) {
-                ld->idle_iters++;
+        /* Requests deferred for lack of arena space stay queued, for the next
+           time the loader is launched. Files still being opened are waited
+           for, and then issued, as are requests deferred while IO is in
+           flight. */
+        if (stopping && rd->n_opening == 0 &&
+            (rd->n_queued == 0 || rd->n_sqes == atomic_load(&rd->n_cqes))) {
+            break;
+        }
+
+        /* Take back files opened through the ring, to queue alongside the
+           others. */
+        if (rd->n_opening > 0 && async_reader_opened(rd) > 0) {
+            rd->idle_iters = 0;
+            continue;
+        }
+        if (stopping) {
+            if (rd->n_unsubmitted > 0) {
+                io_uring_submit(&rd->ring);
+                rd->n_unsubmitted = 0;
+            }
+            continue;
+        }
+
+        /* Pop an item from a ready ring. Files to be opened through the ring
+           are submitted in batches, once a pass finds nothing more (or the
+           batch would fill the LBA sorting queue). Requests are left in the
+           ready rings while those queued already are waiting for room under
+           MAX_INFLIGHT, or there's no room to open (or fail) them. */
+        if (rd->n_queued >= ld->dispatch_n || async_sq_room(rd) < per_entry ||
+            (e = async_reader_pop(rd, &next, &victim, &misses)) == NULL) {
+            if (rd->n_unsubmitted > 0) {
+                io_uring_submit(&rd->ring);
+                rd->n_unsubmitted = 0;
+            }
+
+            /* Increment the idle counter if the queue is not empty. Without
+               room for more IO, nothing can be done until the responder
+               reaps some; let it (and the workers) run. */
+            if (rd->n_queued > 0) {
+                rd->idle_iters++;
+            }
+            if (async_sq_room(rd) < per_entry) {
+                sched_yield();
+            }
+            continue;
+        }
+        rd->idle_iters = 0;
+
+        if (ld->uring_open) {
+            async_open(rd, e);
+            if (rd->n_unsubmitted >= ld->dispatch_n) {
+                io_uring_submit(&rd->ring);
+                rd->n_unsubmitted = 0;
             }
             continue;
         }
-        ld->idle_iters = 0;
         
-        /* Open file. */
-        if ((e->fd = open(e->path, st->loader->oflags)) < 0) {
-            fprintf(stderr, "failed to open %s\n", e->path);
-            fifo_push(&st->ready, &st->ready_lock, e);
+        /* Open and stat file. */
+        struct stat st;
+        off_t size = 0;
+        if ((e->fd = open(e->path, ld->oflags)) < 0 ||
+            (size = file_get_size(e->fd, &st)) < 0) {
+            async_fail(rd, e, e->fd < 0 ? -errno : (int) size);
+            io_uring_submit(&rd->ring);
             continue;
         };
-
-        /* Queue for next bulk submission. */
-        sort_wrapper_t *w = ld->sortable[ld->n_queued++];
+        e->file_size = (size_t) size;
+
+        /* Issue straight away, submitted in batches as opens through the ring
+           are, unless it's worth queueing for the next bulk submission to be
+           sorted by LBA. */
+        dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+        uint64_t lba = 0;
+        if (!async_device_sorted(rd, dev, e->fd, &lba)) {
+            async_issue(rd, e, 0);
+            if (rd->n_unsubmitted >= ld->dispatch_n) {
+                io_uring_submit(&rd->ring);
+                rd->n_unsubmitted = 0;
+            }
+            continue;
+        }
+        sort_wrapper_t *w = rd->sortable[rd->n_queued++];
         w->data = (void *) e;
-        w->key = file_get_lba(e->fd);
+        w->key = lba;
     }
 
+    async_stop_responder(rd);
+
     return NULL;
 }
 
-/* Loop for responder thread. */
-static void *
-async_responder_loop(void *arg)
+/* Record RES, the result of reading E's file, in E. Files on devices without
+   polled queues can't be read through a polled ring (with ASYNC_IOPOLL); they
+   are read here instead, by a blocking system call. */
+static void
+async_read_done(lstate_t *ld, entry_t *e, int res)
 {
-    lstate_t *ld = (lstate_t *) arg;
-
-    int cnt = 0;
+    if (res == -EOPNOTSUPP && (ld->ring_flags & IORING_SETUP_IOPOLL)) {
+        static _Atomic bool warned = false;
+        if (!atomic_exchange(&warned, true)) {
+            fprintf(stderr, "can't poll for reads of %s, using blocking reads\n", e->path);
+        }
+        ssize_t n_read = pread(e->fd, async_data(e), e->size, 0);
+        res = n_read < 0 ? -errno : (int) n_read;
+    }
 
-    struct io_uring_cqe *cqe;
-    while (true) {
-        /* Remove an entry from the completion queue. */
-        int status = io_uring_wait_cqe(&ld->ring, &cqe);
-        if (status < 0) {
-            continue;
-        } else if (cqe->res < 0) {
-            entry_t *e = io_uring_cqe_get_data(cqe);
+    if (e->status == 0 && res < 0) {
+        /* With ASYNC_URING_OPEN, the file was read through its fixed-file
+           slot, and E has no fd. */
+        if (ld->uring_open) {
             fprintf(stderr,
-                    "asynchronous read failed; %s (fd = %d (flags = 0x%x), shm_lfd = %d (flags = 0x%x), data @ %p (4K aligned? %d), size = 0x%lx (4K aligned? %d)).\n",
-                    strerror(-cqe->res),
+                    "asynchronous read failed; %s (fixed file %zu, data @ arena + 0x%lx (4K aligned? %d), size = 0x%lx (4K aligned? %d)).\n",
+                    strerror(-res),
+                    async_entry_index(ld, e),
+                    e->offset,
+                    e->offset % 4096 == 0,
+                    e->size,
+                    e->size % 4096 == 0);
+        } else {
+            fprintf(stderr,
+                    "asynchronous read failed; %s (fd = %d (flags = 0x%x), data @ arena + 0x%lx (4K aligned? %d), size = 0x%lx (4K aligned? %d)).\n",
+                    strerror(-res),
                     e->fd,
                     fcntl(e->fd, F_GETFD),
-                    e->shm_lfd,
-                    fcntl(e->shm_lfd, F_GETFD),
-                    e->shm_ldata,
-                    ((uint64_t) e->shm_ldata) % 4096 == 0,
+                    e->offset,
+                    e->offset % 4096 == 0,
                     e->size,
                     e->size % 4096 == 0);
-            if (cnt++ > 32) {
-                exit(EXIT_FAILURE);
+        }
+
+        /* Failed entries hold no block, nor inline data. */
+        async_free_block(ld, e);
+        e->status = res;
+        e->size = 0;
+        e->file_size = 0;
+        e->inlined = false;
+    } else if (e->status == 0 && (size_t) res < e->file_size) {
+        /* File was truncated since we checked its size. */
+        e->file_size = (size_t) res;
+    }
+}
+
+/* Wake STATE's worker if it's asleep waiting for a completed entry. */
+static void
+async_wake(wstate_t *state)
+{
+    if (atomic_load(&state->n_waiters) > 0) {
+        syscall(SYS_futex, &state->completions, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    if (atomic_exchange(&state->armed, 0) != 0) {
+        uint64_t one = 1;
+        if (write(state->event_fd, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "failed to signal worker; %s\n", strerror(errno));
+        }
+    }
+}
+
+/* Complete the N entries in DONE, which may belong to any workers; place each
+   worker's into its ring for entries with completed IO at once, and then wake
+   the worker if it's asleep waiting for one. Clears DONE. */
+static void
+async_complete_many(entry_t **done, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (done[i]->fd >= 0) {
+            close(done[i]->fd);
+            done[i]->fd = -1;
+        }
+    }
+
+    size_t indices[REAP_BATCH];
+    for (size_t i = 0; i < n; i++) {
+        if (done[i] == NULL) {
+            continue;
+        }
+
+        /* Gather the rest of this worker's entries. */
+        wstate_t *st = done[i]->worker;
+        size_t k = 0;
+        for (size_t j = i; j < n; j++) {
+            if (done[j] != NULL && done[j]->worker == st) {
+                indices[k++] = done[j] - st->queue;
+                done[j] = NULL;
             }
+        }
+
+        size_t pushed = ring_push_many(&st->completed, indices, k);
+        assert(pushed == k);
+        (void) pushed;
+        atomic_fetch_sub(&st->n_pending, k);
+        atomic_fetch_add(&st->completions, k);
+        async_wake(st);
+    }
+}
+
+/* Loop for responder thread. Each wakeup, reaps every CQE available (up to
+   REAP_BATCH), then publishes the entries they complete one batch per worker,
+   so that a worker's ring and wakeup are touched once for all of them. */
+static void *
+async_responder_loop(void *arg)
+{
+    rstate_t *rd = (rstate_t *) arg;
+    lstate_t *ld = rd->loader;
+
+    struct io_uring_cqe *cqes[REAP_BATCH];
+    entry_t *done[REAP_BATCH];
+    bool stopped = false;
+    while (!stopped) {
+        /* Wait for a CQE, then take it and all others already posted. */
+        int status = io_uring_wait_cqe(&rd->ring, &cqes[0]);
+        if (status < 0) {
             continue;
         }
+        unsigned n_cqes = io_uring_peek_batch_cqe(&rd->ring, cqes, REAP_BATCH);
+        rd->n_reaps++;
+
+        size_t n_done = 0;
+        for (unsigned i = 0; i < n_cqes; i++) {
+            /* Get the entry associated with the IO, and what completed.
+               Entries failed by the reader already have their status. The
+               reader sends no entry once it has stopped, after all others. */
+            uintptr_t data = (uintptr_t) io_uring_cqe_get_data(cqes[i]);
+            entry_t *e = (entry_t *) (data & ~(uintptr_t) (CACHE_LINE - 1));
+            cqe_kind_t kind = (cqe_kind_t) (data & (CACHE_LINE - 1));
+            int res = cqes[i]->res;
+            if (e == NULL) {
+                stopped = true;
+                continue;
+            }
 
-        /* Get the entry associated with the IO, and place it into the list for
-           entries with completed IO. */
-        entry_t *e = io_uring_cqe_get_data(cqe);
-        io_uring_cqe_seen(&ld->ring, cqe);
-        close(e->fd);
-        fifo_push(&e->worker->completed, &e->worker->completed_lock, e);
+            switch (kind) {
+            case CQE_OPEN:
+            case CQE_STATX:
+                async_opened(rd, e, kind, res);
+                break;
+            case CQE_READ:
+                async_read_done(ld, e, res);
+                done[n_done++] = e;
+                break;
+            case CQE_READ_LINKED:
+                async_read_done(ld, e, res);
+                break;
+            case CQE_DONE:
+                done[n_done++] = e;
+                break;
+            }
+        }
+        io_uring_cq_advance(&rd->ring, n_cqes);
+        atomic_fetch_add(&rd->n_cqes, n_cqes);
+
+        async_complete_many(done, n_done);
     }
 
     return NULL;
 }
 
+/* Close this process' copies of LOADER's workers' event fds, once the loader
+   is no longer needed here. The fds in the workers' states are left as they
+   are, as the other processes forked from the creator still use theirs. */
+void
+async_close_events(lstate_t *loader)
+{
+    for (size_t i = 0; i < loader->n_states; i++) {
+        if (loader->states[i].event_fd >= 0) {
+            close(loader->states[i].event_fd);
+        }
+    }
+}
+
 /* Given a loader, starts the reader and responder threads. Does not return. */
 void
 async_start(lstate_t *loader)
 {
-    /* Spawn the reader. */
-    pthread_t reader;
-    int status = pthread_create(&reader, NULL, async_reader_loop, loader);
+    int status = async_launch(loader);
     if (status < 0) {
         fprintf(stderr,
-                "failed to created reader thread; %s\n",
+                "failed to create loader threads; %s\n",
                 strerror(-status));
         assert(false);
     }
 
-    /* Become the responder. */
-    async_responder_loop(loader);
+    /* The threads never stop, so this never returns. */
+    pthread_join(loader->readers[0].responder, NULL);
 
     /* Never reached. */
     assert(false);
 }
 
-/* Initialize the loader. Allocates all shared memory. On success, initializes
-   LOADER and returns 0. On failure, returns negative ERRNO value. Each worker
-   is given of queue of depth QUEUE_DEPTH, and memory is dynamically allocated
-   when files are loaded. IO is only dispatched when a minimum of MIN_DISPATCH_N
-   IOs are ready to execute. OFLAGS are used with OPEN() as the open mode,
+/* Stop the first N_LAUNCHED of LOADER's readers, and their responders, which
+   must have been started by ASYNC_LAUNCH, waiting for them to exit. */
+static void
+async_join(lstate_t *loader, size_t n_launched)
+{
+    atomic_store(&loader->stopping, true);
+    for (size_t i = 0; i < n_launched; i++) {
+        pthread_join(loader->readers[i].reader, NULL);
+        pthread_join(loader->readers[i].responder, NULL);
+    }
+    atomic_store(&loader->stopping, false);
+}
+
+/* Given a loader, starts the reader and responder threads in the calling
+   process, and returns. They run until ASYNC_STOP is called. On success,
+   returns 0. On failure, returns negative ERRNO value. */
+int
+async_launch(lstate_t *loader)
+{
+    atomic_store(&loader->stopping, false);
+
+    for (size_t i = 0; i < loader->n_readers; i++) {
+        rstate_t *rd = &loader->readers[i];
+        int status = pthread_create(&rd->responder, NULL, async_responder_loop, rd);
+        if (status != 0) {
+            async_join(loader, i);
+            return -status;
+        }
+        status = pthread_create(&rd->reader, NULL, async_reader_loop, rd);
+        if (status != 0) {
+            /* Stop the responder as the reader would have. */
+            async_stop_responder(rd);
+            pthread_join(rd->responder, NULL);
+            async_join(loader, i);
+            return -status;
+        }
+    }
+
+    return 0;
+}
+
+/* Stops the threads started by ASYNC_LAUNCH, waiting for them to exit. The
+   requests the readers have already taken are issued first, and their IO
+   completed. Any others (including those deferred for lack of arena space)
+   are kept, and issued if the loader is launched again. */
+void
+async_stop(lstate_t *loader)
+{
+    async_join(loader, loader->n_readers);
+}
+
+/* Register LOADER's data arena with every reader's ring, as buffers of no more
+   than FIXED_BUFFER_MAX bytes. On success, returns 0. On failure (e.g., the
+   arena exceeds RLIMIT_MEMLOCK), returns negative ERRNO value, with the arena
+   registered with none of them. */
+static int
+async_register_arena(lstate_t *loader)
+{
+    size_t n_bufs = (loader->arena_size + FIXED_BUFFER_MAX - 1) / FIXED_BUFFER_MAX;
+    struct iovec *iovecs = malloc(n_bufs * sizeof(struct iovec));
+    if (iovecs == NULL) {
+        return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < n_bufs; i++) {
+        size_t off = i * FIXED_BUFFER_MAX;
+        size_t remaining = loader->arena_size - off;
+        iovecs[i].iov_base = loader->arena + off;
+        iovecs[i].iov_len = remaining < FIXED_BUFFER_MAX ? remaining : FIXED_BUFFER_MAX;
+    }
+    int status = 0;
+    for (size_t i = 0; i < loader->n_readers && status == 0; i++) {
+        status = io_uring_register_buffers(&loader->readers[i].ring, iovecs, n_bufs);
+        for (size_t j = 0; status < 0 && j < i; j++) {
+            io_uring_unregister_buffers(&loader->readers[j].ring);
+        }
+    }
+    free(iovecs);
+
+    return status;
+}
+
+/* Place worker ID's entries, and its part of the data arena, on NUMA node
+   NODE. If the arena is split into slots, the worker's slots are bound to
+   NODE. Blocks from an allocator can't be tied to a worker, so the arena is
+   instead interleaved over every node a worker has been placed on. Must be
+   called before LOADER's memory is shared with other processes (or pinned),
+   so that pages can be moved. On success, returns 0. On failure, returns
+   negative ERRNO value. */
+static int
+async_place_worker(lstate_t *loader, size_t id, int node)
+{
+    if (node < 0 || node >= MAX_NUMA_NODES) {
+        return -EINVAL;
+    }
+    wstate_t *state = &loader->states[id];
+    unsigned long nodemask = 1UL << node;
+
+    /* Entries, and their inline areas. */
+    int status = mmap_bind(state->queue,
+                           async_queue_bytes(state->capacity) +
+                           state->capacity * loader->inline_size,
+                           nodemask,
+                           false);
+    if (status < 0) {
+        return status;
+    }
+
+    /* Data. Hugetlb pages can only be placed whole, so a page shared with a
+       neighbouring worker's slots goes to whichever is placed last. */
+    if (loader->buddy != NULL) {
+        loader->arena_nodes |= nodemask;
+        status = mmap_bind(loader->arena,
+                           loader->arena_size,
+                           loader->arena_nodes,
+                           true);
+    } else {
+        size_t align = loader->arena_pages == PAGES_HUGETLB ? HUGE_PAGE_SIZE : 0x1000;
+        size_t start = state->queue[0].offset & ~(align - 1);
+        size_t end = state->queue[0].offset + state->capacity * loader->slot_size;
+        end = ((end - 1) | (align - 1)) + 1;
+        if (end > loader->arena_size) {
+            end = loader->arena_size;
+        }
+        status = mmap_bind(loader->arena + start, end - start, nodemask, false);
+    }
+    if (status < 0) {
+        return status;
+    }
+    state->node = node;
+
+    return 0;
+}
+
+/* Layout tag of named loaders' segments. Processes may only attach to loaders
+   created with the same version and struct layouts. */
+static uint64_t
+async_shm_tag(void)
+{
+    return ((uint64_t) ASYNC_SHM_VERSION << 48) |
+           ((uint64_t) sizeof(lstate_t) << 24) |
+           ((uint64_t) sizeof(wstate_t) << 8) |
+           (uint64_t) sizeof(entry_t);
+}
+
+/* Check that the kernel can open, stat and close files through LOADER's rings,
+   as direct descriptors, and give each ring a table of them, with a slot for
+   every entry. On success, returns 0. On failure, returns negative ERRNO value
+   (-EOPNOTSUPP if an operation is unsupported), with no tables registered. */
+static int
+async_register_files(lstate_t *loader)
+{
+    struct io_uring_probe *probe = io_uring_get_probe_ring(&loader->readers[0].ring);
+    if (probe == NULL) {
+        return -EOPNOTSUPP;
+    }
+    bool supported = io_uring_opcode_supported(probe, IORING_OP_OPENAT) &&
+                     io_uring_opcode_supported(probe, IORING_OP_STATX) &&
+                     io_uring_opcode_supported(probe, IORING_OP_CLOSE) &&
+                     io_uring_opcode_supported(probe, IORING_OP_READ);
+    io_uring_free_probe(probe);
+    if (!supported) {
+        return -EOPNOTSUPP;
+    }
+
+    /* Kernels with sparse tables (5.19) can also open direct descriptors into
+       given slots (5.15). */
+    int status = 0;
+    unsigned n_slots = (unsigned) (loader->n_states * loader->states[0].capacity);
+    for (size_t i = 0; i < loader->n_readers && status == 0; i++) {
+        status = io_uring_register_files_sparse(&loader->readers[i].ring, n_slots);
+        for (size_t j = 0; status < 0 && j < i; j++) {
+            io_uring_unregister_files(&loader->readers[j].ring);
+        }
+    }
+
+    return status;
+}
+
+/* Set up RD's ring, of ENTRIES entries, with the IORING_SETUP_* FLAGS. With
+   IORING_SETUP_SQPOLL, the ring's kernel poller is pinned to a CPU this process
+   may use; the readers' pollers take them in turn, from the last. */
+static int
+async_ring_init(rstate_t *rd, unsigned int entries, unsigned int flags)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    cpu_set_t cpus;
+    if ((flags & IORING_SETUP_SQPOLL) &&
+        sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        int n_cpus = CPU_COUNT(&cpus);
+        int skip = (int) (rd->id % n_cpus);
+        for (int cpu = CPU_SETSIZE - 1; cpu >= 0; cpu--) {
+            if (CPU_ISSET(cpu, &cpus) && skip-- == 0) {
+                params.flags |= IORING_SETUP_SQ_AFF;
+                params.sq_thread_cpu = cpu;
+                break;
+            }
+        }
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+
+    return io_uring_queue_init_params(entries, &rd->ring, &params);
+}
+
+/* Set up the rings of LOADER's readers, of ENTRIES entries each, with the
+   IORING_SETUP_* flags SETUP, or with none if the kernel rejects them. On
+   success, returns 0, with the flags used in LOADER's RING_FLAGS. On failure,
+   returns negative ERRNO value, with no rings set up. */
+static int
+async_init_rings(lstate_t *loader, unsigned int entries, unsigned int setup)
+{
+    for (size_t i = 0; i < loader->n_readers; i++) {
+        int status = async_ring_init(&loader->readers[i], entries, setup);
+        if (status < 0 && setup != 0 && i == 0) {
+            fprintf(stderr,
+                    "can't set up io_uring with flags 0x%x, using defaults; %s\n",
+                    setup,
+                    strerror(-status));
+            setup = 0;
+            status = async_ring_init(&loader->readers[i], entries, setup);
+        }
+        if (status < 0) {
+            fprintf(stderr, "io_uring_queue_init failed; %s\n", strerror(-status));
+            for (size_t j = 0; j < i; j++) {
+                io_uring_queue_exit(&loader->readers[j].ring);
+            }
+            return status;
+        }
+    }
+    loader->ring_flags = setup;
+
+    return 0;
+}
+
+/* Tear down the rings of LOADER's readers. */
+static void
+async_exit_rings(lstate_t *loader)
+{
+    for (size_t i = 0; i < loader->n_readers; i++) {
+        io_uring_queue_exit(&loader->readers[i].ring);
+    }
+}
+
+/* Unmap LOADER's memory, including LOADER itself, from this process, without
+   touching it; it remains mapped in any other processes. */
+static void
+async_unmap(lstate_t *loader)
+{
+    if (loader->name[0] != '\0') {
+        shm_detach(loader);
+        return;
+    }
+
+    mmap_free(loader->states, loader->total_size);
+    if (loader->buddy != NULL) {
+        buddy_destroy(loader->buddy);
+    } else if (loader->arena != NULL) {
+        mmap_free(loader->arena, loader->arena_size);
+    }
+    mmap_free(loader, sizeof(lstate_t));
+}
+
+/* Free the memory of LOADER, created by ASYNC_INIT, including LOADER itself.
+   A named loader's segment is removed. */
+static void
+async_free(lstate_t *loader)
+{
+    char name[SHM_NAME_MAX + 1];
+    strcpy(name, loader->name);
+    async_unmap(loader);
+    if (name[0] != '\0') {
+        shm_remove(name);
+    }
+}
+
+/* Allocate the memory for a loader named NAME (anonymous if NULL) with
+   STATE_BYTES of worker state, and a data arena of ARENA_SIZE bytes managed by
+   an allocator, or split into N_ENTRIES slots of SLOT_SIZE bytes if ARENA_SIZE
+   is zero. An anonymous loader's parts are allocated separately. A named
+   loader, and everything it points to, is instead carved out of a single named
+   segment, so that it can be attached to by any process. On success, returns
+   the zeroed loader, with its name, states, and arena set. On failure, returns
+   NULL, writing negative ERRNO value to STATUS. */
+static lstate_t *
+async_alloc(const char *name,
+            size_t state_bytes,
+            size_t arena_size,
+            size_t slot_size,
+            size_t n_entries,
+            bool huge,
+            int *status)
+{
+    lstate_t *loader;
+    *status = -ENOMEM;
+    if (name == NULL) {
+        if ((loader = mmap_alloc(sizeof(lstate_t))) == NULL) {
+            return NULL;
+        }
+        if ((loader->states = mmap_alloc(state_bytes)) == NULL) {
+            mmap_free(loader, sizeof(lstate_t));
+            return NULL;
+        }
+
+        /* Slots and blocks are kept 4K-aligned, so that they remain usable with
+           O_DIRECT. */
+        loader->arena_pages = PAGES_SMALL;
+        if (arena_size > 0) {
+            if ((loader->buddy = buddy_create(arena_size, 4096, huge)) == NULL) {
+                mmap_free(loader->states, state_bytes);
+                mmap_free(loader, sizeof(lstate_t));
+                return NULL;
+            }
+            loader->arena = loader->buddy->base;
+            loader->arena_size = loader->buddy->size;
+            loader->arena_pages = loader->buddy->pages;
+        } else {
+            loader->arena_size = slot_size * n_entries;
+            loader->arena = huge ? mmap_alloc_huge(&loader->arena_size,
+                                                   &loader->arena_pages)
+                                 : mmap_alloc(loader->arena_size);
+            if (loader->arena == NULL) {
+                mmap_free(loader->states, state_bytes);
+                mmap_free(loader, sizeof(lstate_t));
+                return NULL;
+            }
+        }
+
+        return loader;
+    }
+
+    /* Lay out the segment; the loader, worker states, allocator state, and
+       then the arena, which starts on a huge page if it's to use them. */
+    size_t arena_bytes = arena_size > 0 ? arena_size & ~0xFFFUL : slot_size * n_entries;
+    if (arena_bytes == 0) {
+        return NULL;
+    }
+    if (huge) {
+        arena_bytes = ((arena_bytes - 1) | (HUGE_PAGE_SIZE - 1)) + 1;
+    }
+    size_t buddy_bytes = arena_size > 0 ? PAGE_ROUND(buddy_state_size(arena_bytes, 4096)) : 0;
+    size_t arena_off = PAGE_ROUND(sizeof(lstate_t)) + state_bytes + buddy_bytes;
+    if (huge) {
+        arena_off = (((arena_off + SHM_HEADER_SIZE - 1) | (HUGE_PAGE_SIZE - 1)) + 1) - SHM_HEADER_SIZE;
+    }
+
+    void *mem;
+    if ((*status = shm_create(name, arena_off + arena_bytes, async_shm_tag(), &mem)) < 0) {
+        return NULL;
+    }
+    loader = mem;
+    strcpy(loader->name, name);
+    loader->states = (wstate_t *) ((uint8_t *) mem + PAGE_ROUND(sizeof(lstate_t)));
+    loader->arena = (uint8_t *) mem + arena_off;
+    loader->arena_size = arena_bytes;
+    loader->arena_pages = huge ? mmap_advise_huge(loader->arena, arena_bytes) : PAGES_SMALL;
+    mmap_populate(mem, arena_off + arena_bytes);
+    if (arena_size > 0) {
+        loader->buddy = buddy_init((uint8_t *) loader->states + state_bytes,
+                                   loader->arena,
+                                   arena_bytes,
+                                   4096);
+        loader->buddy->pages = loader->arena_pages;
+    }
+
+    return loader;
+}
+
+/* Initialize a loader, allocating it and all of its shared memory. On success,
+   writes the loader to LOADER and returns 0. On failure, returns negative ERRNO
+   value. Each worker is given of queue of depth QUEUE_DEPTH. If ARENA_SIZE is
+   non-zero, a single prefaulted data arena of ARENA_SIZE bytes is shared by all
+   entries; a block of it is allocated when a file is loaded, and freed when the
+   entry is released. Otherwise, if MAX_FILE_SIZE is non-zero, every entry is
+   given a fixed slot of at least MAX_FILE_SIZE bytes in a prefaulted data
+   arena. In both cases, files larger than MAX_FILE_SIZE (if non-zero) cannot be
+   loaded. One of the two must be non-zero. If INLINE_SIZE is non-zero, every
+   entry also has an inline area of INLINE_SIZE bytes (rounded up to 4K)
+   alongside it, and files which fit are read there instead, without using the
+   arena. If NAME is NULL, the loader's memory is anonymous, and is only shared
+   with processes forked after this returns; no named (e.g., /dev/shm) objects
+   are created, and nothing is left behind if a process is killed. Otherwise,
+   it's all kept in the named segment NAME, which other processes may attach
+   to with ASYNC_ATTACH, and which is removed by ASYNC_DESTROY. IO is only
+   dispatched when a minimum of MIN_DISPATCH_N IOs are ready to execute.
+   OFLAGS are used with OPEN() as the open mode,
    allowing use of O_DIRECT and other configurations. O_RDONLY is specified by
-   default, and so O_WRONLY must not be specified. */
+   default, and so O_WRONLY must not be specified. FLAGS is a bitmask of ASYNC_*
+   loader flags. If ASYNC_FIXED_BUFFERS is set and the loader has a data arena,
+   the arena is registered with io_uring so that reads use fixed buffers. If
+   registration fails, regular reads are used instead. If ASYNC_HUGEPAGES is
+   set, the data arena is backed by huge pages where possible, falling back to
+   regular pages otherwise (named loaders only use transparent huge pages). If
+   ASYNC_THREADED_WORKERS is set, workers may use their queues from several
+   threads at once. If NODES is non-NULL, it gives the NUMA node for each of the
+   N_WORKERS workers (or -1 to leave a worker unplaced), and each worker's
+   entries and data are placed on its node. IO is issued by N_READERS readers
+   (at least 1, and no more than N_WORKERS), each with a ring and responder of
+   its own, which open and sort the requests of their share of the workers,
+   and steal requests from the others' when they run out. Each reader has at
+   most MAX_INFLIGHT entries' IO in flight at once (all of them if 0, and no
+   more than its ring can hold), with the rest waiting in the workers' ready
+   rings, so that rings stay small however deep the queues. ASYNC_SQPOLL,
+   ASYNC_IOPOLL and ASYNC_COOP_TASKRUN select how the readers' rings are set up,
+   falling back to the defaults if the kernel rejects them. ASYNC_SQPOLL implies
+   ASYNC_URING_OPEN; ASYNC_IOPOLL requires O_DIRECT, without ASYNC_URING_OPEN.
+   Requests are only sorted for files on rotational disks, and otherwise issued
+   as soon as they're opened, unless ASYNC_ALWAYS_SORT is set. */
 int
-async_init(lstate_t *loader,
+async_init(lstate_t **loader_p,
+           const char *name,
            size_t queue_depth,
+           size_t max_file_size,
+           size_t arena_size,
+           size_t inline_size,
            size_t n_workers,
+           size_t n_readers,
            size_t dispatch_n,
            size_t max_idle_iters,
-           int oflags)
+           size_t max_inflight,
+           int oflags,
+           unsigned int flags,
+           const int *nodes)
 {
-    /* Figure out how much memory to allocate. */
-    size_t entry_size = sizeof(entry_t) + sizeof(sort_wrapper_t) + sizeof(sort_wrapper_t *);
-    size_t queue_size = entry_size * queue_depth;
-    size_t worker_size = queue_size + sizeof(wstate_t);
-    size_t total_size = worker_size * n_workers;
+    /* Figure out how much memory to allocate. Each worker's entries (followed
+       by its rings' cells, the entries' paths, and then their inline areas)
+       start on a page of their own, so that they can be placed on the worker's
+       NUMA node. */
     size_t n_entries = n_workers * queue_depth;
+    n_readers = n_readers == 0 ? 1 : n_readers > n_workers ? n_workers : n_readers;
+    inline_size = inline_size == 0 ? 0 : PAGE_ROUND(inline_size);
+    size_t state_bytes = PAGE_ROUND(n_workers * sizeof(wstate_t));
+    size_t worker_bytes = async_queue_bytes(queue_depth) + queue_depth * inline_size;
+    size_t reader_bytes = n_readers * sizeof(rstate_t);
+    size_t sorts_bytes = n_readers * n_entries * sizeof(sort_wrapper_t);
+    size_t sortp_bytes = n_readers * n_entries * sizeof(sort_wrapper_t *);
+    /* A kernel poller resolves descriptors in the process which set up its
+       ring, not in a loader forked from it, so files are opened through the
+       ring as direct descriptors. */
+    flags |= (flags & ASYNC_SQPOLL) ? ASYNC_URING_OPEN : 0;
+    bool uring_open = (flags & ASYNC_URING_OPEN) != 0;
+    size_t sqes_per_entry = uring_open ? 2 : 1;
+    size_t max_inflight_limit = (RING_MAX_ENTRIES - 1) / sqes_per_entry;
+    max_inflight = max_inflight == 0 || max_inflight > n_entries ? n_entries : max_inflight;
+    max_inflight = max_inflight > max_inflight_limit ? max_inflight_limit : max_inflight;
+    size_t opened_cap = ring_capacity(n_entries);
+    size_t opened_bytes = uring_open ? n_readers * opened_cap * sizeof(ring_cell_t) : 0;
+    size_t opens_bytes = uring_open ? n_entries * sizeof(open_state_t) : 0;
+    size_t total_size = PAGE_ROUND(state_bytes + n_workers * worker_bytes + reader_bytes + sorts_bytes + sortp_bytes +
+                                   opened_bytes + opens_bytes);
+
+    /* File data must live in an arena. */
+    if (max_file_size == 0 && arena_size == 0) {
+        return -EINVAL;
+    }
 
-    /* Do the allocation. */
-    if ((loader->states = mmap_alloc(total_size)) == NULL) {
-        return -ENOMEM;
+    /* Only O_DIRECT reads can be polled, and a polled ring can't open files. */
+    if ((flags & ASYNC_IOPOLL) && (!(oflags & O_DIRECT) || uring_open)) {
+        return -EINVAL;
     }
 
-    /*   LO                                          HI
-        ┌────────┬───────┬──────────────┬──────────────┐
-        │wstate_t│entry_t│sort_wrapper_t│sort_wrapper_t│
-        │structs │structs│structs       │pointers      │
-        └┬───────┴┬──────┴┬─────────────┴┬─────────────┘
-         │        │       │              │
-         │        │       │              └►n_workers * queue_depth * sizeof(sort_wrapper_t *)
-         │        │       └►n_workers * queue_depth * sizeof(sort_wrapper_t)
-         │        └►n_workers * queue_depth * sizeof(entry_t)
-         └►n_workers * sizeof(wstate_t)
+    /* Do the allocation. */
+    size_t slot_size = arena_size > 0 ? 0 : PAGE_ROUND(max_file_size);
+    bool huge = (flags & ASYNC_HUGEPAGES) != 0;
+    int status;
+    lstate_t *loader = async_alloc(name, total_size, arena_size, slot_size, n_entries, huge, &status);
+    if (loader == NULL) {
+        return status;
+    }
+    loader->slot_size = slot_size;
+    loader->max_file_size = max_file_size;
+    loader->inline_size = inline_size;
+    loader->arena_nodes = 0;
+
+    /*   LO                                                                                      HI
+        ┌────────┬───────┬─────┬───────┬────────┬──────────────┬──────────────┬───────────┬────────────┐
+        │wstate_t│entry_t│     │entry_t│rstate_t│sort_wrapper_t│sort_wrapper_t│opened     │open_state_t│
+        │structs │structs│ ... │structs│structs │structs       │pointers      │rings' cells│structs     │
+        └┬───────┴┬──────┴─────┴───────┴┬───────┴┬─────────────┴┬─────────────┴┬──────────┴┬───────────┘
+         │        │                     │        │              │              │           │
+         │        │                     │        │              │              │           └►n_workers * queue_depth * sizeof(open_state_t), with ASYNC_URING_OPEN
+         │        │                     │        │              │              └►n_readers * ring_capacity(n_workers * queue_depth) cells, with ASYNC_URING_OPEN
+         │        │                     │        │              └►n_readers * n_workers * queue_depth * sizeof(sort_wrapper_t *)
+         │        │                     │        └►n_readers * n_workers * queue_depth * sizeof(sort_wrapper_t)
+         │        │                     └►n_readers * sizeof(rstate_t)
+         │        └►n_workers * (queue_depth * (sizeof(entry_t) + MAX_PATH_LEN + 1)
+         │                       + 3 rings' cells, rounded up to 4K,
+         │                       + queue_depth * inline_size)
+         └►n_workers * sizeof(wstate_t), rounded up to 4K
     */
 
-    /* Sizes of each region. */
-    size_t state_bytes = n_workers * sizeof(wstate_t);
-    size_t entry_bytes = n_entries * sizeof(entry_t);
-    size_t sorts_bytes = n_entries * sizeof(sort_wrapper_t);
-
     /* Addresses of each region. */
-    entry_t         *entry_start = (entry_t *) ((uint8_t *) loader->states + state_bytes);
-    sort_wrapper_t  *sorts_start = (sort_wrapper_t *) ((uint8_t *) entry_start + entry_bytes);
+    uint8_t         *queue_start = (uint8_t *) loader->states + state_bytes;
+    rstate_t        *reader_start = (rstate_t *) (queue_start + n_workers * worker_bytes);
+    sort_wrapper_t  *sorts_start = (sort_wrapper_t *) ((uint8_t *) reader_start + reader_bytes);
     sort_wrapper_t **sortp_start = (sort_wrapper_t **) ((uint8_t *) sorts_start + sorts_bytes);
+    ring_cell_t     *opened_start = (ring_cell_t *) ((uint8_t *) sortp_start + sortp_bytes);
+    open_state_t    *opens_start = (open_state_t *) ((uint8_t *) opened_start + opened_bytes);
 
     /* Assign all of the correct locations to each state/queue. */
     size_t entry_n = 0;
@@ -464,74 +1768,211 @@ async_init(lstate_t *loader,
         wstate_t *state = &loader->states[i];
 
         state->loader = loader;
+        state->node = -1;
         state->capacity = queue_depth;
 
         /* Assign memory for queues and file data. */
-        state->queue = &entry_start[entry_n];
+        state->queue = (entry_t *) (queue_start + i * worker_bytes);
+        state->inline_data = (uint8_t *) state->queue + async_queue_bytes(queue_depth);
+        size_t ring_cap = ring_capacity(queue_depth);
+        ring_cell_t *cells = (ring_cell_t *) &state->queue[queue_depth];
+        char (*paths)[MAX_PATH_LEN + 1] = (void *) &cells[3 * ring_cap];
         for (size_t j = 0; j < queue_depth; j++) {
             entry_t *e = &state->queue[j];
 
-            /* Configure SHM. */
-            e->shm_fp[0] = 0;
-            e->shm_lfd = -1;
-            e->shm_wfd = -1;
-            e->shm_ldata = NULL;
-            e->shm_wdata = NULL;
-            e->shm_lmapped = false;
+            /* Assign the entry its slot, if the arena is split into slots. If
+               not, this is overwritten when a block is allocated. */
+            e->offset = loader->buddy != NULL ? ASYNC_NO_BLOCK : entry_n * loader->slot_size;
+            e->inlined = false;
 
             /* Configure entry. */
+            e->path = paths[j];
             e->path[0] = '\0';
             e->worker = state;
             e->size = 0;
+            e->file_size = 0;
             e->fd = -1;
-
-            /* Link this entry to the following and previous entries, in order
-               to initialize the free list with all entries. */
-            e->next = &state->queue[(j + 1) % queue_depth];
-            e->prev = &state->queue[(j - 1) % queue_depth];
+            e->status = 0;
+            e->id = 0;
 
             entry_n++;
         }
 
-        /* Initialize status lists. */
-        state->free = state->queue;
-        state->ready = NULL;
-        state->completed = NULL;
-
-        /* Initialize the status list locks. */
-        pthread_spin_init(&state->free_lock, PTHREAD_PROCESS_SHARED);
-        pthread_spin_init(&state->ready_lock, PTHREAD_PROCESS_SHARED);
-        pthread_spin_init(&state->completed_lock, PTHREAD_PROCESS_SHARED);
+        /* Initialize the status rings, with every entry free. Only the rings
+           the worker uses need to allow several threads at once, on its side,
+           as do the rings readers steal from, and responders complete to, on
+           the loader's side, if it has several readers. */
+        bool threaded = (flags & ASYNC_THREADED_WORKERS) != 0;
+        bool stealing = n_readers > 1;
+        ring_init(&state->free, &cells[0], ring_cap, threaded, threaded);
+        ring_init(&state->ready, &cells[ring_cap], ring_cap, threaded, stealing);
+        ring_init(&state->completed, &cells[2 * ring_cap], ring_cap, stealing, threaded);
+        for (size_t j = 0; j < queue_depth; j++) {
+            async_push(&state->free, &state->queue[j]);
+        }
+        atomic_init(&state->completions, 0);
+        atomic_init(&state->n_waiters, 0);
+        atomic_init(&state->n_pending, 0);
+        atomic_init(&state->armed, 0);
+        state->event_fd = -1;
     }
 
-    /* Initialize the LBA sorting arrays. */
-    loader->wrappers = sorts_start;
-    loader->sortable = sortp_start;
-    for (size_t i = 0; i < n_entries; i++) {
-        loader->wrappers[i].data = NULL;
-        loader->wrappers[i].key = 0;
-        loader->sortable[i] = &loader->wrappers[i];
+    /* Initialize the readers, and their LBA sorting arrays. Any reader may
+       steal every entry, so each array has room for all of them. */
+    loader->readers = reader_start;
+    loader->n_readers = n_readers;
+    for (size_t i = 0; i < n_readers; i++) {
+        rstate_t *rd = &loader->readers[i];
+        rd->loader = loader;
+        rd->id = i;
+        rd->n_queued = 0;
+        rd->idle_iters = 0;
+        rd->n_opening = 0;
+        rd->n_unsubmitted = 0;
+        rd->n_reaps = 0;
+        rd->n_devices = 0;
+        rd->n_sqes = 0;
+        rd->n_cqes = 0;
+        if (uring_open) {
+            ring_init(&rd->opened, opened_start + i * opened_cap, opened_cap, false, false);
+        }
+        rd->wrappers = sorts_start + i * n_entries;
+        rd->sortable = sortp_start + i * n_entries;
+        for (size_t j = 0; j < n_entries; j++) {
+            rd->wrappers[j].data = NULL;
+            rd->wrappers[j].key = 0;
+            rd->sortable[j] = &rd->wrappers[j];
+        }
     }
 
     /* Set the loader's config states. */
-    loader->idle_iters = 0;
     loader->max_idle_iters = max_idle_iters;
+    loader->max_inflight = max_inflight;
     loader->n_states = n_workers;
-    loader->n_queued = 0;
     loader->dispatch_n = dispatch_n;
     loader->total_size = total_size;
     loader->oflags = O_RDONLY | oflags;
+    loader->fixed_buffers = false;
+    loader->uring_open = false;
+    loader->always_sort = (flags & ASYNC_ALWAYS_SORT) != 0;
+    loader->opens = uring_open ? opens_start : NULL;
+
+    /* Place workers' memory on their NUMA nodes. */
+    for (size_t i = 0; nodes != NULL && i < n_workers; i++) {
+        if (nodes[i] < 0) {
+            continue;
+        }
+        if ((status = async_place_worker(loader, i, nodes[i])) < 0) {
+            async_free(loader);
+            return status;
+        }
+    }
 
     /* Initialize liburing. We don't need to worry about this not using shared
        memory because while worker interact with the shared queues, the IO
        submissions (thus interactions with liburing) are done only by this
-       reader/responder process. */
-    int status = io_uring_queue_init((unsigned int) n_entries, &loader->ring, 0);
+       reader/responder process. Each ring holds the SQEs of MAX_INFLIGHT
+       entries (one each, or two opening files through the ring), plus the
+       responder's stop no-op. If the kernel rejects the requested setup, the
+       defaults are used. */
+    unsigned int ring_entries = (unsigned int) (sqes_per_entry * max_inflight + 1);
+    unsigned int setup = ((flags & ASYNC_SQPOLL) ? IORING_SETUP_SQPOLL : 0) |
+                         ((flags & ASYNC_IOPOLL) ? IORING_SETUP_IOPOLL : 0) |
+                         ((flags & ASYNC_COOP_TASKRUN) ? IORING_SETUP_COOP_TASKRUN : 0);
+    if ((status = async_init_rings(loader, ring_entries, setup)) < 0) {
+        async_free(loader);
+        return status;
+    }
+
+    /* Open files through io_uring, if requested. Blocking system calls are
+       always a safe fallback, except with a kernel poller, which can't see the
+       descriptors they return in a loader forked from this process. Its rings
+       are set up again without one. */
+    if (uring_open) {
+        if ((status = async_register_files(loader)) < 0) {
+            fprintf(stderr,
+                    "can't open files through io_uring, using blocking calls; %s\n",
+                    strerror(-status));
+            if (loader->ring_flags & IORING_SETUP_SQPOLL) {
+                async_exit_rings(loader);
+                setup = loader->ring_flags & ~IORING_SETUP_SQPOLL;
+                if ((status = async_init_rings(loader, ring_entries, setup)) < 0) {
+                    async_free(loader);
+                    return status;
+                }
+            }
+        } else {
+            loader->uring_open = true;
+        }
+    }
+
+    /* Create the workers' event fds. They're inherited by the processes forked
+       from this one, so the loader and workers all share them. */
+    for (size_t i = 0; i < n_workers; i++) {
+        if ((loader->states[i].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            status = -errno;
+            fprintf(stderr, "failed to create worker event fd; %s\n", strerror(-status));
+            async_close_events(loader);
+            async_exit_rings(loader);
+            async_free(loader);
+            return status;
+        }
+    }
+
+    /* Register the data arena, if requested. As with opening files, falling
+       back to regular reads is always safe, so failure here isn't fatal. */
+    if ((flags & ASYNC_FIXED_BUFFERS) && loader->arena != NULL) {
+        if ((status = async_register_arena(loader)) < 0) {
+            fprintf(stderr,
+                    "failed to register data arena, using regular reads; %s\n",
+                    strerror(-status));
+        } else {
+            loader->fixed_buffers = true;
+        }
+    }
+
+    /* Only now may other processes attach. */
+    if (name != NULL) {
+        shm_publish(loader);
+    }
+    *loader_p = loader;
+
+    return 0;
+}
+
+/* Attach to the loader in the named segment NAME, created by another process
+   with ASYNC_INIT. Its workers may then be used as usual, except that their
+   event fds belong to the creator. On success, writes the loader to LOADER and
+   returns 0. On failure, returns negative ERRNO value; see SHM_ATTACH. */
+int
+async_attach(lstate_t **loader, const char *name)
+{
+    void *mem;
+    int status = shm_attach(name, async_shm_tag(), &mem);
     if (status < 0) {
-        fprintf(stderr, "io_uring_queue_init failed; %s\n", strerror(-status));
-        mmap_free(loader->states, total_size);
         return status;
     }
+    *loader = mem;
 
     return 0;
+}
+
+/* Detach from LOADER, attached to with ASYNC_ATTACH, or inherited from the
+   creator by a forked process, unmapping it from this process. Nothing shared
+   with the other processes (e.g., its rings or event fds) is touched. */
+void
+async_detach(lstate_t *loader)
+{
+    async_unmap(loader);
+}
+
+/* Destroy LOADER, created by ASYNC_INIT, once its threads (wherever they run)
+   are no longer needed, freeing all of its memory. A named loader's segment is
+   removed, but remains mapped in processes still attached to it. */
+void
+async_destroy(lstate_t *loader)
+{
+    async_close_events(loader);
+    async_exit_rings(loader);
+    async_free(loader);
 }
\ No newline at end of file
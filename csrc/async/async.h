@@ -25,109 +25,282 @@
 #define __ASYNC_LOADER_MODULE_H_
 
 #include "../utils/sort.h"
+#include "../utils/alloc.h"
+#include "../utils/ring.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
 #include <liburing.h>
 
 #define MAX_PATH_LEN (128)
 
-/* Queue entry. */
+/* Loader flags. */
+#define ASYNC_FIXED_BUFFERS (1 << 0)    /* Register the data arena with io_uring
+                                           and use fixed buffer reads. */
+#define ASYNC_HUGEPAGES     (1 << 1)    /* Back the data arena with huge pages,
+                                           where possible. */
+#define ASYNC_THREADED_WORKERS (1 << 2) /* Workers may request, get and release
+                                           from several threads at once. */
+#define ASYNC_URING_OPEN    (1 << 3)    /* Open, stat and close files through
+                                           io_uring, as direct descriptors,
+                                           where the kernel supports it. */
+#define ASYNC_SQPOLL        (1 << 4)    /* Submit IO through a kernel thread
+                                           polling each reader's ring, pinned
+                                           to a CPU. Implies ASYNC_URING_OPEN. */
+#define ASYNC_IOPOLL        (1 << 5)    /* Poll for reads to complete, rather
+                                           than taking interrupts. Requires
+                                           O_DIRECT, and can't be used with
+                                           ASYNC_URING_OPEN. */
+#define ASYNC_COOP_TASKRUN  (1 << 6)    /* Run completion work when the reader
+                                           next enters the kernel, rather than
+                                           interrupting it. */
+#define ASYNC_ALWAYS_SORT   (1 << 7)    /* Sort requests for every file by LBA
+                                           before issuing them, rather than
+                                           only those on rotational disks. */
+
+/* Largest buffer which may be registered with io_uring. Larger data arenas are
+   registered as several buffers. */
+#define FIXED_BUFFER_MAX (1UL << 30)
+
+/* Default number of times ASYNC_WAIT checks for a completed entry before going
+   to sleep. */
+#define ASYNC_WAIT_SPIN (1024)
+
+/* Version of the layout of named loaders' shared memory. Bumped whenever it
+   changes in a way the struct sizes don't reveal. */
+#define ASYNC_SHM_VERSION (6)
+
+/* Offset of entries which hold no block of an arena with an allocator. */
+#define ASYNC_NO_BLOCK ((size_t) -1)
+
+/* Devices whose IO policy each reader remembers. Once full, the policy
+   decided longest ago is forgotten. */
+#define ASYNC_MAX_DEVICES (8)
+
+/* Size of a cache line. Shared structures are laid out so that fields written
+   by different processes (or threads) don't share one. */
+#define CACHE_LINE (64)
+
+/* Queue entry. Only fields used for every request are kept here, so that each
+   entry fills exactly one cache line, and entries being handled by different
+   processes never share one. Its path is kept apart, with the worker's other
+   entries' paths. */
 typedef struct queue_entry {
-    char          path[MAX_PATH_LEN+1];     /* Filepath data was read from. */
+    struct worker_state *worker;            /* Worker that owns this queue. */
+    size_t        size;                     /* Size of the read in bytes; the
+                                               file's size rounded up to 4K. */
+    size_t        file_size;                /* Size of file in bytes. */
+    size_t        offset;                   /* Offset of the file's data
+                                               (SIZE bytes) in the loader's
+                                               data arena; either the entry's
+                                               fixed slot, or a block allocated
+                                               from the arena (ASYNC_NO_BLOCK
+                                               if it holds none). Translated to
+                                               a pointer by ASYNC_DATA. */
+    char         *path;                     /* Filepath data was read from;
+                                               MAX_PATH_LEN+1 bytes in the
+                                               worker's path array. */
+    uint64_t      id;                       /* Identifier given with the
+                                               request, for the worker's use. */
     int           fd;                       /* File descriptor for file being
                                                loaded. Belongs to the loader.
                                                Not to be touched by workers. */
-    uint64_t      lba;                      /* LBA of the file's first extent. */
-    size_t        size;                     /* Size of file in bytes. */
-    char          shm_fp[MAX_PATH_LEN+2];   /* Name used for shm object. */
-    int           shm_lfd;                  /* File descriptor of shm object for
-                                               the loader process. */
-    int           shm_wfd;                  /* File descriptor of shm object for
-                                               the worker process.*/
-    uint8_t      *shm_ldata;                /* File data (SIZE bytes) in the shm
-                                               object, accessible by the loader
-                                               process. */
-    uint8_t      *shm_wdata;                /* File data (SIZE bytes) in the shm
-                                               object, accessible by the worker
-                                               process. */
-    bool          shm_lmapped;              /* If set when the entry is accessed
-                                               in the free list, the loader must
-                                               unmap SHM_DATA. */
-
-    /* Free/ready link list. */
-    struct worker_state *worker;            /* Worker that owns this queue. */
-    struct queue_entry  *next;              /* Next entry in status list. */
-    struct queue_entry  *prev;              /* Previous entry in status list. */
-} entry_t;
+    int           status;                   /* 0 if the file was loaded, or
+                                               negative ERRNO value if not. */
+    bool          inlined;                  /* Data was small enough to be read
+                                               into the entry's inline area,
+                                               rather than the arena. False if
+                                               the file wasn't loaded. */
+} __attribute__((aligned(CACHE_LINE))) entry_t;
 
 /* Worker state. Input/output queues unique to that worker. */
 typedef struct worker_state {
+    /* Configuration. Read-only once the loader is initialized. */
     struct loader_state *loader;    /* Loader's state struct. */
-    bool                 eager;     /* Flag indicating if this worker is
-                                       currently requesting eager submission. */
+    int                  node;      /* NUMA node this worker's queue and data
+                                       are placed on, or -1 if unplaced. */
+    int                  event_fd;  /* Non-blocking eventfd, signalled by the
+                                       responder on completions once armed by
+                                       ASYNC_ARM. Pollable by event loops.
+                                       Only valid in the loader's creator and
+                                       processes forked from it. */
 
     /* Input buffer. */
-    size_t   capacity;  /* Total number of entries in QUEUE. */
-    entry_t *queue;     /* CAPACITY queue entries. */
+    size_t   capacity;      /* Total number of entries in QUEUE. */
+    entry_t *queue;         /* CAPACITY queue entries, followed by their
+                               rings' cells and their paths. */
+    uint8_t *inline_data;   /* CAPACITY inline data areas, of the loader's
+                               INLINE_SIZE bytes each, following QUEUE. */
 
-    /* Status lists. Mutually exclusive, all using NEXT field of entry. Entries
-       move exclusively in a loop, and are only ever present in at most 1 list.
+    /* Status rings, holding indices into QUEUE. Mutually exclusive; entries
+       move exclusively in a loop, and are only ever present in at most 1 ring.
 
             free -> ready -> completed -> free
         
-       Lists should be maintained in FIFO order, and must be looped so that the
-       head's PREV field points to the tail of the list. When an entry has IO
-       issued, it is removed from the ready list. It is only added to the
-       completed list once that IO has completed. In the interim it is tracked
-       only by the uring buffer. Similarly, once a worker reads an entry from
-       the completed list, it is only added to the free list upon release. */
-    entry_t *free;          /* Unused queue entries. */
-    entry_t *ready;         /* Queue entries ready to have IO issued. */
-    entry_t *completed;     /* Queue entries with completed IO. */
-
-    /* Synchronization. */
-    pthread_spinlock_t  free_lock;          /* Protects FREE. */
-    pthread_spinlock_t  ready_lock;         /* Protects READY. */
-    pthread_spinlock_t  completed_lock;     /* Protects COMPLETED. */
+       Rings are FIFO. When an entry has IO issued, it is removed from the
+       ready ring. It is only added to the completed ring once that IO has
+       completed (or failed). In the interim it is tracked only by the uring
+       buffer. Similarly, once a worker reads an entry from the completed ring,
+       it is only added to the free ring upon release.
+
+       FREE is only used by the worker, READY is pushed by the worker and
+       popped by the readers (usually just the one owning the worker), and
+       COMPLETED is pushed by the responders and popped by the worker. Each
+       ring's head and tail have cache lines of their own, and neither side
+       ever takes a lock. */
+    ring_t free;        /* Unused queue entries. */
+    ring_t ready;       /* Queue entries ready to have IO issued. */
+    ring_t completed;   /* Queue entries with completed IO. */
+
+    /* Completion signal; a futex. The responder bumps COMPLETIONS after each
+       push to COMPLETED, and wakes it if any of the worker's threads are
+       sleeping in ASYNC_WAIT. */
+    _Atomic uint32_t completions __attribute__((aligned(CACHE_LINE)));
+    _Atomic uint32_t n_waiters;     /* Threads sleeping on COMPLETIONS. */
+    _Atomic uint32_t n_pending;     /* Requests made, but not yet completed. */
+    _Atomic uint32_t armed;         /* EVENT_FD is to be signalled at the next
+                                       completion. */
 } wstate_t;
 
-/* Loader (reader + responder) state. */
-typedef struct loader_state {
-    wstate_t       *states;         /* N_STATES worker states. */
-    size_t          n_states;       /* Worker states in STATES. */
+/* How a reader issues requests for files on a device. */
+typedef struct device_policy {
+    dev_t dev;      /* The device; its files' ST_DEV (or ST_RDEV, if they are
+                       block devices themselves). */
+    bool  sorted;   /* Requests are queued and sorted by LBA (or by inode, if
+                       opened through the reader's ring) before being issued,
+                       rather than issued as soon as they're opened. */
+} device_policy_t;
+
+/* Reader state. Each reader has a ring of its own, and a responder reaping it,
+   and issues the requests of the workers it owns; worker I is owned by reader
+   I % N_READERS. A reader which finds its own workers idle steals requests
+   from the others. Kept on cache lines of its own, away from other readers. */
+typedef struct reader_state {
+    struct loader_state *loader;    /* Loader's state struct. */
+    size_t          id;             /* Index in the loader's READERS. */
     size_t          n_queued;       /* Number of requests queued in WRAPPERS. */
-    size_t          dispatch_n;     /* Necessary N_QUEUED value to submit IO. */
     size_t          idle_iters;     /* Current number of reader iterations since
                                        the last request was added to the LBA
                                        sorting queue. */
-    size_t          max_idle_iters; /* Maximum number of idle reader iterations
-                                       per-worker before we eagerly submit. */
-    size_t          total_size;     /* Total memory allocated. For clean up. */
-    int             oflags;         /* Mode to open files with. Allows use of
-                                       O_DIRECT, etc. */
     struct io_uring ring;           /* Submission ring buffer for liburing. */
     sort_wrapper_t  *wrappers;      /* Array of sort_wrapper_t structs to be
                                        configured prior to sorting. */
     sort_wrapper_t **sortable;      /* Sortable array of sort_wrapper_t
                                        pointers for LBA sorting. */
+    size_t          n_opening;      /* Entries whose files are being opened
+                                       through RING, not yet back in OPENED. */
+    size_t          n_unsubmitted;  /* Entries opening, or issued without
+                                       sorting, whose SQEs aren't yet
+                                       submitted. */
+    ring_t          opened;         /* Indices (as ASYNC_ENTRY_INDEX) of
+                                       entries whose files have been opened
+                                       through RING. Pushed by the responder,
+                                       popped by the reader. */
+    size_t          n_sqes;         /* SQEs the reader has prepared. */
+    size_t          n_reaps;        /* Times the responder woke to reap CQEs. */
+    _Atomic size_t  n_cqes;         /* CQEs the responder has reaped. Less than
+                                       N_SQES while IO is in flight. */
+    device_policy_t devices[ASYNC_MAX_DEVICES]; /* Policies of the devices
+                                       most recently seen. */
+    size_t          n_devices;      /* Policies decided so far. DEVICES is
+                                       reused round-robin once full. */
+    pthread_t       reader;         /* Threads started by ASYNC_LAUNCH. Only */
+    pthread_t       responder;      /* meaningful in the launching process. */
+} __attribute__((aligned(CACHE_LINE))) rstate_t;
+
+/* Loader (readers + responders) state. */
+typedef struct loader_state {
+    char            name[SHM_NAME_MAX + 1]; /* Name of the segment holding the
+                                               loader, or empty if anonymous. */
+    wstate_t       *states;         /* N_STATES worker states. */
+    size_t          n_states;       /* Worker states in STATES. */
+    size_t          dispatch_n;     /* Necessary N_QUEUED value to submit IO. */
+    size_t          max_idle_iters; /* Maximum number of idle reader iterations
+                                       per-worker before we eagerly submit. */
+    size_t          max_inflight;   /* Most entries each reader has in flight
+                                       at once. Its ring is sized for this
+                                       many, and further requests wait in the
+                                       workers' ready rings. */
+    size_t          total_size;     /* Bytes of memory at STATES. For clean up. */
+    uint8_t        *arena;          /* Shared, prefaulted file data arena. */
+    size_t          arena_size;     /* Size of ARENA in bytes. */
+    page_kind_t     arena_pages;    /* Pages backing ARENA. */
+    size_t          slot_size;      /* Bytes of ARENA owned by each entry. Zero
+                                       if ARENA is managed by BUDDY. */
+    size_t          max_file_size;  /* Largest file that may be loaded. Zero if
+                                       unlimited. */
+    size_t          inline_size;    /* Bytes of inline data per entry (a
+                                       multiple of 4K). Files this small skip
+                                       the arena. Zero if disabled. */
+    buddy_t        *buddy;          /* Allocator for variable-sized blocks of
+                                       ARENA. NULL if ARENA is split into fixed
+                                       slots. */
+    unsigned long   arena_nodes;    /* NUMA nodes ARENA is interleaved over,
+                                       if it has an allocator. */
+    int             oflags;         /* Mode to open files with. Allows use of
+                                       O_DIRECT, etc. */
+    bool            fixed_buffers;  /* ARENA is registered with every reader's
+                                       RING, as buffers of FIXED_BUFFER_MAX
+                                       bytes. */
+    unsigned int    ring_flags;     /* IORING_SETUP_* flags the readers' rings
+                                       were set up with. */
+    bool            uring_open;     /* Files are opened, stat'd and closed
+                                       through the readers' rings, as direct
+                                       descriptors, rather than by blocking
+                                       system calls. */
+    bool            always_sort;    /* Every device's requests are sorted,
+                                       as ASYNC_ALWAYS_SORT. */
+    struct open_state *opens;       /* Each entry's state while its file is
+                                       opened through a ring, by index (as
+                                       ASYNC_ENTRY_INDEX). NULL unless
+                                       ASYNC_URING_OPEN was requested. */
+    _Atomic bool    stopping;       /* The readers and responders are to exit,
+                                       once IO already issued completes. */
+    rstate_t       *readers;        /* N_READERS reader states. */
+    size_t          n_readers;      /* Reader states in READERS. */
 } lstate_t;
 
 
 bool async_try_request(wstate_t *state, char *path);
+size_t async_request_many(wstate_t *state, char **paths, const uint64_t *ids, size_t n);
 entry_t *async_try_get(wstate_t *state);
+size_t async_try_get_many(wstate_t *state, entry_t **entries, size_t n);
+int async_wait(wstate_t *state, size_t spin, const struct timespec *deadline);
+entry_t *async_wait_get(wstate_t *state, size_t spin, const struct timespec *deadline);
+bool async_arm(wstate_t *state);
+void async_drain(wstate_t *state);
+uint8_t *async_data(entry_t *e);
 void async_release(entry_t *e);
+void async_release_many(entry_t **entries, size_t n);
+int async_worker_bind(wstate_t *state);
+int async_reclaim(wstate_t *state);
 
 void async_start(lstate_t *loader);
-int async_init(lstate_t *loader,
+int async_launch(lstate_t *loader);
+void async_stop(lstate_t *loader);
+void async_close_events(lstate_t *loader);
+int async_init(lstate_t **loader,
+               const char *name,
                size_t queue_depth,
+               size_t max_file_size,
+               size_t arena_size,
+               size_t inline_size,
                size_t n_workers,
+               size_t n_readers,
                size_t min_dispatch_n,
                size_t max_idle_iters,
-               int oflags);
+               size_t max_inflight,
+               int oflags,
+               unsigned int flags,
+               const int *nodes);
+int async_attach(lstate_t **loader, const char *name);
+void async_detach(lstate_t *loader);
+void async_destroy(lstate_t *loader);
 
 
 #endif
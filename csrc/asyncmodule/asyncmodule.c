@@ -25,9 +25,12 @@
 #include <Python.h>
 
 #include "../async/async.h"
+#include "../daemon/daemon.h"
 #include "../utils/alloc.h"
+#include "dlpack.h"
 
 #include <stdatomic.h>
+#include <stddef.h>
 
 /* Input validation. */
 #define ARG_CHECK(valid_condition, error_string, return_fail)                  \
@@ -36,6 +39,14 @@
       return return_fail;                                                      \
    }
 
+/* Columns of a batch's descriptors; each entry's ID, data offset, length,
+   status, and whether its data was read inline. */
+#define BATCH_COLUMNS (5)
+
+/* Longest a daemon run by LOADER.SERVE waits before checking for signals, in
+   milliseconds. Signals may be delivered to the loader's threads instead. */
+#define SERVE_POLL_MS (100)
+
 /* --------- */
 /*   TYPES   */
 /* --------- */
@@ -44,14 +55,48 @@
 typedef struct {
    PyObject_HEAD
 
-   entry_t *entry;
+   entry_t   *entry;            /* Wrapped entry. NULL once released. */
+   PyObject  *owner;            /* Worker ENTRY was gotten from, which keeps
+                                   its loader's memory mapped while the entry
+                                   (or an export of its data) is alive. */
+   Py_ssize_t n_exports;        /* Live buffer exports of ENTRY's data. */
+   bool       release_pending;  /* Release ENTRY once N_EXPORTS reaches 0. */
 } Entry;
 
+/* Python wrapper for a batch of entry_t structs, from the same worker. */
+typedef struct {
+   PyObject_HEAD
+
+   entry_t  **entries;      /* N wrapped entries. NULL once released. */
+   size_t     n;            /* Entries in ENTRIES. */
+   PyObject  *owner;        /* Worker ENTRIES were gotten from, as an entry's
+                               owner. */
+   PyObject  *descriptors;  /* (N, BATCH_COLUMNS) int64 view of each entry's
+                               ID, data offset, length, status and whether
+                               it was read inline. */
+} Batch;
+
+/* Read-only region of a loader's memory (e.g., its data arena), exported by a
+   batch. Holds the worker the batch came from, keeping the memory mapped for
+   as long as views of it are alive. */
+typedef struct {
+   PyObject_HEAD
+
+   PyObject  *owner;    /* Worker whose loader's memory BUF is in. */
+   char      *buf;      /* Start of the region. */
+   Py_ssize_t len;      /* Bytes in the region. */
+} Region;
+
 /* Python wrapper for wstate_t struct. */
 typedef struct {
    PyObject_HEAD
 
    wstate_t *worker;
+   PyObject *owner;     /* Loader whose memory WORKER is in. */
+   PyObject *waiters;   /* Futures awaiting entries from GET, in order. */
+   PyObject *loop;      /* Event loop watching WORKER's event fd, or NULL. */
+   int       lease;     /* Connection to the daemon WORKER is leased from, or
+                           -1 if it isn't leased. */
 } Worker;
 
 /* Python wrapper for lstate_t struct. */
@@ -59,8 +104,22 @@ typedef struct {
    PyObject_HEAD
 
    lstate_t *loader;    /* Asynchronous loader state. */
+   pid_t     runner;    /* Process in which START started LOADER's threads,
+                           or 0 if they've been stopped. Forked processes
+                           inherit it, but not the threads. */
+   bool      attached;  /* LOADER was created by another process, and this
+                           one attached to it by name. */
+   pid_t     creator;   /* Process which created (or attached to) LOADER. */
+   PyObject *weakrefs;  /* Weak references to this loader. */
 } Loader;
 
+/* Named loaders mapped into this process, by name, as weak references. A named
+   loader's segment can only be mapped once per process. */
+static PyObject *named_loaders = NULL;
+
+static PyTypeObject PythonLoaderType;
+static PyObject *Loader_open(const char *name);
+
 
 /* ------------------------ */
 /*   LOADER ENTRY METHODS   */
@@ -70,6 +129,7 @@ typedef struct {
 static void
 Entry_dealloc(PyObject *self)
 {
+   Py_XDECREF(((Entry *) self)->owner);
    Py_TYPE(self)->tp_free(self);
 }
 
@@ -94,36 +154,296 @@ Entry_init(PyObject *self, PyObject *args, PyObject *kwds)
    return 0;
 }
 
+/* Take a reference to an entry's data on behalf of an export (a buffer or a
+   DLPack tensor), preventing the entry from being released while it's alive.
+   On failure (the entry has been released), returns -1 with an exception set.
+   */
+static int
+Entry_export(Entry *entry)
+{
+   if (entry->entry == NULL || entry->release_pending) {
+      PyErr_SetString(PyExc_BufferError, "entry has been released");
+      return -1;
+   }
+   entry->n_exports++;
+
+   return 0;
+}
+
+/* Drop a reference taken with Entry_export. Completes a release deferred by
+   live exports. */
+static void
+Entry_unexport(Entry *entry)
+{
+   if (--entry->n_exports == 0 && entry->release_pending) {
+      async_release(entry->entry);
+      entry->entry = NULL;
+      entry->release_pending = false;
+   }
+}
+
+/* Entry buffer export method. Exposes the entry's data in shared memory,
+   read-only and without copying. */
+static int
+Entry_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+   Entry *entry = (Entry *) self;
+
+   if (Entry_export(entry) < 0) {
+      view->obj = NULL;
+      return -1;
+   }
+   if (PyBuffer_FillInfo(view,
+                         self,
+                         async_data(entry->entry),
+                         entry->entry->file_size,
+                         1,
+                         flags) < 0) {
+      Entry_unexport(entry);
+      return -1;
+   }
+
+   return 0;
+}
+
+/* Entry buffer release method. */
+static void
+Entry_releasebuffer(PyObject *self, Py_buffer *view)
+{
+   Entry_unexport((Entry *) self);
+}
+
+/* DLPack tensor exported by an entry. The entry's data is exposed as a 1D array
+   of bytes. */
+typedef struct {
+   DLManagedTensor managed;
+   int64_t         shape[1];
+} EntryTensor;
+
+/* DLPack deleter, called by the tensor's consumer (possibly without the GIL)
+   once it's done with the tensor. */
+static void
+Entry_dlpack_deleter(DLManagedTensor *managed)
+{
+   PyGILState_STATE gil = PyGILState_Ensure();
+   Entry *entry = (Entry *) managed->manager_ctx;
+   Entry_unexport(entry);
+   Py_DECREF(entry);
+   PyMem_RawFree(managed);
+   PyGILState_Release(gil);
+}
+
+/* DLPack capsule destructor. Consumers rename the capsule when they take
+   ownership of the tensor, so it's only deleted here if never consumed. */
+static void
+Entry_dlpack_capsule_destructor(PyObject *capsule)
+{
+   if (!PyCapsule_IsValid(capsule, DLPACK_CAPSULE_NAME)) {
+      return;
+   }
+
+   PyObject *type, *value, *traceback;
+   PyErr_Fetch(&type, &value, &traceback);
+   DLManagedTensor *managed = PyCapsule_GetPointer(capsule, DLPACK_CAPSULE_NAME);
+   managed->deleter(managed);
+   PyErr_Restore(type, value, traceback);
+}
+
 /* Get the filename for the data in this entry. */
 static PyObject *
 Entry_get_filepath(Worker *self, PyObject *args, PyObject *kwds)
 {
    Entry *entry = (Entry *) self;
+   ARG_CHECK(entry->entry != NULL && !entry->release_pending,
+             "entry has been released",
+             NULL);
 
    return PyBytes_FromString(entry->entry->path);
 }
 
-/* Get the data in this entry. */
+/* Get the ID this entry's file was requested with. */
 static PyObject *
-Entry_get_data(Worker *self, PyObject *args, PyObject *kwds)
+Entry_get_id(Worker *self, PyObject *args, PyObject *kwds)
 {
    Entry *entry = (Entry *) self;
+   ARG_CHECK(entry->entry != NULL && !entry->release_pending,
+             "entry has been released",
+             NULL);
+
+   return PyLong_FromUnsignedLongLong(entry->entry->id);
+}
+
+/* Get the data in this entry, as a read-only memoryview over the shared memory
+   it was loaded into. */
+static PyObject *
+Entry_get_data(Worker *self, PyObject *args, PyObject *kwds)
+{
+   return PyMemoryView_FromObject((PyObject *) self);
+}
+
+/* Get the data in this entry as a read-only NumPy array of DTYPE (uint8 by
+   default), starting OFFSET bytes into the data, optionally reshaped to SHAPE.
+   The array refers directly to the entry's shared memory. */
+static PyObject *
+Entry_as_numpy(Entry *self, PyObject *args, PyObject *kwds)
+{
+   PyObject *dtype = NULL, *shape = Py_None;
+   Py_ssize_t offset = 0;
+   static char *kwlist[] = {"dtype", "shape", "offset", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOn", kwlist,
+                                    &dtype,
+                                    &shape,
+                                    &offset)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+   ARG_CHECK(offset >= 0, "offset must be non-negative", NULL);
+
+   /* Figure out how many elements to read. Reading exactly as many as SHAPE
+      needs allows trailing data (e.g., padding) after the array. */
+   Py_ssize_t count = -1;
+   if (shape != Py_None) {
+      PyObject *dims = PyLong_Check(shape) ? PyTuple_Pack(1, shape)
+                                           : PySequence_Tuple(shape);
+      if (dims == NULL) {
+         return NULL;
+      }
+      count = 1;
+      for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(dims); i++) {
+         count *= PyLong_AsSsize_t(PyTuple_GET_ITEM(dims, i));
+      }
+      Py_DECREF(dims);
+      if (PyErr_Occurred()) {
+         return NULL;
+      }
+   }
+
+   /* numpy.frombuffer holds a buffer export of this entry for as long as the
+      array is alive. */
+   PyObject *numpy, *frombuffer, *kwargs, *array;
+   if ((numpy = PyImport_ImportModule("numpy")) == NULL) {
+      return NULL;
+   }
+   frombuffer = PyObject_GetAttrString(numpy, "frombuffer");
+   Py_DECREF(numpy);
+   if (frombuffer == NULL) {
+      return NULL;
+   }
+   if (dtype == NULL) {
+      kwargs = Py_BuildValue("{s:s,s:n,s:n}",
+                             "dtype", "uint8",
+                             "count", count,
+                             "offset", offset);
+   } else {
+      kwargs = Py_BuildValue("{s:O,s:n,s:n}",
+                             "dtype", dtype,
+                             "count", count,
+                             "offset", offset);
+   }
+   if (kwargs == NULL) {
+      Py_DECREF(frombuffer);
+      return NULL;
+   }
+   PyObject *frombuffer_args = PyTuple_Pack(1, (PyObject *) self);
+   array = frombuffer_args == NULL ? NULL :
+           PyObject_Call(frombuffer, frombuffer_args, kwargs);
+   Py_XDECREF(frombuffer_args);
+   Py_DECREF(kwargs);
+   Py_DECREF(frombuffer);
+   if (array == NULL || shape == Py_None) {
+      return array;
+   }
+
+   PyObject *reshaped = PyObject_CallMethod(array, "reshape", "(O)", shape);
+   Py_DECREF(array);
 
-   return PyBytes_FromStringAndSize((char *) entry->entry->shm_wdata, entry->entry->size);
+   return reshaped;
+}
+
+/* Export the data in this entry as a DLPack capsule, holding a 1D uint8 CPU
+   tensor which refers directly to the entry's shared memory. The tensor holds
+   the entry (and so its loader), which cannot be released until the consumer
+   deletes the tensor. */
+static PyObject *
+Entry_dlpack(Entry *self, PyObject *args, PyObject *kwds)
+{
+   PyObject *stream = Py_None, *max_version = Py_None;
+   PyObject *dl_device = Py_None, *copy = Py_None;
+   static char *kwlist[] = {"stream", "max_version", "dl_device", "copy", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$OOOO", kwlist,
+                                    &stream,
+                                    &max_version,
+                                    &dl_device,
+                                    &copy)) {
+      return NULL;
+   }
+   ARG_CHECK(stream == Py_None, "stream must be None for CPU tensors", NULL);
+   if (copy == Py_True) {
+      PyErr_SetString(PyExc_BufferError, "entries cannot be exported by copy");
+      return NULL;
+   }
+
+   /* Build the tensor. */
+   EntryTensor *tensor = PyMem_RawCalloc(1, sizeof(EntryTensor));
+   if (tensor == NULL) {
+      return PyErr_NoMemory();
+   }
+   if (Entry_export(self) < 0) {
+      PyMem_RawFree(tensor);
+      return NULL;
+   }
+   tensor->shape[0] = (int64_t) self->entry->file_size;
+   tensor->managed.dl_tensor.data = async_data(self->entry);
+   tensor->managed.dl_tensor.device.device_type = kDLCPU;
+   tensor->managed.dl_tensor.device.device_id = 0;
+   tensor->managed.dl_tensor.ndim = 1;
+   tensor->managed.dl_tensor.dtype.code = kDLUInt;
+   tensor->managed.dl_tensor.dtype.bits = 8;
+   tensor->managed.dl_tensor.dtype.lanes = 1;
+   tensor->managed.dl_tensor.shape = tensor->shape;
+   tensor->managed.dl_tensor.strides = NULL;
+   tensor->managed.dl_tensor.byte_offset = 0;
+   tensor->managed.manager_ctx = self;
+   tensor->managed.deleter = Entry_dlpack_deleter;
+   Py_INCREF(self);
+
+   /* Wrap it in a capsule. */
+   PyObject *capsule = PyCapsule_New(&tensor->managed,
+                                     DLPACK_CAPSULE_NAME,
+                                     Entry_dlpack_capsule_destructor);
+   if (capsule == NULL) {
+      Entry_dlpack_deleter(&tensor->managed);
+      return NULL;
+   }
+
+   return capsule;
+}
+
+/* Get the DLPack device of this entry's data. */
+static PyObject *
+Entry_dlpack_device(Entry *self, PyObject *args, PyObject *kwds)
+{
+   return Py_BuildValue("(ii)", kDLCPU, 0);
 }
 
-/* Release an entry. */
+/* Release an entry. If views of the entry's data are still alive, the release
+   is deferred until the last of them is released. */
 static PyObject *
 Entry_release(Worker *self, PyObject *args, PyObject *kwds)
 {
    Entry *entry = (Entry *) self;
 
    /* Release the wrapped entry, unless it's NULL. */
-   if (entry->entry == NULL) {
+   if (entry->entry == NULL || entry->release_pending) {
       PyErr_SetString(PyExc_Exception, "cannot release entry; empty wrapper");
       return NULL;
    }
-   async_release(entry->entry);
+   if (entry->n_exports > 0) {
+      entry->release_pending = true;
+   } else {
+      async_release(entry->entry);
+      entry->entry = NULL;
+   }
 
    return PyLong_FromLong(0);
 }
@@ -136,11 +456,35 @@ static PyMethodDef Entry_methods[] = {
       METH_NOARGS,
       "Get the filepath for this entry."
    },
+   {
+      "get_id",
+      (PyCFunction) Entry_get_id,
+      METH_NOARGS,
+      "Get the ID this entry's file was requested with."
+   },
    {
       "get_data",
       (PyCFunction) Entry_get_data,
       METH_NOARGS,
-      "Get the data contained by this entry."
+      "Get a read-only view of the data contained by this entry."
+   },
+   {
+      "as_numpy",
+      (PyCFunction) Entry_as_numpy,
+      METH_VARARGS | METH_KEYWORDS,
+      "Get a read-only NumPy array over the data contained by this entry."
+   },
+   {
+      "__dlpack__",
+      (PyCFunction) Entry_dlpack,
+      METH_VARARGS | METH_KEYWORDS,
+      "Export the data contained by this entry as a DLPack capsule."
+   },
+   {
+      "__dlpack_device__",
+      (PyCFunction) Entry_dlpack_device,
+      METH_NOARGS,
+      "Get the DLPack device of the data contained by this entry."
    },
    {
       "release",
@@ -151,6 +495,12 @@ static PyMethodDef Entry_methods[] = {
    {NULL}
 };
 
+/* Entry buffer protocol. */
+static PyBufferProcs Entry_as_buffer = {
+   .bf_getbuffer = Entry_getbuffer,
+   .bf_releasebuffer = Entry_releasebuffer,
+};
+
 /* Entry type declaration. */
 static PyTypeObject PythonEntryType = {
     PyVarObject_HEAD_INIT(NULL, 0)
@@ -165,6 +515,232 @@ static PyTypeObject PythonEntryType = {
     .tp_new = Entry_new,
     .tp_init = Entry_init,
     .tp_methods = Entry_methods,
+    .tp_as_buffer = &Entry_as_buffer,
+};
+
+
+/* ----------------- */
+/*   LOADER REGION   */
+/* ----------------- */
+
+/* Region deallocate method. */
+static void
+Region_dealloc(PyObject *self)
+{
+   Py_XDECREF(((Region *) self)->owner);
+   Py_TYPE(self)->tp_free(self);
+}
+
+/* Region buffer export method. */
+static int
+Region_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+   Region *region = (Region *) self;
+
+   return PyBuffer_FillInfo(view, self, region->buf, region->len, 1, flags);
+}
+
+/* Region buffer protocol. */
+static PyBufferProcs Region_as_buffer = {
+   .bf_getbuffer = Region_getbuffer,
+};
+
+/* Region type declaration. */
+static PyTypeObject PythonRegionType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "AsyncLoader.Region",
+    .tp_doc = PyDoc_STR("Region of a loader's memory"),
+    .tp_basicsize = sizeof(Region),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+
+    /* Methods. */
+    .tp_dealloc = Region_dealloc,
+    .tp_as_buffer = &Region_as_buffer,
+};
+
+/* Get a read-only memoryview of the LEN bytes at BUF, in the memory of
+   OWNER's loader, which it keeps mapped. */
+static PyObject *
+Region_view(PyObject *owner, void *buf, size_t len)
+{
+   Region *region = PyObject_New(Region, &PythonRegionType);
+   if (region == NULL) {
+      return NULL;
+   }
+   Py_INCREF(owner);
+   region->owner = owner;
+   region->buf = (char *) buf;
+   region->len = (Py_ssize_t) len;
+
+   PyObject *view = PyMemoryView_FromObject((PyObject *) region);
+   Py_DECREF(region);
+
+   return view;
+}
+
+
+/* ---------------- */
+/*   LOADER BATCH   */
+/* ---------------- */
+
+/* Batch deallocate method. */
+static void
+Batch_dealloc(PyObject *self)
+{
+   Batch *batch = (Batch *) self;
+   PyMem_Free(batch->entries);
+   Py_XDECREF(batch->owner);
+   Py_XDECREF(batch->descriptors);
+   Py_TYPE(self)->tp_free(self);
+}
+
+/* Batch allocation method. */
+static PyObject *
+Batch_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+   PyObject *batch;
+   if ((batch = type->tp_alloc(type, 0)) == NULL) {
+      PyErr_NoMemory();
+      return NULL;
+   }
+
+   return (PyObject *) batch;
+}
+
+/* Fill BATCH's descriptor array from its entries. Each row is an entry's ID,
+   the offset of its data, its length, its status, and 1 if its data was read
+   inline (or 0 if not). Data read inline is at its offset in the worker's
+   inline areas, and other data at its offset in the data arena. Failed entries
+   have no data. On success, returns 0. On failure, returns -1 with an
+   exception set. */
+static int
+Batch_describe(Batch *batch)
+{
+   PyObject *bytes = PyByteArray_FromStringAndSize(NULL, batch->n * BATCH_COLUMNS * sizeof(int64_t));
+   if (bytes == NULL) {
+      return -1;
+   }
+   int64_t *rows = (int64_t *) PyByteArray_AS_STRING(bytes);
+   for (size_t i = 0; i < batch->n; i++) {
+      entry_t *e = batch->entries[i];
+      wstate_t *worker = e->worker;
+      int64_t *row = &rows[BATCH_COLUMNS * i];
+      bool inlined = e->status == 0 && e->inlined;
+      row[0] = (int64_t) e->id;
+      row[1] = e->status < 0 ? 0 :
+               inlined ? (int64_t) ((e - worker->queue) * worker->loader->inline_size) :
+               (int64_t) e->offset;
+      row[2] = (int64_t) e->file_size;
+      row[3] = e->status;
+      row[4] = inlined;
+   }
+
+   /* View the rows as a 2D array, so NumPy takes it as-is. */
+   PyObject *view = PyMemoryView_FromObject(bytes);
+   Py_DECREF(bytes);
+   if (view == NULL) {
+      return -1;
+   }
+   batch->descriptors = PyObject_CallMethod(view, "cast", "s(nn)", "q", (Py_ssize_t) batch->n, (Py_ssize_t) BATCH_COLUMNS);
+   Py_DECREF(view);
+
+   return batch->descriptors == NULL ? -1 : 0;
+}
+
+/* Get the batch's descriptors; an (N, BATCH_COLUMNS) int64 array of each
+   entry's ID, data offset, length, status (0, or negative ERRNO value), and
+   whether it was read inline. */
+static PyObject *
+Batch_get_descriptors(Batch *self, PyObject *args, PyObject *kwds)
+{
+   ARG_CHECK(self->entries != NULL, "batch has been released", NULL);
+
+   Py_INCREF(self->descriptors);
+   return self->descriptors;
+}
+
+/* Get a read-only view of the whole data arena, which the batch's descriptors'
+   offsets index (for entries not read inline). The view keeps the loader
+   mapped, but the data of released entries may be overwritten at any time. */
+static PyObject *
+Batch_get_data(Batch *self, PyObject *args, PyObject *kwds)
+{
+   ARG_CHECK(self->entries != NULL, "batch has been released", NULL);
+   ARG_CHECK(self->n > 0, "batch is empty", NULL);
+
+   lstate_t *loader = self->entries[0]->worker->loader;
+   return Region_view(self->owner, loader->arena, loader->arena_size);
+}
+
+/* Get a read-only view of the worker's inline areas, which the batch's
+   descriptors' offsets index for entries read inline. Returns None if the
+   loader has no inline areas. */
+static PyObject *
+Batch_get_inline_data(Batch *self, PyObject *args, PyObject *kwds)
+{
+   ARG_CHECK(self->entries != NULL, "batch has been released", NULL);
+   ARG_CHECK(self->n > 0, "batch is empty", NULL);
+
+   wstate_t *worker = self->entries[0]->worker;
+   if (worker->loader->inline_size == 0) {
+      Py_INCREF(Py_None);
+      return Py_None;
+   }
+
+   return Region_view(self->owner,
+                      worker->inline_data,
+                      worker->capacity * worker->loader->inline_size);
+}
+
+/* Number of entries in the batch. */
+static Py_ssize_t
+Batch_length(PyObject *self)
+{
+   return (Py_ssize_t) ((Batch *) self)->n;
+}
+
+/* Batch methods array. */
+static PyMethodDef Batch_methods[] = {
+   {
+      "get_descriptors",
+      (PyCFunction) Batch_get_descriptors,
+      METH_NOARGS,
+      "Get an (n, 5) int64 array of each entry's ID, offset, length, status and inline flag."
+   },
+   {
+      "get_data",
+      (PyCFunction) Batch_get_data,
+      METH_NOARGS,
+      "Get a read-only view of the data arena."
+   },
+   {
+      "get_inline_data",
+      (PyCFunction) Batch_get_inline_data,
+      METH_NOARGS,
+      "Get a read-only view of the worker's inline areas, if any."
+   },
+   {NULL}
+};
+
+static PySequenceMethods Batch_as_sequence = {
+   .sq_length = Batch_length,
+};
+
+/* Batch type declaration. */
+static PyTypeObject PythonBatchType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "AsyncLoader.Batch",
+    .tp_doc = PyDoc_STR("Batch of loaded files"),
+    .tp_basicsize = sizeof(Batch),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+
+    /* Methods. */
+    .tp_dealloc = Batch_dealloc,
+    .tp_new = Batch_new,
+    .tp_methods = Batch_methods,
+    .tp_as_sequence = &Batch_as_sequence,
 };
 
 
@@ -172,97 +748,670 @@ static PyTypeObject PythonEntryType = {
 /*   WORKER CONTEXT   */
 /* ------------------ */
 
-/* Worker deallocate method. */
+/* Worker deallocate method. Ends WORKER's lease, if it's leased; the entries
+   and batches gotten from WORKER hold it, so none of them are still alive. */
 static void
 Worker_dealloc(PyObject *self)
 {
+   Worker *worker = (Worker *) self;
+   if (worker->lease >= 0) {
+      close(worker->lease);
+   }
+   Py_XDECREF(worker->owner);
+   Py_XDECREF(worker->waiters);
+   Py_XDECREF(worker->loop);
    Py_TYPE(self)->tp_free(self);
 }
 
-/* Worker allocation method. */
+/* Worker allocation method. */
+static PyObject *
+Worker_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+   Worker *worker;
+   if ((worker = (Worker *) type->tp_alloc(type, 0)) == NULL) {
+      PyErr_NoMemory();
+      return NULL;
+   }
+   worker->lease = -1;
+   if ((worker->waiters = PyList_New(0)) == NULL) {
+      Py_DECREF(worker);
+      return NULL;
+   }
+
+   return (PyObject *) worker;
+}
+
+/* Worker initialization mmethod. Given a named loader's NAME and a worker ID
+   (as when unpickled), attaches to the loader if it isn't already mapped into
+   this process, and becomes the context for that worker. */
+static int
+Worker_init(PyObject *self, PyObject *args, PyObject *kwds)
+{
+   Worker *worker = (Worker *) self;
+   char *name = NULL;
+   size_t id = 0;
+   static char *kwlist[] = {"name", "id", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sk", kwlist, &name, &id)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return -1;
+   }
+   if (name == NULL) {
+      return 0;
+   }
+
+   PyObject *owner = Loader_open(name);
+   if (owner == NULL) {
+      return -1;
+   }
+   lstate_t *loader = ((Loader *) owner)->loader;
+   if (id >= loader->n_states) {
+      Py_DECREF(owner);
+      PyErr_SetString(PyExc_Exception, "invalid worker id");
+      return -1;
+   }
+   Py_XSETREF(worker->owner, owner);
+   worker->worker = &loader->states[id];
+
+   return 0;
+}
+
+/* Worker method to pickle the worker, as its loader's name and its ID, so that
+   it can be passed to processes which weren't forked from the loader's creator
+   (e.g., by multiprocessing's spawn and forkserver start methods). Only workers
+   of named loaders can be pickled. */
+static PyObject *
+Worker_reduce(Worker *self, PyObject *args, PyObject *kwds)
+{
+   lstate_t *loader = self->worker->loader;
+   ARG_CHECK(loader->name[0] != '\0', "only workers of named loaders can be pickled", NULL);
+
+   return Py_BuildValue("(O(sk))",
+                        (PyObject *) Py_TYPE(self),
+                        loader->name,
+                        (unsigned long) (self->worker - loader->states));
+}
+
+/* Worker method to request a file be loaded, optionally with an ID for its
+   entry. On success, returns True. On failure, returns False. */
+static PyObject *
+Worker_request(Worker *self, PyObject *args, PyObject *kwds)
+{
+   char *filepath;
+   unsigned long long id = 0;
+   static char *kwlist[] = {"filepath", "id", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|K", kwlist, &filepath, &id)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+
+   uint64_t ids[1] = {id};
+   if (async_request_many(self->worker, &filepath, ids, 1) == 0) {
+      return PyBool_FromLong(false);
+   }
+
+   return PyBool_FromLong(true);
+}
+
+/* Collect pointers to the paths in OBJ, either a sequence of str (or bytes)
+   paths, or a buffer of NUL-separated paths, writing their number to N. The
+   paths stay owned by OBJ; by the sequence written to SEQ, or the buffer
+   exported to VIEW, which must be released along with the returned array. On
+   failure, returns NULL with an exception set, and nothing to release. */
+static char **
+Worker_parse_paths(PyObject *obj, Py_buffer *view, PyObject **seq, size_t *n)
+{
+   char **paths;
+   *seq = NULL;
+   view->obj = NULL;
+   *n = 0;
+   if (PyObject_CheckBuffer(obj)) {
+      if (PyObject_GetBuffer(obj, view, PyBUF_SIMPLE) < 0) {
+         return NULL;
+      }
+      char *buf = view->buf;
+      size_t len = (size_t) view->len;
+      if (len > 0 && buf[len - 1] != '\0') {
+         PyErr_SetString(PyExc_Exception, "path buffer must end with a NUL");
+         PyBuffer_Release(view);
+         return NULL;
+      }
+      for (size_t i = 0; i < len; i++) {
+         *n += buf[i] == '\0';
+      }
+      if ((paths = PyMem_Malloc((*n + 1) * sizeof(char *))) == NULL) {
+         PyErr_NoMemory();
+         PyBuffer_Release(view);
+         return NULL;
+      }
+      for (size_t i = 0, j = 0; i < len; i += strlen(&buf[i]) + 1) {
+         paths[j++] = &buf[i];
+      }
+
+      return paths;
+   }
+
+   if ((*seq = PySequence_Fast(obj, "paths must be a sequence or buffer")) == NULL) {
+      return NULL;
+   }
+   *n = (size_t) PySequence_Fast_GET_SIZE(*seq);
+   if ((paths = PyMem_Malloc((*n + 1) * sizeof(char *))) == NULL) {
+      PyErr_NoMemory();
+      Py_CLEAR(*seq);
+      return NULL;
+   }
+   for (size_t i = 0; i < *n; i++) {
+      PyObject *path = PySequence_Fast_GET_ITEM(*seq, i);
+      paths[i] = PyBytes_Check(path) ?
+                 PyBytes_AsString(path) :
+                 (char *) PyUnicode_AsUTF8(path);
+      if (paths[i] == NULL) {
+         PyMem_Free(paths);
+         Py_CLEAR(*seq);
+         return NULL;
+      }
+   }
+
+   return paths;
+}
+
+/* Copy the N 64-bit IDs in OBJ, either a sequence of int, or a buffer (e.g., a
+   NumPy array) of 64-bit integers, into a new array. On failure, returns NULL
+   with an exception set. */
+static uint64_t *
+Worker_parse_ids(PyObject *obj, size_t n)
+{
+   uint64_t *ids;
+   if ((ids = PyMem_Malloc((n + 1) * sizeof(uint64_t))) == NULL) {
+      PyErr_NoMemory();
+      return NULL;
+   }
+
+   if (PyObject_CheckBuffer(obj)) {
+      Py_buffer view;
+      if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+         PyMem_Free(ids);
+         return NULL;
+      }
+      const char *format = view.format == NULL ? "B" : view.format;
+      format += strspn(format, "@=<");
+      bool valid = view.itemsize == sizeof(uint64_t) &&
+                   strlen(format) == 1 &&
+                   strchr("qQlLnN", format[0]) != NULL &&
+                   (size_t) (view.len / view.itemsize) == n;
+      if (valid) {
+         memcpy(ids, view.buf, n * sizeof(uint64_t));
+      }
+      PyBuffer_Release(&view);
+      if (!valid) {
+         PyErr_SetString(PyExc_Exception, "ids must hold one 64-bit integer per path");
+         PyMem_Free(ids);
+         return NULL;
+      }
+
+      return ids;
+   }
+
+   PyObject *seq = PySequence_Fast(obj, "ids must be a sequence or buffer");
+   if (seq == NULL) {
+      PyMem_Free(ids);
+      return NULL;
+   }
+   if ((size_t) PySequence_Fast_GET_SIZE(seq) != n) {
+      PyErr_SetString(PyExc_Exception, "ids must hold one integer per path");
+   }
+   for (size_t i = 0; i < n && !PyErr_Occurred(); i++) {
+      ids[i] = PyLong_AsUnsignedLongLongMask(PySequence_Fast_GET_ITEM(seq, i));
+   }
+   Py_DECREF(seq);
+   if (PyErr_Occurred()) {
+      PyMem_Free(ids);
+      return NULL;
+   }
+
+   return ids;
+}
+
+/* Worker method to request many files be loaded at once. PATHS is either a
+   sequence of str (or bytes) paths, or a buffer of NUL-separated paths. IDS,
+   if given, is a sequence (or buffer, e.g., a NumPy array) of 64-bit integers,
+   one per path. All of the requests are queued in one go, rather than one at a
+   time. Returns the number of files requested, which is less than the number
+   of paths if the queue fills; the first that many were requested. */
+static PyObject *
+Worker_request_many(Worker *self, PyObject *args, PyObject *kwds)
+{
+   PyObject *paths_obj, *ids_obj = Py_None;
+   static char *kwlist[] = {"paths", "ids", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &paths_obj, &ids_obj)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+
+   /* Collect the paths and IDs. */
+   size_t n;
+   PyObject *seq;
+   Py_buffer view;
+   char **paths = Worker_parse_paths(paths_obj, &view, &seq, &n);
+   if (paths == NULL) {
+      return NULL;
+   }
+   uint64_t *ids = NULL;
+   if (ids_obj != Py_None && (ids = Worker_parse_ids(ids_obj, n)) == NULL) {
+      PyMem_Free(paths);
+      Py_XDECREF(seq);
+      if (view.obj != NULL) {
+         PyBuffer_Release(&view);
+      }
+      return NULL;
+   }
+
+   size_t n_requested = async_request_many(self->worker, paths, ids, n);
+
+   PyMem_Free(ids);
+   PyMem_Free(paths);
+   Py_XDECREF(seq);
+   if (view.obj != NULL) {
+      PyBuffer_Release(&view);
+   }
+
+   return PyLong_FromSize_t(n_requested);
+}
+
+/* Wrap a completed entry E, gotten from SELF, for Python. If loading its file
+   failed, E is released and an exception is raised instead. */
+static PyObject *
+Worker_wrap(Worker *self, entry_t *e)
+{
+   if (e->status < 0) {
+      PyErr_Format(PyExc_Exception,
+                   "failed to load %s; %s",
+                   e->path,
+                   strerror(-e->status));
+      async_release(e);
+      return NULL;
+   }
+
+   /* Allocate a wrapper. */
+   Entry *entry = (Entry *) Entry_new(&PythonEntryType, NULL, NULL);
+   if (entry == NULL) {
+      async_release(e);
+      return NULL;
+   }
+
+   /* Insert the entry_t into the wrapper. */
+   entry->entry = e;
+   Py_INCREF(self);
+   entry->owner = (PyObject *) self;
+
+   return (PyObject *) entry;
+}
+
+/* Worker method to try to get a file. If a file is waiting in the completion
+   queue, that file is returned and popped from the queue. Otherwise, None is
+   returned. Raises an exception if the file failed to load. */
+static PyObject *
+Worker_try_get(Worker *self, PyObject *args, PyObject *kwds)
+{
+   /* Get an entry from the completion queue. */
+   entry_t *e = async_try_get(self->worker);
+   if (e == NULL) {
+      Py_INCREF(Py_None);
+      return Py_None;
+   }
+
+   return Worker_wrap(self, e);
+}
+
+/* Wait until SELF has completed entries, as ASYNC_WAIT does, with the GIL
+   released. TIMEOUT_OBJ is None, or the number of seconds to wait. Returns 1
+   once entries are waiting, 0 on timeout, and -1 with an exception set on
+   failure. */
+static int
+Worker_wait(Worker *self, PyObject *timeout_obj, size_t spin)
+{
+   /* Turn the timeout into a deadline. */
+   struct timespec deadline, *deadline_p = NULL;
+   if (timeout_obj != Py_None) {
+      double seconds = PyFloat_AsDouble(timeout_obj);
+      if (PyErr_Occurred()) {
+         return -1;
+      }
+      ARG_CHECK(seconds >= 0, "timeout must be non-negative", -1);
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += (time_t) seconds;
+      deadline.tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+      if (deadline.tv_nsec >= 1000000000) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000;
+      }
+      deadline_p = &deadline;
+   }
+
+   while (true) {
+      int status;
+      Py_BEGIN_ALLOW_THREADS
+      status = async_wait(self->worker, spin, deadline_p);
+      Py_END_ALLOW_THREADS
+      if (status == 0) {
+         return 1;
+      } else if (status == -ETIMEDOUT) {
+         return 0;
+      } else if (status == -EINTR && PyErr_CheckSignals() < 0) {
+         return -1;
+      }
+   }
+}
+
+/* Worker method to block until a file is loaded. Removes the file from the
+   completion queue, and returns it. Raises an exception if the file failed to
+   load. The completion queue is checked SPIN times before sleeping until the
+   responder signals a completion. The GIL is released while waiting, but held
+   while popping, so Python threads sharing a worker don't race. If TIMEOUT
+   seconds pass first, returns None. */
+static PyObject *
+Worker_wait_get(Worker *self, PyObject *args, PyObject *kwds)
+{
+   PyObject *timeout = Py_None;
+   unsigned long spin = ASYNC_WAIT_SPIN;
+   static char *kwlist[] = {"timeout", "spin", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Ok", kwlist, &timeout, &spin)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+
+   while (true) {
+      entry_t *e = async_try_get(self->worker);
+      if (e != NULL) {
+         return Worker_wrap(self, e);
+      }
+
+      int status = Worker_wait(self, timeout, spin);
+      if (status < 0) {
+         return NULL;
+      } else if (status == 0) {
+         Py_INCREF(Py_None);
+         return Py_None;
+      }
+   }
+}
+
+/* Worker method to get up to MAX_N loaded files at once, as a Batch, waiting
+   for at least one as WAIT_GET does. Failed files are included, with their
+   status. If TIMEOUT seconds pass first, returns None. */
+static PyObject *
+Worker_get_batch(Worker *self, PyObject *args, PyObject *kwds)
+{
+   size_t max_n;
+   PyObject *timeout = Py_None;
+   unsigned long spin = ASYNC_WAIT_SPIN;
+   static char *kwlist[] = {"max_n", "timeout", "spin", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "k|Ok", kwlist, &max_n, &timeout, &spin)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+   ARG_CHECK(max_n > 0, "max_n must be positive", NULL);
+   if (max_n > self->worker->capacity) {
+      max_n = self->worker->capacity;
+   }
+
+   /* Allocate a wrapper. */
+   Batch *batch = (Batch *) Batch_new(&PythonBatchType, NULL, NULL);
+   if (batch == NULL) {
+      return NULL;
+   }
+   if ((batch->entries = PyMem_Malloc(max_n * sizeof(entry_t *))) == NULL) {
+      Py_DECREF(batch);
+      PyErr_NoMemory();
+      return NULL;
+   }
+   Py_INCREF(self);
+   batch->owner = (PyObject *) self;
+
+   /* Pop as many entries as are waiting, once there are any. */
+   while ((batch->n = async_try_get_many(self->worker, batch->entries, max_n)) == 0) {
+      int status = Worker_wait(self, timeout, spin);
+      if (status <= 0) {
+         Py_DECREF(batch);
+         if (status < 0) {
+            return NULL;
+         }
+         Py_INCREF(Py_None);
+         return Py_None;
+      }
+   }
+   if (Batch_describe(batch) < 0) {
+      async_release_many(batch->entries, batch->n);
+      Py_DECREF(batch);
+      return NULL;
+   }
+
+   return (PyObject *) batch;
+}
+
+/* Worker method to release every entry in BATCH at once. Views of the batch's
+   data must not be used afterwards. */
+static PyObject *
+Worker_release_batch(Worker *self, PyObject *args, PyObject *kwds)
+{
+   PyObject *obj;
+   static char *kwlist[] = {"batch", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!", kwlist, &PythonBatchType, &obj)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+   Batch *batch = (Batch *) obj;
+   ARG_CHECK(batch->entries != NULL, "batch has already been released", NULL);
+   ARG_CHECK(batch->n == 0 || batch->entries[0]->worker == self->worker,
+             "batch belongs to another worker",
+             NULL);
+
+   async_release_many(batch->entries, batch->n);
+   PyMem_Free(batch->entries);
+   batch->entries = NULL;
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+/* Worker method returning the worker's event fd, which becomes readable when
+   entries complete while GET is waiting for them. */
 static PyObject *
-Worker_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+Worker_fileno(Worker *self, PyObject *args, PyObject *kwds)
 {
-   PyObject *worker;
-   if ((worker = type->tp_alloc(type, 0)) == NULL) {
-      PyErr_NoMemory();
-      return NULL;
+   ARG_CHECK(!((Loader *) self->owner)->attached,
+             "event fd is only available to processes forked from the loader's creator",
+             NULL);
+
+   return PyLong_FromLong(self->worker->event_fd);
+}
+
+/* Resolve the future FUT with the completed entry E, gotten from SELF, or with
+   the exception raised if loading it failed. On success, returns 0. On failure,
+   returns -1 with an exception set. */
+static int
+Worker_resolve(Worker *self, PyObject *fut, entry_t *e)
+{
+   PyObject *result;
+   PyObject *entry = Worker_wrap(self, e);
+   if (entry != NULL) {
+      result = PyObject_CallMethod(fut, "set_result", "O", entry);
+      Py_DECREF(entry);
+   } else {
+      PyObject *type, *value, *traceback;
+      PyErr_Fetch(&type, &value, &traceback);
+      PyErr_NormalizeException(&type, &value, &traceback);
+      result = PyObject_CallMethod(fut, "set_exception", "O", value);
+      Py_XDECREF(type);
+      Py_XDECREF(value);
+      Py_XDECREF(traceback);
+   }
+   if (result == NULL) {
+      return -1;
    }
+   Py_DECREF(result);
 
-   return (PyObject *) worker;
+   return 0;
 }
 
-/* Worker initialization mmethod. */
+/* Hand completed entries to the futures waiting on SELF, in order, skipping any
+   which were cancelled. The event loop only watches the worker's event fd while
+   futures are left waiting. On success, returns 0. On failure, returns -1 with
+   an exception set. */
 static int
-Worker_init(PyObject *self, PyObject *args, PyObject *kwds)
+Worker_dispatch(Worker *self)
 {
-   /* No-op. */
+   async_drain(self->worker);
+   while (PyList_GET_SIZE(self->waiters) > 0) {
+      PyObject *fut = PyList_GET_ITEM(self->waiters, 0);
+      PyObject *done = PyObject_CallMethod(fut, "done", NULL);
+      if (done == NULL) {
+         return -1;
+      }
+      int is_done = PyObject_IsTrue(done);
+      Py_DECREF(done);
+
+      if (!is_done) {
+         entry_t *e = async_try_get(self->worker);
+         if (e == NULL) {
+            /* Sleep until the responder signals, unless entries completed
+               since we checked. */
+            if (async_arm(self->worker)) {
+               break;
+            }
+            continue;
+         }
+         if (Worker_resolve(self, fut, e) < 0) {
+            return -1;
+         }
+      }
+      if (PySequence_DelItem(self->waiters, 0) < 0) {
+         return -1;
+      }
+   }
+
+   /* Watch the event fd only while futures are waiting. */
+   PyObject *result = NULL;
+   bool waiting = PyList_GET_SIZE(self->waiters) > 0;
+   bool watching = self->loop != NULL;
+   if (waiting == watching) {
+      return 0;
+   } else if (waiting) {
+      PyObject *ready = PyObject_GetAttrString((PyObject *) self, "_ready");
+      if (ready == NULL) {
+         return -1;
+      }
+      PyObject *asyncio = PyImport_ImportModule("asyncio");
+      if (asyncio != NULL) {
+         self->loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+         Py_DECREF(asyncio);
+      }
+      if (self->loop != NULL) {
+         result = PyObject_CallMethod(self->loop,
+                                      "add_reader",
+                                      "iO",
+                                      self->worker->event_fd,
+                                      ready);
+         if (result == NULL) {
+            Py_CLEAR(self->loop);
+         }
+      }
+      Py_DECREF(ready);
+   } else {
+      result = PyObject_CallMethod(self->loop,
+                                   "remove_reader",
+                                   "i",
+                                   self->worker->event_fd);
+      Py_CLEAR(self->loop);
+   }
+   if (result == NULL) {
+      return -1;
+   }
+   Py_DECREF(result);
+
    return 0;
 }
 
-/* Worker method to request a file be loaded. On success, returns True. On
-   failure, returns False. */
+/* Worker method called by the event loop when the event fd is readable. */
 static PyObject *
-Worker_request(Worker *self, PyObject *args, PyObject *kwds)
+Worker_ready(Worker *self, PyObject *args, PyObject *kwds)
 {
-   char *filepath;
-   static char *kwlist[] = {"filepath", NULL};
-   if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &filepath)) {
-      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+   if (Worker_dispatch(self) < 0) {
       return NULL;
    }
 
-   if (!async_try_request(self->worker, filepath)) {
-      return PyBool_FromLong(false);
-   }
-
-   return PyBool_FromLong(true);
+   Py_INCREF(Py_None);
+   return Py_None;
 }
 
-/* Worker method to try to get a file. If a file is waiting in the completion
-   queue, that file is returned and popped from the queue. Otherwise, None is
-   returned. */
+/* Worker method to get a file from within a running asyncio event loop.
+   Returns a future for the next loaded entry, without blocking the loop. If
+   the file failed to load, the future raises an exception instead. */
 static PyObject *
-Worker_try_get(Worker *self, PyObject *args, PyObject *kwds)
+Worker_get(Worker *self, PyObject *args, PyObject *kwds)
 {
-   /* Get an entry from the completion queue. */
-   entry_t *e = async_try_get(self->worker);
-   if (e == NULL) {
-      Py_INCREF(Py_None);
-      return Py_None;
+   ARG_CHECK(!((Loader *) self->owner)->attached,
+             "get() is only available to processes forked from the loader's creator",
+             NULL);
+
+   PyObject *asyncio = PyImport_ImportModule("asyncio");
+   if (asyncio == NULL) {
+      return NULL;
+   }
+   PyObject *loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+   Py_DECREF(asyncio);
+   if (loop == NULL) {
+      return NULL;
+   }
+   if (self->loop != NULL && self->loop != loop) {
+      Py_DECREF(loop);
+      PyErr_SetString(PyExc_Exception, "worker is awaited by another event loop");
+      return NULL;
    }
 
-   /* Allocate a wrapper. */
-   Entry *entry = (Entry *) Entry_new(&PythonEntryType, NULL, NULL);
-   if (entry == NULL) {
+   PyObject *fut = PyObject_CallMethod(loop, "create_future", NULL);
+   Py_DECREF(loop);
+   if (fut == NULL) {
+      return NULL;
+   }
+   if (PyList_Append(self->waiters, fut) < 0 || Worker_dispatch(self) < 0) {
+      Py_DECREF(fut);
       return NULL;
    }
 
-   /* Insert the entry_t into the wrapper. */
-   entry->entry = e;
+   return fut;
+}
 
-   return (PyObject *) entry;
+/* Workers are asynchronous iterators over their loaded entries. Iteration
+   never ends on its own. */
+static PyObject *
+Worker_aiter(PyObject *self)
+{
+   Py_INCREF(self);
+   return self;
 }
 
-/* Worker method to block until a file is loaded. Removes the file from the
-   completion queue, and returns it. */
 static PyObject *
-Worker_wait_get(Worker *self, PyObject *args, PyObject *kwds)
+Worker_anext(PyObject *self)
 {
-   /* Spin until we get an entry. */
-   entry_t *e;
-   while ((e = async_try_get(self->worker)) == NULL) {}
+   return Worker_get((Worker *) self, NULL, NULL);
+}
 
-   /* Allocate a wrapper. */
-   Entry *entry = (Entry *) Entry_new(&PythonEntryType, NULL, NULL);
-   if (entry == NULL) {
+/* Worker method to bind the calling process to the CPUs (and memory) of the
+   NUMA node its queue and data were placed on. Does nothing if the loader
+   wasn't given a node for this worker. */
+static PyObject *
+Worker_bind(Worker *self, PyObject *args, PyObject *kwds)
+{
+   int status = async_worker_bind(self->worker);
+   if (status < 0) {
+      PyErr_Format(PyExc_Exception,
+                   "failed to bind worker to node %d; %s",
+                   self->worker->node,
+                   strerror(-status));
       return NULL;
    }
-   
-   /* Insert the entry_t into the wrapper. */
-   entry->entry = e;
 
-   return (PyObject *) entry;
+   return PyLong_FromLong(self->worker->node);
 }
 
 /* Worker methods array. */
@@ -282,13 +1431,66 @@ static PyMethodDef Worker_methods[] = {
    {
       "wait_get",
       (PyCFunction) Worker_wait_get,
+      METH_VARARGS | METH_KEYWORDS,
+      "Block until a file has been loaded, or until timeout seconds pass."
+   },
+   {
+      "get_batch",
+      (PyCFunction) Worker_get_batch,
+      METH_VARARGS | METH_KEYWORDS,
+      "Get up to max_n loaded files at once, as a Batch."
+   },
+   {
+      "release_batch",
+      (PyCFunction) Worker_release_batch,
+      METH_VARARGS | METH_KEYWORDS,
+      "Release every entry in a Batch at once."
+   },
+   {
+      "request_many",
+      (PyCFunction) Worker_request_many,
+      METH_VARARGS | METH_KEYWORDS,
+      "Request many files be loaded, returning how many were accepted."
+   },
+   {
+      "get",
+      (PyCFunction) Worker_get,
+      METH_NOARGS,
+      "Get a future for the next loaded file, from within an asyncio loop."
+   },
+   {
+      "__reduce__",
+      (PyCFunction) Worker_reduce,
+      METH_NOARGS,
+      "Pickle the worker, if its loader is named."
+   },
+   {
+      "fileno",
+      (PyCFunction) Worker_fileno,
+      METH_NOARGS,
+      "Get the worker's event fd, readable when files complete."
+   },
+   {
+      "_ready",
+      (PyCFunction) Worker_ready,
+      METH_NOARGS,
+      "Hand completed files to waiting futures. Called by the event loop."
+   },
+   {
+      "bind",
+      (PyCFunction) Worker_bind,
       METH_NOARGS,
-      "Block until a file has been loaded."
+      "Bind this process to the worker's NUMA node, returning the node."
    },
    {NULL}
 };
 
 /* Worker type declaration. */
+static PyAsyncMethods Worker_as_async = {
+   .am_aiter = Worker_aiter,
+   .am_anext = Worker_anext,
+};
+
 static PyTypeObject PythonWorkerType = {
     PyVarObject_HEAD_INIT(NULL, 0)
     .tp_name = "AsyncLoader.Worker",
@@ -302,6 +1504,7 @@ static PyTypeObject PythonWorkerType = {
     .tp_new = Worker_new,
     .tp_init = Worker_init,
     .tp_methods = Worker_methods,
+    .tp_as_async = &Worker_as_async,
 };
 
 
@@ -317,22 +1520,47 @@ Loader_dealloc(PyObject *self)
    if (loader == NULL) {
       return;
    }
+   if (loader->weakrefs != NULL) {
+      PyObject_ClearWeakRefs(self);
+   }
 
    if (loader->loader != NULL) {
-      /* All of the lstate_t's shared memory is allocated contiguously in a
-         single mmap, so freeing it is simple. */
-      if (loader->loader->states != NULL) {
-         mmap_free(loader->loader->states, loader->loader->total_size);
+      /* The loader's threads use its memory, so must exit first. */
+      if (loader->runner == getpid()) {
+         Py_BEGIN_ALLOW_THREADS
+         async_stop(loader->loader);
+         Py_END_ALLOW_THREADS
+         loader->runner = 0;
       }
 
-      /* Free the lstate_t struct itself. */
-      mmap_free(loader->loader, sizeof(lstate_t));
+      /* Only the creator destroys the loader; other processes (attached to it,
+         or forked from the creator) just unmap it. */
+      if (!loader->attached && loader->creator == getpid()) {
+         async_destroy(loader->loader);
+      } else {
+         async_detach(loader->loader);
+      }
    }
 
    /* Free the Loader wrapper. */
    Py_TYPE(loader)->tp_free((PyObject *) loader);
 }
 
+/* Record LOADER, a named loader, as mapped into this process. On success,
+   returns 0. On failure, returns -1 with an exception set. */
+static int
+Loader_register(Loader *loader)
+{
+   PyObject *ref = PyWeakref_NewRef((PyObject *) loader, NULL);
+   if (ref == NULL) {
+      return -1;
+   }
+   int status = PyDict_SetItemString(named_loaders, loader->loader->name, ref);
+   Py_DECREF(ref);
+
+   return status;
+}
+
 /* Loader allocation method. */
 static PyObject *
 Loader_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
@@ -347,6 +1575,20 @@ Loader_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
    return (PyObject *) self;
 }
 
+/* Setups of the readers' rings a loader may ask for, by name; the loader flag
+   requesting each, and the IORING_SETUP_* flag it's applied as. */
+static const struct {
+   const char   *name;
+   unsigned int  flag;
+   unsigned int  setup;
+} ring_profiles[] = {
+   {"default", 0, 0},
+   {"sqpoll", ASYNC_SQPOLL, IORING_SETUP_SQPOLL},
+   {"iopoll", ASYNC_IOPOLL, IORING_SETUP_IOPOLL},
+   {"taskrun", ASYNC_COOP_TASKRUN, IORING_SETUP_COOP_TASKRUN},
+};
+#define N_RING_PROFILES (sizeof(ring_profiles) / sizeof(ring_profiles[0]))
+
 /* Loader initialization method. */
 static int
 Loader_init(PyObject *self, PyObject *args, PyObject *kwds)
@@ -354,17 +1596,38 @@ Loader_init(PyObject *self, PyObject *args, PyObject *kwds)
    Loader *loader = (Loader *) self;
 
    /* Parse arguments. */
-   int direct = 0;
+   int direct = 0, fixed_buffers = 0, hugepages = 0, threaded_workers = 0;
+   int uring_open = 0, always_sort = 0;
    size_t queue_depth, n_workers, dispatch_n, max_idle_iters;
+   size_t max_file_size = 0, arena_size = 0, inline_size = 0, n_readers = 1;
+   size_t max_inflight = 0;
+   PyObject *worker_nodes = Py_None;
+   char *name = NULL, *ring_profile = "default";
    static char *kwlist[] = {
-      "queue_depth", "n_workers", "dispatch_n", "max_idle_iters", "direct", NULL
+      "queue_depth", "n_workers", "dispatch_n", "max_idle_iters", "direct",
+      "max_file_size", "arena_size", "fixed_buffers", "hugepages",
+      "worker_nodes", "inline_size", "threaded_workers", "name", "n_readers",
+      "uring_open", "ring_profile", "max_inflight", "always_sort", NULL
    };
-   if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkkk|p", kwlist,
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkkk|pkkppOkpzkpskp", kwlist,
                                     &queue_depth,
                                     &n_workers,
                                     &dispatch_n,
                                     &max_idle_iters,
-                                    &direct)) {
+                                    &direct,
+                                    &max_file_size,
+                                    &arena_size,
+                                    &fixed_buffers,
+                                    &hugepages,
+                                    &worker_nodes,
+                                    &inline_size,
+                                    &threaded_workers,
+                                    &name,
+                                    &n_readers,
+                                    &uring_open,
+                                    &ring_profile,
+                                    &max_inflight,
+                                    &always_sort)) {
       PyErr_SetString(PyExc_Exception, "missing/invalid argument");
       return -1;
    }
@@ -372,34 +1635,173 @@ Loader_init(PyObject *self, PyObject *args, PyObject *kwds)
    /* Sanity-check arguments. */
    ARG_CHECK(queue_depth > 0, "queue depth must be positive", -1);
    ARG_CHECK(n_workers > 0, "must have >=1 worker(s)", -1);
-
-   /* Allocate lstate using shared memory. */
-   if ((loader->loader = mmap_alloc(sizeof(lstate_t))) == NULL) {
-      PyErr_SetString(PyExc_Exception, "failed to allocate loader struct");
-      return -1;
+   ARG_CHECK(n_readers > 0 && n_readers <= n_workers,
+             "must have between 1 and n_workers reader(s)",
+             -1);
+   ARG_CHECK(max_file_size > 0 || arena_size > 0,
+             "must specify max_file_size or arena_size",
+             -1);
+   size_t profile = 0;
+   while (profile < N_RING_PROFILES &&
+          strcmp(ring_profiles[profile].name, ring_profile) != 0) {
+      profile++;
+   }
+   ARG_CHECK(profile < N_RING_PROFILES,
+             "ring_profile must be default, sqpoll, iopoll or taskrun",
+             -1);
+   ARG_CHECK(ring_profiles[profile].flag != ASYNC_IOPOLL || (direct && !uring_open),
+             "iopoll requires direct, and can't be used with uring_open",
+             -1);
+
+   /* Collect the workers' NUMA nodes, if given. */
+   int *nodes = NULL;
+   if (worker_nodes != Py_None) {
+      ARG_CHECK(PySequence_Check(worker_nodes) &&
+                PySequence_Size(worker_nodes) == (Py_ssize_t) n_workers,
+                "worker_nodes must be a sequence of n_workers nodes",
+                -1);
+      if ((nodes = PyMem_Malloc(n_workers * sizeof(int))) == NULL) {
+         PyErr_NoMemory();
+         return -1;
+      }
+      for (size_t i = 0; i < n_workers; i++) {
+         PyObject *node = PySequence_GetItem(worker_nodes, i);
+         nodes[i] = node == NULL ? -1 : (int) PyLong_AsLong(node);
+         Py_XDECREF(node);
+         if (PyErr_Occurred()) {
+            PyMem_Free(nodes);
+            return -1;
+         }
+      }
    }
 
-   /* Initialize the loader. */
-   int status = async_init(loader->loader,
+   /* Create the loader. */
+   int status = async_init(&loader->loader,
+                           name,
                            queue_depth,
+                           max_file_size,
+                           arena_size,
+                           inline_size,
                            n_workers,
+                           n_readers,
                            dispatch_n,
                            max_idle_iters,
-                           direct ? __O_DIRECT : 0);
+                           max_inflight,
+                           direct ? __O_DIRECT : 0,
+                           (fixed_buffers ? ASYNC_FIXED_BUFFERS : 0) |
+                           (hugepages ? ASYNC_HUGEPAGES : 0) |
+                           (threaded_workers ? ASYNC_THREADED_WORKERS : 0) |
+                           (uring_open ? ASYNC_URING_OPEN : 0) |
+                           (always_sort ? ASYNC_ALWAYS_SORT : 0) |
+                           ring_profiles[profile].flag,
+                           nodes);
+   PyMem_Free(nodes);
    if (status < 0) {
       PyErr_Format(PyExc_Exception,
                    "failed to initialize loader; %s",
                    strerror(-status));
+      loader->loader = NULL;
+      return -1;
+   }
+   loader->creator = getpid();
+   if (name != NULL && Loader_register(loader) < 0) {
       return -1;
    }
 
    return 0;
 }
 
+/* Get the named loader NAME, attaching to it if it isn't mapped into this
+   process yet. On success, returns a new reference to the loader. On failure,
+   returns NULL with an exception set. */
+static PyObject *
+Loader_open(const char *name)
+{
+   /* Calling a weak reference returns its object, or None if it's gone. */
+   PyObject *ref = PyDict_GetItemString(named_loaders, name);
+   if (ref != NULL) {
+      PyObject *existing = PyObject_CallObject(ref, NULL);
+      if (existing == NULL || existing != Py_None) {
+         return existing;
+      }
+      Py_DECREF(existing);
+   }
+
+   Loader *loader;
+   if ((loader = (Loader *) Loader_new(&PythonLoaderType, NULL, NULL)) == NULL) {
+      return NULL;
+   }
+   int status = async_attach(&loader->loader, name);
+   if (status < 0) {
+      PyErr_Format(PyExc_Exception,
+                   "failed to attach to loader %s; %s",
+                   name,
+                   status == -EEXIST ? "its address is in use in this process" :
+                   status == -EPROTO ? "it was created by an incompatible version" :
+                   strerror(-status));
+      loader->loader = NULL;
+      Py_DECREF(loader);
+      return NULL;
+   }
+   loader->attached = true;
+   loader->creator = getpid();
+   if (Loader_register(loader) < 0) {
+      Py_DECREF(loader);
+      return NULL;
+   }
+
+   return (PyObject *) loader;
+}
+
+/* Loader method to attach to the named loader NAME, created by another
+   process. Its workers may then be used as in processes forked from the
+   creator. */
+static PyObject *
+Loader_attach(PyObject *cls, PyObject *args, PyObject *kwds)
+{
+   char *name;
+   static char *kwlist[] = {"name", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &name)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+
+   return Loader_open(name);
+}
+
+/* Loader method to get the loader's name, or None if it's anonymous. */
+static PyObject *
+Loader_get_name(Loader *self, PyObject *args, PyObject *kwds)
+{
+   if (self->loader->name[0] == '\0') {
+      Py_INCREF(Py_None);
+      return Py_None;
+   }
+
+   return PyUnicode_FromString(self->loader->name);
+}
+
+/* Loader method to get the profile the readers' rings were set up with; the one
+   requested, unless the kernel didn't support it. */
+static PyObject *
+Loader_get_ring_profile(Loader *self, PyObject *args, PyObject *kwds)
+{
+   for (size_t i = 1; i < N_RING_PROFILES; i++) {
+      if (self->loader->ring_flags & ring_profiles[i].setup) {
+         return PyUnicode_FromString(ring_profiles[i].name);
+      }
+   }
+
+   return PyUnicode_FromString(ring_profiles[0].name);
+}
+
 /* Loader method to become a loader process. */
 static PyObject *
 Loader_become_loader(Loader *self, PyObject *args, PyObject *kwds)
 {
+   ARG_CHECK(self->runner != getpid(), "loader is already running in this process", NULL);
+   ARG_CHECK(!self->attached, "attached loaders can't run the loader", NULL);
+
    /* Start the loader. */
    async_start(self->loader);
 
@@ -410,6 +1812,9 @@ Loader_become_loader(Loader *self, PyObject *args, PyObject *kwds)
 static PyObject *
 Loader_spawn_loader(Loader *self, PyObject *args, PyObject *kwds)
 {
+   ARG_CHECK(self->runner != getpid(), "loader is already running in this process", NULL);
+   ARG_CHECK(!self->attached, "attached loaders can't run the loader", NULL);
+
    /* Fork. Child starts the loader. */
    if (fork() == 0) {
       async_start(self->loader);
@@ -421,6 +1826,152 @@ Loader_spawn_loader(Loader *self, PyObject *args, PyObject *kwds)
    return PyLong_FromLong(0);
 }
 
+/* Loader method to start the loader's threads in this process, without
+   forking. Returns immediately; the threads run until STOP is called. */
+static PyObject *
+Loader_start(Loader *self, PyObject *args, PyObject *kwds)
+{
+   ARG_CHECK(self->runner != getpid(), "loader is already running in this process", NULL);
+   ARG_CHECK(!self->attached, "attached loaders can't run the loader", NULL);
+
+   int status = async_launch(self->loader);
+   if (status < 0) {
+      PyErr_Format(PyExc_Exception,
+                   "failed to start loader threads; %s",
+                   strerror(-status));
+      return NULL;
+   }
+   self->runner = getpid();
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+/* Loader method to stop the threads started by START, once the IO they've
+   already issued completes. */
+static PyObject *
+Loader_stop(Loader *self, PyObject *args, PyObject *kwds)
+{
+   ARG_CHECK(self->runner == getpid(), "loader was not started in this process", NULL);
+
+   Py_BEGIN_ALLOW_THREADS
+   async_stop(self->loader);
+   Py_END_ALLOW_THREADS
+   self->runner = 0;
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+/* Loader method to serve the loader's workers to jobs in other processes, as a
+   daemon listening on the Unix socket at PATH. Starts the loader's threads in
+   this process if they aren't running yet. Serves until interrupted (e.g., by
+   KeyboardInterrupt), and only returns by raising. */
+static PyObject *
+Loader_serve(Loader *self, PyObject *args, PyObject *kwds)
+{
+   char *path;
+   static char *kwlist[] = {"path", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+   ARG_CHECK(self->loader->name[0] != '\0', "only named loaders can be served", NULL);
+   ARG_CHECK(!self->attached, "attached loaders can't be served", NULL);
+
+   daemon_t daemon;
+   int status = daemon_init(&daemon, self->loader, path);
+   if (status < 0) {
+      PyErr_Format(PyExc_Exception,
+                   "failed to listen on %s; %s",
+                   path,
+                   strerror(-status));
+      return NULL;
+   }
+   bool started = self->runner != getpid();
+   if (started && (status = async_launch(self->loader)) < 0) {
+      daemon_close(&daemon);
+      PyErr_Format(PyExc_Exception,
+                   "failed to start loader threads; %s",
+                   strerror(-status));
+      return NULL;
+   }
+   self->runner = getpid();
+
+   while (true) {
+      Py_BEGIN_ALLOW_THREADS
+      status = daemon_poll(&daemon, SERVE_POLL_MS);
+      Py_END_ALLOW_THREADS
+      if (status < 0 && status != -EINTR) {
+         PyErr_Format(PyExc_Exception,
+                      "failed to serve clients; %s",
+                      strerror(-status));
+         break;
+      } else if (PyErr_CheckSignals() < 0) {
+         break;
+      }
+   }
+
+   daemon_close(&daemon);
+   if (started) {
+      Py_BEGIN_ALLOW_THREADS
+      async_stop(self->loader);
+      Py_END_ALLOW_THREADS
+      self->runner = 0;
+   }
+
+   return NULL;
+}
+
+/* Loader method to lease a worker from the daemon listening at PATH, attaching
+   to its loader. The worker may have no more than DEPTH entries in use at once
+   (or its whole queue, if 0). The lease ends when the worker is deleted, which
+   is only once every entry and batch gotten from it (each holding the worker)
+   has been deleted too. */
+static PyObject *
+Loader_connect(PyObject *cls, PyObject *args, PyObject *kwds)
+{
+   char *path;
+   size_t depth = 0;
+   static char *kwlist[] = {"path", "depth", NULL};
+   if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|k", kwlist, &path, &depth)) {
+      PyErr_SetString(PyExc_Exception, "missing/invalid argument");
+      return NULL;
+   }
+
+   daemon_lease_t lease;
+   int status;
+   Py_BEGIN_ALLOW_THREADS
+   status = daemon_connect(&lease, path, depth);
+   Py_END_ALLOW_THREADS
+   if (status < 0) {
+      PyErr_Format(PyExc_Exception,
+                   "failed to connect to %s; %s",
+                   path,
+                   status == -EBUSY ? "every worker is in use" :
+                   status == -EPROTO ? "it was started by an incompatible version" :
+                   strerror(-status));
+      return NULL;
+   }
+
+   /* Become the context for the leased worker, as when unpickled. */
+   Worker *worker;
+   if ((worker = (Worker *) Worker_new(&PythonWorkerType, NULL, NULL)) == NULL) {
+      daemon_disconnect(&lease);
+      return NULL;
+   }
+   worker->lease = lease.fd;
+   PyObject *init_args = Py_BuildValue("(sk)", lease.name, (unsigned long) lease.worker);
+   if (init_args == NULL || Worker_init((PyObject *) worker, init_args, NULL) < 0) {
+      Py_XDECREF(init_args);
+      Py_DECREF(worker);
+      return NULL;
+   }
+   Py_DECREF(init_args);
+
+   return (PyObject *) worker;
+}
+
 /* Loader method to get the context for the worker with the given ID. */
 static PyObject *
 Loader_get_worker_context(Loader *self, PyObject *args, PyObject *kwds)
@@ -444,10 +1995,51 @@ Loader_get_worker_context(Loader *self, PyObject *args, PyObject *kwds)
 
    /* Fill the wrapper. */
    worker->worker = &self->loader->states[id];
+   Py_INCREF(self);
+   worker->owner = (PyObject *) self;
 
    return (PyObject *) worker;
 }
 
+/* Loader method to get statistics for the data arena; its size, the kind of
+   pages backing it, and usage statistics if it has an allocator. Returns None
+   if the loader does not have a data arena. */
+static PyObject *
+Loader_get_arena_stats(Loader *self, PyObject *args, PyObject *kwds)
+{
+   lstate_t *ld = self->loader;
+   if (ld->arena == NULL) {
+      Py_INCREF(Py_None);
+      return Py_None;
+   }
+
+   static const char *page_kinds[] = {
+      [PAGES_SMALL] = "small",
+      [PAGES_THP] = "thp",
+      [PAGES_HUGETLB] = "hugetlb",
+   };
+   if (ld->buddy == NULL) {
+      return Py_BuildValue("{s:k,s:s}",
+                           "capacity", ld->arena_size,
+                           "pages", page_kinds[ld->arena_pages]);
+   }
+
+   buddy_stats_t stats;
+   buddy_get_stats(ld->buddy, &stats);
+
+   return Py_BuildValue("{s:k,s:s,s:k,s:k,s:k,s:k,s:k,s:k,s:d,s:d}",
+                        "capacity", stats.capacity,
+                        "pages", page_kinds[ld->arena_pages],
+                        "in_use", stats.in_use,
+                        "requested", stats.requested,
+                        "high_water", stats.high_water,
+                        "largest_free", stats.largest_free,
+                        "n_allocs", stats.n_allocs,
+                        "n_failed", stats.n_failed,
+                        "internal_frag", stats.internal_frag,
+                        "external_frag", stats.external_frag);
+}
+
 /* Loader methods array. */
 static PyMethodDef Loader_methods[] = {
    {
@@ -462,12 +2054,60 @@ static PyMethodDef Loader_methods[] = {
       METH_NOARGS,
       "Fork and spawn a loader process as a child."
    },
+   {
+      "start",
+      (PyCFunction) Loader_start,
+      METH_NOARGS,
+      "Start the loader's threads in this process."
+   },
+   {
+      "stop",
+      (PyCFunction) Loader_stop,
+      METH_NOARGS,
+      "Stop the loader's threads started by start()."
+   },
    {
       "get_worker_context",
       (PyCFunction) Loader_get_worker_context,
       METH_VARARGS | METH_KEYWORDS,
       "Get context for specified worker."
    },
+   {
+      "get_arena_stats",
+      (PyCFunction) Loader_get_arena_stats,
+      METH_NOARGS,
+      "Get usage statistics for the data arena."
+   },
+   {
+      "get_name",
+      (PyCFunction) Loader_get_name,
+      METH_NOARGS,
+      "Get the loader's name, or None if it's anonymous."
+   },
+   {
+      "get_ring_profile",
+      (PyCFunction) Loader_get_ring_profile,
+      METH_NOARGS,
+      "Get the profile the loader's io_uring instances were set up with."
+   },
+   {
+      "attach",
+      (PyCFunction) Loader_attach,
+      METH_VARARGS | METH_KEYWORDS | METH_STATIC,
+      "Attach to the named loader created by another process."
+   },
+   {
+      "serve",
+      (PyCFunction) Loader_serve,
+      METH_VARARGS | METH_KEYWORDS,
+      "Serve the loader's workers to other processes, as a daemon."
+   },
+   {
+      "connect",
+      (PyCFunction) Loader_connect,
+      METH_VARARGS | METH_KEYWORDS | METH_STATIC,
+      "Lease a worker from the daemon listening at the given path."
+   },
    {NULL}
 };
 
@@ -485,6 +2125,7 @@ static PyTypeObject PythonLoaderType = {
     .tp_new = Loader_new,
     .tp_init = Loader_init,
     .tp_methods = Loader_methods,
+    .tp_weaklistoffset = offsetof(Loader, weakrefs),
 };
 
 
@@ -524,13 +2165,22 @@ PyInit_AsyncLoader(void)
 
    /* Ready all types. */
    if (PyType_Ready(&PythonEntryType)  < 0 ||
+       PyType_Ready(&PythonRegionType) < 0 ||
+       PyType_Ready(&PythonBatchType)  < 0 ||
        PyType_Ready(&PythonWorkerType) < 0 ||
        PyType_Ready(&PythonLoaderType) < 0) {
       return NULL;
    }
 
+   /* Named loaders are tracked for the lifetime of the module. */
+   if ((named_loaders = PyDict_New()) == NULL) {
+      Py_DECREF(module);
+      return NULL;
+   }
+
    /* Register all types. */
    REGISTER_TYPE(module, "Entry", &PythonEntryType);
+   REGISTER_TYPE(module, "Batch", &PythonBatchType);
    REGISTER_TYPE(module, "Worker", &PythonWorkerType);
    REGISTER_TYPE(module, "Loader", &PythonLoaderType);
 
@@ -0,0 +1,80 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef __ASYNC_LOADER_DLPACK_H_
+#define __ASYNC_LOADER_DLPACK_H_
+
+/* The subset of the DLPack ABI (https://dmlc.github.io/dlpack/latest/) needed
+   to export CPU tensors through the unversioned "dltensor" capsule. Layouts
+   must match dlpack.h exactly. */
+
+#include <stdint.h>
+
+/* Name of a DLManagedTensor capsule, and of one a consumer has taken. */
+#define DLPACK_CAPSULE_NAME      "dltensor"
+#define DLPACK_USED_CAPSULE_NAME "used_dltensor"
+
+/* Device types. */
+typedef enum {
+    kDLCPU = 1,
+} DLDeviceType;
+
+/* Device on which a tensor's data lives. */
+typedef struct {
+    DLDeviceType device_type;
+    int32_t      device_id;
+} DLDevice;
+
+/* Type codes. */
+typedef enum {
+    kDLInt = 0U,
+    kDLUInt = 1U,
+    kDLFloat = 2U,
+} DLDataTypeCode;
+
+/* Element type. */
+typedef struct {
+    uint8_t  code;
+    uint8_t  bits;
+    uint16_t lanes;
+} DLDataType;
+
+/* Tensor view of some memory. */
+typedef struct {
+    void       *data;
+    DLDevice    device;
+    int32_t     ndim;
+    DLDataType  dtype;
+    int64_t    *shape;
+    int64_t    *strides;        /* NULL for compact row-major. */
+    uint64_t    byte_offset;
+} DLTensor;
+
+/* Tensor plus the means for its consumer to release it. */
+typedef struct DLManagedTensor {
+    DLTensor  dl_tensor;
+    void     *manager_ctx;
+    void    (*deleter)(struct DLManagedTensor *self);
+} DLManagedTensor;
+
+#endif
@@ -0,0 +1,352 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#define _GNU_SOURCE
+#include "daemon.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Fill ADDR with the address of the Unix socket at PATH. Returns 0 on success,
+   and -ENAMETOOLONG if PATH doesn't fit. */
+static int
+daemon_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+/* Check whether the socket at ADDR was left behind by a daemon which is no
+   longer running; i.e., nothing is listening on it. */
+static bool
+daemon_stale(struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    bool stale = connect(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 &&
+                 errno == ECONNREFUSED;
+    close(fd);
+
+    return stale;
+}
+
+/* Start serving LOADER, a named loader, to clients connecting to the Unix
+   socket at PATH. A socket left at PATH by a daemon which is no longer running
+   is replaced. Clients are only served while DAEMON_POLL is being called, and
+   the loader's threads must be run separately (e.g., with ASYNC_LAUNCH). On
+   success, initializes DAEMON and returns 0. On failure, returns negative
+   ERRNO value. */
+int
+daemon_init(daemon_t *daemon, lstate_t *loader, const char *path)
+{
+    if (loader->name[0] == '\0') {
+        return -EINVAL;
+    }
+    struct sockaddr_un addr;
+    int status = daemon_address(&addr, path);
+    if (status < 0) {
+        return status;
+    }
+
+    /* Listen. Messages keep their boundaries, so requests and replies are
+       always read whole. */
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        status = -errno;
+        if (status == -EADDRINUSE && daemon_stale(&addr)) {
+            unlink(path);
+            status = bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ? -errno : 0;
+        }
+    }
+    if (status == 0 && listen(fd, SOMAXCONN) < 0) {
+        status = -errno;
+        unlink(path);
+    }
+    if (status < 0) {
+        close(fd);
+        return status;
+    }
+
+    /* Every worker starts out free, with nobody connected. */
+    size_t n = loader->n_states;
+    daemon->loader = loader;
+    strcpy(daemon->path, path);
+    daemon->fds = malloc((n + 1) * sizeof(struct pollfd));
+    daemon->registered = calloc(n, sizeof(bool));
+    daemon->draining = calloc(n, sizeof(bool));
+    daemon->held = malloc(n * loader->states[0].capacity * sizeof(size_t));
+    daemon->n_held = calloc(n, sizeof(size_t));
+    if (daemon->fds == NULL ||
+        daemon->registered == NULL ||
+        daemon->draining == NULL ||
+        daemon->held == NULL ||
+        daemon->n_held == NULL) {
+        free(daemon->fds);
+        free(daemon->registered);
+        free(daemon->draining);
+        free(daemon->held);
+        free(daemon->n_held);
+        close(fd);
+        unlink(path);
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i <= n; i++) {
+        daemon->fds[i].fd = i == 0 ? fd : -1;
+        daemon->fds[i].events = POLLIN;
+        daemon->fds[i].revents = 0;
+    }
+
+    return 0;
+}
+
+/* End the lease of DAEMON's worker ID, disconnecting its client. The worker's
+   withheld entries are returned, and it's reclaimed once the client's requests
+   have completed. */
+static void
+daemon_end_lease(daemon_t *daemon, size_t id)
+{
+    close(daemon->fds[id + 1].fd);
+    daemon->fds[id + 1].fd = -1;
+    if (!daemon->registered[id]) {
+        return;
+    }
+
+    wstate_t *state = &daemon->loader->states[id];
+    size_t *held = &daemon->held[id * state->capacity];
+    size_t pushed = ring_push_many(&state->free, held, daemon->n_held[id]);
+    assert(pushed == daemon->n_held[id]);
+    (void) pushed;
+    daemon->n_held[id] = 0;
+    daemon->registered[id] = false;
+    daemon->draining[id] = true;
+}
+
+/* Register the client connected to DAEMON's worker ID, which sent REQUEST,
+   replying with its lease. Entries beyond the client's quota are withheld
+   from the worker's free ring until the lease ends. */
+static void
+daemon_register(daemon_t *daemon, size_t id, daemon_request_t *request)
+{
+    wstate_t *state = &daemon->loader->states[id];
+    daemon_reply_t reply;
+    memset(&reply, 0, sizeof(reply));
+    if (request->version != ASYNC_SHM_VERSION) {
+        reply.status = -EPROTO;
+    } else {
+        size_t depth = request->depth == 0 || request->depth > state->capacity ?
+                       state->capacity : request->depth;
+        size_t *held = &daemon->held[id * state->capacity];
+        daemon->n_held[id] = ring_pop_many(&state->free, held, state->capacity - depth);
+        daemon->registered[id] = true;
+
+        reply.worker = (uint32_t) id;
+        reply.depth = (uint32_t) (state->capacity - daemon->n_held[id]);
+        strcpy(reply.name, daemon->loader->name);
+    }
+
+    if (send(daemon->fds[id + 1].fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply) ||
+        reply.status < 0) {
+        daemon_end_lease(daemon, id);
+    }
+}
+
+/* Accept a connection to DAEMON, giving it a free worker to lease once it
+   registers. If every worker is leased (or being reclaimed), the client is
+   told so, and disconnected. */
+static void
+daemon_accept(daemon_t *daemon)
+{
+    int fd = accept4(daemon->fds[0].fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < daemon->loader->n_states; i++) {
+        if (daemon->fds[i + 1].fd < 0 && !daemon->draining[i]) {
+            daemon->fds[i + 1].fd = fd;
+            daemon->registered[i] = false;
+            return;
+        }
+    }
+
+    daemon_reply_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.status = -EBUSY;
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+
+    /* Closing with the client's request unread would reset the connection,
+       discarding the reply, so stop it sending first, and drain it. */
+    daemon_request_t request;
+    shutdown(fd, SHUT_RDWR);
+    while (recv(fd, &request, sizeof(request), MSG_DONTWAIT) > 0) {}
+    close(fd);
+}
+
+/* Serve DAEMON's clients for a while; accept connections, register clients,
+   end the leases of clients which disconnect (or exit), and reclaim their
+   workers. Waits up to TIMEOUT milliseconds (forever, if negative) for any of
+   that to happen. On success, returns 0. On failure, returns negative ERRNO
+   value; -EINTR if interrupted by a signal. */
+int
+daemon_poll(daemon_t *daemon, int timeout)
+{
+    size_t n = daemon->loader->n_states;
+
+    /* Reclaim workers once their clients' requests have completed. */
+    bool draining = false;
+    for (size_t i = 0; i < n; i++) {
+        if (daemon->draining[i]) {
+            daemon->draining[i] = async_reclaim(&daemon->loader->states[i]) == -EBUSY;
+            draining |= daemon->draining[i];
+        }
+    }
+    if (draining && (timeout < 0 || timeout > DAEMON_RECLAIM_MS)) {
+        timeout = DAEMON_RECLAIM_MS;
+    }
+
+    if (poll(daemon->fds, n + 1, timeout) < 0) {
+        return -errno;
+    }
+
+    /* Registered clients only ever disconnect. */
+    for (size_t i = 0; i < n; i++) {
+        short revents = daemon->fds[i + 1].revents;
+        if (revents == 0) {
+            continue;
+        }
+        if (!daemon->registered[i] && (revents & POLLIN)) {
+            daemon_request_t request;
+            ssize_t len = recv(daemon->fds[i + 1].fd, &request, sizeof(request), MSG_DONTWAIT);
+            if (len == sizeof(request)) {
+                daemon_register(daemon, i, &request);
+                continue;
+            } else if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+        }
+        daemon_end_lease(daemon, i);
+    }
+    if (daemon->fds[0].revents & POLLIN) {
+        daemon_accept(daemon);
+    }
+
+    return 0;
+}
+
+/* Stop serving clients, disconnecting them, and free DAEMON. Workers still
+   leased aren't reclaimed. */
+void
+daemon_close(daemon_t *daemon)
+{
+    for (size_t i = 0; i <= daemon->loader->n_states; i++) {
+        if (daemon->fds[i].fd >= 0) {
+            close(daemon->fds[i].fd);
+        }
+    }
+    unlink(daemon->path);
+    free(daemon->fds);
+    free(daemon->registered);
+    free(daemon->draining);
+    free(daemon->held);
+    free(daemon->n_held);
+}
+
+/* Connect to the daemon listening at PATH, leasing one of its workers, with a
+   quota of DEPTH entries in use at once (or a whole worker's queue if 0). The
+   worker can be used once its loader, named in LEASE, has been attached to.
+   On success, fills LEASE, and returns 0. On failure, returns negative ERRNO
+   value; -EBUSY if every worker is already leased. */
+int
+daemon_connect(daemon_lease_t *lease, const char *path, size_t depth)
+{
+    struct sockaddr_un addr;
+    int status = daemon_address(&addr, path);
+    if (status < 0) {
+        return status;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        status = -errno;
+        close(fd);
+        return status;
+    }
+
+    /* Register, and wait for the lease. If every worker is in use, the daemon
+       may reply and disconnect before the request is sent, so the reply is
+       read even if sending failed. */
+    daemon_request_t request = {
+        .version = ASYNC_SHM_VERSION,
+        .depth = (uint32_t) (depth < UINT32_MAX ? depth : UINT32_MAX),
+    };
+    daemon_reply_t reply;
+    ssize_t len;
+    send(fd, &request, sizeof(request), MSG_NOSIGNAL);
+    while ((len = recv(fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR) {}
+    if (len < 0 || len != sizeof(reply)) {
+        status = len < 0 ? -errno : -ECONNRESET;
+        close(fd);
+        return status;
+    }
+    if (reply.status < 0) {
+        close(fd);
+        return reply.status;
+    }
+
+    lease->fd = fd;
+    lease->worker = reply.worker;
+    lease->depth = reply.depth;
+    memcpy(lease->name, reply.name, sizeof(lease->name));
+    lease->name[SHM_NAME_MAX] = '\0';
+
+    return 0;
+}
+
+/* End LEASE, disconnecting from its daemon. The worker mustn't be used after. */
+void
+daemon_disconnect(daemon_lease_t *lease)
+{
+    close(lease->fd);
+    lease->fd = -1;
+}
@@ -0,0 +1,90 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef __ASYNC_DAEMON_H_
+#define __ASYNC_DAEMON_H_
+
+#include "../async/async.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <sys/un.h>
+
+/* How often (in milliseconds) workers whose leases ended are checked for
+   outstanding requests, until they can be reclaimed. */
+#define DAEMON_RECLAIM_MS (10)
+
+/* Registration request, sent by a client once connected. */
+typedef struct daemon_request {
+    uint32_t version;   /* ASYNC_SHM_VERSION of the client. */
+    uint32_t depth;     /* Most entries the client wants in use at once, or 0
+                           for a whole worker's queue. */
+} daemon_request_t;
+
+/* Reply to a registration request. */
+typedef struct daemon_reply {
+    int32_t  status;                    /* 0, or negative ERRNO value if the
+                                           client wasn't registered. */
+    uint32_t worker;                    /* ID of the worker leased. */
+    uint32_t depth;                     /* Most entries the client may have in
+                                           use at once; its quota. */
+    char     name[SHM_NAME_MAX + 1];    /* Name of the loader to attach to. */
+} daemon_reply_t;
+
+/* A client's lease of one of a daemon's workers. */
+typedef struct daemon_lease {
+    int      fd;                        /* Connection to the daemon. The lease
+                                           ends when it's closed. */
+    size_t   worker;                    /* ID of the worker leased. */
+    size_t   depth;                     /* Quota, as in DAEMON_REPLY_T. */
+    char     name[SHM_NAME_MAX + 1];    /* Name of the daemon's loader. */
+} daemon_lease_t;
+
+/* Daemon state. A named loader, whose workers are leased to clients (e.g.,
+   jobs) connected over a Unix socket, so that every client's IO is issued, and
+   sorted, together. Private to the daemon's process. */
+typedef struct daemon {
+    lstate_t      *loader;      /* Loader whose workers are leased. */
+    char           path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+                                /* Path of the listening socket. */
+    struct pollfd *fds;         /* The listening socket, followed by each
+                                   worker's client connection (-1 if none). */
+    bool          *registered;  /* Whether each worker's client has sent its
+                                   registration request. */
+    bool          *draining;    /* Whether each worker's lease has ended, and
+                                   it's waiting to be reclaimed. */
+    size_t        *held;        /* Entries withheld from each worker's free
+                                   ring, to enforce its client's quota; the
+                                   loader's queue depth per worker. */
+    size_t        *n_held;      /* Entries in each worker's part of HELD. */
+} daemon_t;
+
+int daemon_init(daemon_t *daemon, lstate_t *loader, const char *path);
+int daemon_poll(daemon_t *daemon, int timeout);
+void daemon_close(daemon_t *daemon);
+
+int daemon_connect(daemon_lease_t *lease, const char *path, size_t depth);
+void daemon_disconnect(daemon_lease_t *lease);
+
+#endif
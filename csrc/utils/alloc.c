@@ -21,13 +21,32 @@
    SOFTWARE.
    */
 
+#define _GNU_SOURCE
 #include "alloc.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
-#define _GNU_SOURCE
+#define BUDDY_NIL        ((size_t) -1)  /* Empty free list/link. */
+#define BUDDY_FREE       (0x80)         /* Meta flag; block is free. */
+#define BUDDY_USED       (0x40)         /* Meta flag; block is allocated. */
+#define BUDDY_ORDER_MASK (0x3F)         /* Meta bits holding the block order. */
+
+/* Free list links, stored in the first bytes of each free block. */
+typedef struct buddy_link {
+   size_t next;   /* Offset of next free block of the same order. */
+   size_t prev;   /* Offset of previous free block of the same order. */
+} buddy_link_t;
 
 
 /* Allocate shared memory using an anonymous mmap. If this process forks, and
@@ -41,15 +60,578 @@ mmap_alloc(size_t size)
 {
    /* Allocate SIZE bytes of page-aligned memory in an anonymous shared mmap. */
    assert(size > 0);
-   return mmap(NULL, size,
-               PROT_READ | PROT_WRITE,
-               MAP_ANONYMOUS | MAP_SHARED | MAP_POPULATE,
-               -1, 0);
+   void *ptr = mmap(NULL, size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_SHARED | MAP_POPULATE,
+                    -1, 0);
+
+   return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/* Check whether the kernel will back shared memory with transparent huge pages
+   when asked to with MADV_HUGEPAGE. */
+static bool
+shmem_thp_enabled(void)
+{
+   char buf[128];
+   FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+   if (f == NULL) {
+      return false;
+   }
+   size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+   fclose(f);
+   buf[n] = '\0';
+
+   return strstr(buf, "[never]") == NULL && strstr(buf, "[deny]") == NULL;
+}
+
+/* Allocate shared memory, as mmap_alloc does, but backed by huge pages where
+   possible. SIZE is rounded up to a multiple of HUGE_PAGE_SIZE, and must be
+   passed to mmap_free as such. Pages from the hugetlb pool are preferred; if
+   none are available, transparent huge pages are requested instead, and if the
+   kernel won't provide those, regular pages are used. The kind of pages used
+   is written to PAGES.
+
+   Returns a pointer to a SIZE-byte region of memory on success, and returns
+   NULL on failure. */
+void *
+mmap_alloc_huge(size_t *size, page_kind_t *pages)
+{
+   assert(*size > 0);
+   *size = ((*size - 1) | (HUGE_PAGE_SIZE - 1)) + 1;
+
+   /* Try hugetlb. The memfd is only needed to create the mapping, which is
+      inherited across fork like any other anonymous shared mapping. */
+   int fd = memfd_create("async-loader", MFD_CLOEXEC | MFD_HUGETLB);
+   if (fd >= 0) {
+      void *ptr = MAP_FAILED;
+      if (ftruncate(fd, *size) == 0) {
+         ptr = mmap(NULL, *size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    fd, 0);
+      }
+      close(fd);
+      if (ptr != MAP_FAILED) {
+         *pages = PAGES_HUGETLB;
+         return ptr;
+      }
+   }
+
+   /* Fall back to (transparent huge pages in) an anonymous shared mmap. The
+      advice has to be given before the region is populated. */
+   void *ptr = mmap(NULL, *size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_ANONYMOUS | MAP_SHARED,
+                    -1, 0);
+   if (ptr == MAP_FAILED) {
+      return NULL;
+   }
+   *pages = PAGES_SMALL;
+   if (shmem_thp_enabled() && madvise(ptr, *size, MADV_HUGEPAGE) == 0) {
+      *pages = PAGES_THP;
+   }
+   memset(ptr, 0, *size);
+
+   return ptr;
+}
+
+/* Place the pages of the SIZE bytes at PTR, which must be 4K aligned, on the
+   NUMA nodes in NODEMASK. If INTERLEAVE, pages are spread round-robin over the
+   nodes, and otherwise they are bound to them. Pages which are already
+   populated are moved, as long as no other process has them mapped yet (i.e.,
+   this is called before forking). Regions backed by hugetlb pages must be
+   aligned to HUGE_PAGE_SIZE.
+
+   Returns 0 on success, and negative ERRNO value on failure. */
+int
+mmap_bind(void *ptr, size_t size, unsigned long nodemask, bool interleave)
+{
+   assert(((uintptr_t) ptr & 0xFFF) == 0);
+   size = ((size - 1) | 0xFFF) + 1;
+
+   /* The kernel ignores the last bit of the mask it's told about. */
+   if (syscall(SYS_mbind,
+               ptr, size,
+               interleave ? MPOL_INTERLEAVE : MPOL_BIND,
+               &nodemask, 8 * sizeof(nodemask) + 1,
+               MPOL_MF_MOVE) < 0) {
+      return -errno;
+   }
+
+   return 0;
 }
 
-/* Free memory allocated with mmap_alloc. */
+/* Free memory allocated with mmap_alloc or mmap_alloc_huge. */
 void
 mmap_free(void *ptr, size_t size)
 {
    munmap(ptr, size);
 }
+
+/* Ask for the SIZE bytes of shared memory at PTR, which must not be populated
+   yet, to be backed by transparent huge pages. Returns the kind of pages the
+   kernel will use. */
+page_kind_t
+mmap_advise_huge(void *ptr, size_t size)
+{
+   if (shmem_thp_enabled() && madvise(ptr, size, MADV_HUGEPAGE) == 0) {
+      return PAGES_THP;
+   }
+
+   return PAGES_SMALL;
+}
+
+/* Fault in the SIZE bytes of shared memory at PTR, which must not be in use
+   yet, as MAP_POPULATE would have. */
+void
+mmap_populate(void *ptr, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+   if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0) {
+      return;
+   }
+#endif
+   for (size_t off = 0; off < size; off += 4096) {
+      ((volatile uint8_t *) ptr)[off] = 0;
+   }
+}
+
+
+/* ----------------------- */
+/*   NAMED SHARED MEMORY   */
+/* ----------------------- */
+
+/* Write the shm_open path of the segment NAME to PATH. Returns 0 on success,
+   and -ENAMETOOLONG if NAME is too long (or empty, or contains a slash). */
+static int
+shm_path(const char *name, char path[SHM_NAME_MAX + 2])
+{
+   size_t len = strnlen(name, SHM_NAME_MAX + 1);
+   if (len == 0 || len > SHM_NAME_MAX || strchr(name, '/') != NULL) {
+      return -ENAMETOOLONG;
+   }
+   snprintf(path, SHM_NAME_MAX + 2, "/%s", name);
+
+   return 0;
+}
+
+/* Create the named shared memory segment NAME (i.e., /dev/shm/NAME), with SIZE
+   usable bytes, mapping it into this process. The segment may be attached to
+   with shm_attach (with the same TAG) once it has been published with
+   shm_publish. Its memory is zeroed, but not populated. On success, returns 0,
+   and writes the address of the usable memory to PTR. On failure, returns
+   negative ERRNO value (-EEXIST if the name is already in use). */
+int
+shm_create(const char *name, size_t size, uint64_t tag, void **ptr)
+{
+   char path[SHM_NAME_MAX + 2];
+   int status = shm_path(name, path);
+   if (status < 0) {
+      return status;
+   }
+
+   int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+   if (fd < 0) {
+      return -errno;
+   }
+   size += SHM_HEADER_SIZE;
+   void *base = MAP_FAILED;
+   if (ftruncate(fd, size) == 0) {
+      base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+   status = -errno;
+   close(fd);
+   if (base == MAP_FAILED) {
+      shm_unlink(path);
+      return status;
+   }
+
+   shm_header_t *header = base;
+   header->tag = tag;
+   header->base = base;
+   header->size = size;
+   *ptr = (uint8_t *) base + SHM_HEADER_SIZE;
+
+   return 0;
+}
+
+/* Publish the segment whose usable memory is at PTR, once it's initialized,
+   allowing other processes to attach to it. */
+void
+shm_publish(void *ptr)
+{
+   shm_header_t *header = (shm_header_t *) ((uint8_t *) ptr - SHM_HEADER_SIZE);
+   atomic_store(&header->magic, SHM_MAGIC);
+}
+
+/* Attach to the named shared memory segment NAME, mapping it (populated) at
+   the same address as in its creator. On success, returns 0, and writes the
+   address of the usable memory to PTR. On failure, returns negative ERRNO
+   value; -ENOENT if there's no such segment, -EAGAIN if it hasn't been
+   published yet, -EPROTO if its tag doesn't match TAG, and -EEXIST if its
+   address is already in use in this process. */
+int
+shm_attach(const char *name, uint64_t tag, void **ptr)
+{
+   char path[SHM_NAME_MAX + 2];
+   int status = shm_path(name, path);
+   if (status < 0) {
+      return status;
+   }
+
+   int fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+   if (fd < 0) {
+      return -errno;
+   }
+
+   /* Validate the header before mapping anything. */
+   shm_header_t header;
+   ssize_t n = pread(fd, &header, sizeof(header), 0);
+   if (n != (ssize_t) sizeof(header)) {
+      status = n < 0 ? -errno : -EAGAIN;
+      close(fd);
+      return status;
+   }
+   if (atomic_load(&header.magic) != SHM_MAGIC) {
+      close(fd);
+      return -EAGAIN;
+   }
+   if (header.tag != tag) {
+      close(fd);
+      return -EPROTO;
+   }
+
+   /* Older kernels treat the address as a hint, rather than refusing it. */
+   void *base = mmap(header.base, header.size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE | MAP_FIXED_NOREPLACE,
+                     fd, 0);
+   status = -errno;
+   close(fd);
+   if (base == MAP_FAILED) {
+      return status;
+   }
+   if (base != header.base) {
+      munmap(base, header.size);
+      return -EEXIST;
+   }
+   *ptr = (uint8_t *) base + SHM_HEADER_SIZE;
+
+   return 0;
+}
+
+/* Unmap the segment whose usable memory is at PTR from this process. The
+   segment itself remains until removed with shm_remove. */
+void
+shm_detach(void *ptr)
+{
+   shm_header_t *header = (shm_header_t *) ((uint8_t *) ptr - SHM_HEADER_SIZE);
+   munmap(header->base, header->size);
+}
+
+/* Remove the named shared memory segment NAME. Processes which have it mapped
+   keep it until they detach. Returns 0 on success, and negative ERRNO value on
+   failure. */
+int
+shm_remove(const char *name)
+{
+   char path[SHM_NAME_MAX + 2];
+   int status = shm_path(name, path);
+   if (status < 0) {
+      return status;
+   }
+
+   return shm_unlink(path) < 0 ? -errno : 0;
+}
+
+
+/* ------------------- */
+/*   BUDDY ALLOCATOR   */
+/* ------------------- */
+
+/* Bytes of shared memory needed for a buddy_t managing N_BLOCKS smallest
+   blocks. The struct is followed by the requested size of each block, and then
+   by each block's metadata byte. */
+static size_t
+buddy_header_size(size_t n_blocks)
+{
+   return sizeof(buddy_t) + n_blocks * (sizeof(size_t) + sizeof(uint8_t));
+}
+
+/* Get the free list links of the free block at OFF. */
+static buddy_link_t *
+buddy_link(buddy_t *buddy, size_t off)
+{
+   return (buddy_link_t *) (buddy->base + off);
+}
+
+/* Get the metadata byte for the block at OFF. Only meaningful when OFF is the
+   start of a block; bytes for the interior of blocks are kept zeroed. */
+static uint8_t *
+buddy_meta(buddy_t *buddy, size_t off)
+{
+   return &buddy->meta[off >> buddy->min_order];
+}
+
+/* Get the requested size slot for the block at OFF. */
+static size_t *
+buddy_requested(buddy_t *buddy, size_t off)
+{
+   return &((size_t *) (buddy + 1))[off >> buddy->min_order];
+}
+
+/* Push the block at OFF onto the free list for ORDER. */
+static void
+buddy_push(buddy_t *buddy, size_t off, unsigned order)
+{
+   buddy_link_t *link = buddy_link(buddy, off);
+   link->prev = BUDDY_NIL;
+   link->next = buddy->free[order];
+   if (link->next != BUDDY_NIL) {
+      buddy_link(buddy, link->next)->prev = off;
+   }
+   buddy->free[order] = off;
+   *buddy_meta(buddy, off) = BUDDY_FREE | order;
+}
+
+/* Remove the block at OFF from the free list for ORDER. */
+static void
+buddy_remove(buddy_t *buddy, size_t off, unsigned order)
+{
+   buddy_link_t *link = buddy_link(buddy, off);
+   if (link->prev != BUDDY_NIL) {
+      buddy_link(buddy, link->prev)->next = link->next;
+   } else {
+      buddy->free[order] = link->next;
+   }
+   if (link->next != BUDDY_NIL) {
+      buddy_link(buddy, link->next)->prev = link->prev;
+   }
+   *buddy_meta(buddy, off) = 0;
+}
+
+/* Bytes of allocator state needed for a buddy allocator managing SIZE bytes,
+   a multiple of MIN_BLOCK. */
+size_t
+buddy_state_size(size_t size, size_t min_block)
+{
+   return buddy_header_size(size / min_block);
+}
+
+/* Initialize a buddy allocator in the zeroed buddy_state_size(SIZE, MIN_BLOCK)
+   bytes of shared memory at MEM, managing the SIZE bytes at BASE (a multiple
+   of MIN_BLOCK), and handing out blocks of MIN_BLOCK * 2^k bytes. MIN_BLOCK
+   must be a power of two. The caller owns both regions; the allocator must not
+   be passed to buddy_destroy.
+   
+   Returns a pointer to the allocator (i.e., MEM). */
+buddy_t *
+buddy_init(void *mem, void *base, size_t size, size_t min_block)
+{
+   assert(min_block >= sizeof(buddy_link_t));
+   assert((min_block & (min_block - 1)) == 0);
+   assert(min_block <= HUGE_PAGE_SIZE);
+   assert(size > 0 && (size & (min_block - 1)) == 0);
+
+   size_t n_blocks = size / min_block;
+   buddy_t *buddy = mem;
+   buddy->pages = PAGES_SMALL;
+   buddy->base = base;
+   buddy->size = size;
+   buddy->min_order = __builtin_ctzl(min_block);
+   buddy->meta_size = n_blocks;
+   buddy->meta = (uint8_t *) buddy + buddy_header_size(n_blocks) - n_blocks;
+   buddy->in_use = 0;
+   buddy->requested = 0;
+   buddy->high_water = 0;
+   buddy->n_allocs = 0;
+   buddy->n_failed = 0;
+   pthread_spin_init(&buddy->lock, PTHREAD_PROCESS_SHARED);
+
+   /* Carve the region into the largest naturally aligned blocks that fit. When
+      SIZE is not a power of two, some blocks have no buddy within the region,
+      and will simply never coalesce. The first block is the largest. */
+   for (unsigned i = 0; i <= BUDDY_MAX_ORDER; i++) {
+      buddy->free[i] = BUDDY_NIL;
+   }
+   size_t off = 0;
+   while (off < size) {
+      unsigned order = BUDDY_MAX_ORDER;
+      while ((off & ((1UL << order) - 1)) != 0 || off + (1UL << order) > size) {
+         order--;
+      }
+      buddy_push(buddy, off, order);
+      if (off == 0) {
+         buddy->max_order = order;
+      }
+      off += 1UL << order;
+   }
+
+   return buddy;
+}
+
+/* Create a buddy allocator managing SIZE bytes (rounded down to a multiple of
+   MIN_BLOCK) of shared memory, as buddy_init does. Both the managed region and
+   the allocator state are allocated with mmap_alloc, so the allocator may be
+   used from any process forked after creation. If HUGE is set, the managed
+   region is instead allocated with mmap_alloc_huge, and SIZE is rounded up to
+   a multiple of HUGE_PAGE_SIZE.
+   
+   Returns a pointer to the allocator on success, and NULL on failure. */
+buddy_t *
+buddy_create(size_t size, size_t min_block, bool huge)
+{
+   /* Figure out block sizes. */
+   size &= ~(min_block - 1);
+   if (size == 0) {
+      return NULL;
+   }
+   if (huge) {
+      size = ((size - 1) | (HUGE_PAGE_SIZE - 1)) + 1;
+   }
+
+   /* Allocate the allocator's state and the region it manages. */
+   size_t state_size = buddy_state_size(size, min_block);
+   void *mem = mmap_alloc(state_size);
+   if (mem == NULL) {
+      return NULL;
+   }
+   page_kind_t pages = PAGES_SMALL;
+   void *base = huge ? mmap_alloc_huge(&size, &pages) : mmap_alloc(size);
+   if (base == NULL) {
+      mmap_free(mem, state_size);
+      return NULL;
+   }
+
+   buddy_t *buddy = buddy_init(mem, base, size, min_block);
+   buddy->pages = pages;
+
+   return buddy;
+}
+
+/* Free a buddy allocator, and the region it manages. */
+void
+buddy_destroy(buddy_t *buddy)
+{
+   mmap_free(buddy->base, buddy->size);
+   mmap_free(buddy, buddy_header_size(buddy->meta_size));
+}
+
+/* Size of the largest block the allocator can ever hand out; the largest
+   naturally aligned power of two that fits in its region, which is smaller
+   than the region unless its size is a power of two. */
+size_t
+buddy_max_block(buddy_t *buddy)
+{
+   return 1UL << buddy->max_order;
+}
+
+/* Allocate a block of at least SIZE bytes. Returns a pointer to the block on
+   success, and NULL if no sufficiently large block is free. */
+void *
+buddy_alloc(buddy_t *buddy, size_t size)
+{
+   /* Find the smallest order that fits SIZE. */
+   unsigned order = buddy->min_order;
+   while (order <= BUDDY_MAX_ORDER && (1UL << order) < size) {
+      order++;
+   }
+
+   /* Find the smallest free block that fits. */
+   pthread_spin_lock(&buddy->lock);
+   unsigned k = order;
+   while (k <= BUDDY_MAX_ORDER && buddy->free[k] == BUDDY_NIL) {
+      k++;
+   }
+   if (k > BUDDY_MAX_ORDER) {
+      buddy->n_failed++;
+      pthread_spin_unlock(&buddy->lock);
+      return NULL;
+   }
+   size_t off = buddy->free[k];
+   buddy_remove(buddy, off, k);
+
+   /* Split the block until it is of the right order, freeing the upper half
+      at each step. */
+   while (k > order) {
+      k--;
+      buddy_push(buddy, off + (1UL << k), k);
+   }
+   *buddy_meta(buddy, off) = BUDDY_USED | order;
+   *buddy_requested(buddy, off) = size;
+
+   /* Update statistics. */
+   buddy->in_use += 1UL << order;
+   buddy->requested += size;
+   buddy->n_allocs++;
+   if (buddy->in_use > buddy->high_water) {
+      buddy->high_water = buddy->in_use;
+   }
+   pthread_spin_unlock(&buddy->lock);
+
+   return buddy->base + off;
+}
+
+/* Free a block allocated with buddy_alloc, coalescing it with its buddy for as
+   long as the buddy is also free. */
+void
+buddy_free(buddy_t *buddy, void *ptr)
+{
+   size_t off = (uint8_t *) ptr - buddy->base;
+   assert(off < buddy->size);
+
+   pthread_spin_lock(&buddy->lock);
+   uint8_t meta = *buddy_meta(buddy, off);
+   assert(meta & BUDDY_USED);
+   unsigned order = meta & BUDDY_ORDER_MASK;
+
+   /* Update statistics. */
+   buddy->in_use -= 1UL << order;
+   buddy->requested -= *buddy_requested(buddy, off);
+   buddy->n_allocs--;
+
+   /* Coalesce. Natural alignment means the buddy's start, if it is the start
+      of a free block at all, is the start of a block of at most ORDER. */
+   *buddy_meta(buddy, off) = 0;
+   while (order < BUDDY_MAX_ORDER) {
+      size_t other = off ^ (1UL << order);
+      if (other + (1UL << order) > buddy->size ||
+          *buddy_meta(buddy, other) != (BUDDY_FREE | order)) {
+         break;
+      }
+      buddy_remove(buddy, other, order);
+      off = off < other ? off : other;
+      order++;
+   }
+   buddy_push(buddy, off, order);
+   pthread_spin_unlock(&buddy->lock);
+}
+
+/* Fill STATS with a snapshot of the allocator's usage. */
+void
+buddy_get_stats(buddy_t *buddy, buddy_stats_t *stats)
+{
+   pthread_spin_lock(&buddy->lock);
+   stats->capacity = buddy->size;
+   stats->in_use = buddy->in_use;
+   stats->requested = buddy->requested;
+   stats->high_water = buddy->high_water;
+   stats->n_allocs = buddy->n_allocs;
+   stats->n_failed = buddy->n_failed;
+   stats->largest_free = 0;
+   for (int i = BUDDY_MAX_ORDER; i >= (int) buddy->min_order; i--) {
+      if (buddy->free[i] != BUDDY_NIL) {
+         stats->largest_free = 1UL << i;
+         break;
+      }
+   }
+   pthread_spin_unlock(&buddy->lock);
+
+   /* Derive fragmentation. */
+   size_t n_free = stats->capacity - stats->in_use;
+   stats->internal_frag = stats->in_use == 0 ? 0.0 :
+      (double) (stats->in_use - stats->requested) / stats->in_use;
+   stats->external_frag = n_free == 0 ? 0.0 :
+      1.0 - (double) stats->largest_free / n_free;
+}
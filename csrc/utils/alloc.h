@@ -25,8 +25,91 @@
 #define __UTILS_ALLOC_H_
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define BUDDY_MAX_ORDER (48)
+#define HUGE_PAGE_SIZE  (2UL * 1024 * 1024)
+#define MAX_NUMA_NODES  (64)    /* Bits in a node mask. */
+
+/* Kinds of pages backing an allocation. */
+typedef enum page_kind {
+    PAGES_SMALL = 0,    /* Regular (4K) pages. */
+    PAGES_THP,          /* Transparent huge pages, as far as the kernel allows. */
+    PAGES_HUGETLB,      /* Huge pages from the hugetlb pool. */
+} page_kind_t;
+
+/* Header at the start of a named shared memory segment. Segments are mapped
+   at the same address in every process, so pointers into them stay valid. */
+#define SHM_MAGIC       (0x4153594e43534d31UL)  /* "ASYNCSM1". */
+#define SHM_HEADER_SIZE (4096UL)                /* Bytes before the segment's
+                                                   usable memory. */
+#define SHM_NAME_MAX    (64)                    /* Longest segment name. */
+typedef struct shm_header {
+    _Atomic uint64_t magic;     /* SHM_MAGIC once published, else zero. */
+    uint64_t         tag;       /* Creator's layout tag; must match to attach. */
+    void            *base;      /* Address the segment is mapped at. */
+    size_t           size;      /* Bytes in the segment, including this header. */
+} shm_header_t;
+
+/* Buddy allocator statistics. */
+typedef struct buddy_stats {
+    size_t capacity;        /* Total bytes managed by the allocator. */
+    size_t in_use;          /* Bytes in allocated blocks. */
+    size_t requested;       /* Bytes requested by live allocations. */
+    size_t high_water;      /* Largest IN_USE seen so far. */
+    size_t largest_free;    /* Size of the largest free block. */
+    size_t n_allocs;        /* Number of live allocations. */
+    size_t n_failed;        /* Number of allocations which have failed. */
+    double internal_frag;   /* Fraction of IN_USE wasted by rounding. */
+    double external_frag;   /* Fraction of free bytes outside LARGEST_FREE. */
+} buddy_stats_t;
+
+/* Buddy allocator over a region of shared memory. The allocator's own state
+   lives in shared memory as well, so blocks may be allocated by one process
+   and freed by another, as long as both are forked from the creator (or have
+   attached to the named segment it was created in). */
+typedef struct buddy {
+    pthread_spinlock_t lock;            /* Protects everything below. */
+    uint8_t           *base;            /* Start of managed region. */
+    size_t             size;            /* Bytes in managed region. */
+    unsigned           min_order;       /* log2 of the smallest block size. */
+    unsigned           max_order;       /* log2 of the largest block size. */
+    uint8_t           *meta;            /* Per smallest-block metadata. */
+    size_t             meta_size;       /* Bytes in META. */
+    page_kind_t        pages;           /* Pages backing the managed region. */
+    size_t             free[BUDDY_MAX_ORDER + 1]; /* Free list heads (offsets). */
+
+    /* Statistics. */
+    size_t             in_use;
+    size_t             requested;
+    size_t             high_water;
+    size_t             n_allocs;
+    size_t             n_failed;
+} buddy_t;
 
 void *mmap_alloc(size_t size);
+void *mmap_alloc_huge(size_t *size, page_kind_t *pages);
+int mmap_bind(void *ptr, size_t size, unsigned long nodemask, bool interleave);
 void mmap_free(void *ptr, size_t size);
+page_kind_t mmap_advise_huge(void *ptr, size_t size);
+void mmap_populate(void *ptr, size_t size);
+
+int shm_create(const char *name, size_t size, uint64_t tag, void **ptr);
+void shm_publish(void *ptr);
+int shm_attach(const char *name, uint64_t tag, void **ptr);
+void shm_detach(void *ptr);
+int shm_remove(const char *name);
+
+size_t buddy_state_size(size_t size, size_t min_block);
+buddy_t *buddy_init(void *mem, void *base, size_t size, size_t min_block);
+buddy_t *buddy_create(size_t size, size_t min_block, bool huge);
+void buddy_destroy(buddy_t *buddy);
+void *buddy_alloc(buddy_t *buddy, size_t size);
+size_t buddy_max_block(buddy_t *buddy);
+void buddy_free(buddy_t *buddy, void *ptr);
+void buddy_get_stats(buddy_t *buddy, buddy_stats_t *stats);
 
 #endif
@@ -0,0 +1,194 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#include "ring.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/* Returns the smallest power of two no less than N; the capacity of a ring
+   which can hold N values. */
+size_t
+ring_capacity(size_t n)
+{
+    size_t capacity = 1;
+    while (capacity < n) {
+        capacity <<= 1;
+    }
+
+    return capacity;
+}
+
+/* Initialize RING, an empty ring using the CAPACITY cells at CELLS. CAPACITY
+   must be a power of two. If MULTI_PUSH (MULTI_POP), several threads or
+   processes may push to (pop from) the ring at once. Otherwise, only one may
+   at a time. */
+void
+ring_init(ring_t *ring,
+          ring_cell_t *cells,
+          size_t capacity,
+          bool multi_push,
+          bool multi_pop)
+{
+    assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+
+    ring->cells = cells;
+    ring->mask = capacity - 1;
+    ring->multi_push = multi_push;
+    ring->multi_pop = multi_pop;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&cells[i].seq, i);
+        cells[i].value = 0;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+/* Claim up to N consecutive positions of POSITION (RING's head or tail), for
+   cells whose SEQ will equal their position + OFFSET once it's this side's
+   turn. Returns the number claimed (zero if the ring is full or empty), with
+   the first claimed position written to START. */
+static size_t
+ring_claim(ring_t *ring,
+           _Atomic size_t *position,
+           size_t offset,
+           bool multi,
+           size_t n,
+           size_t *start)
+{
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t pos = atomic_load_explicit(position, memory_order_relaxed);
+    while (true) {
+        /* Count the cells it's our turn for. */
+        size_t k = 0;
+        intptr_t diff = 0;
+        while (k < n) {
+            ring_cell_t *cell = &ring->cells[(pos + k) & ring->mask];
+            size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+            if ((diff = (intptr_t) seq - (intptr_t) (pos + k + offset)) != 0) {
+                break;
+            }
+            k++;
+        }
+
+        if (k == 0 && diff < 0) {
+            /* The other side hasn't gotten to this cell yet. */
+            return 0;
+        } else if (k == 0 || (diff > 0 && multi)) {
+            /* Another thread on this side claimed it first. */
+            pos = atomic_load_explicit(position, memory_order_relaxed);
+        } else if (!multi) {
+            atomic_store_explicit(position, pos + k, memory_order_relaxed);
+            *start = pos;
+            return k;
+        } else if (atomic_compare_exchange_weak_explicit(position,
+                                                         &pos,
+                                                         pos + k,
+                                                         memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+            *start = pos;
+            return k;
+        }
+    }
+}
+
+/* Push VALUE to the back of RING. Returns true on success, and false if RING
+   is full. */
+bool
+ring_push(ring_t *ring, size_t value)
+{
+    return ring_push_many(ring, &value, 1) == 1;
+}
+
+/* Push up to N VALUES to the back of RING, in order, claiming their cells all
+   at once. Returns the number pushed, which is less than N if RING fills. */
+size_t
+ring_push_many(ring_t *ring, const size_t *values, size_t n)
+{
+    size_t start;
+    size_t k = ring_claim(ring, &ring->tail, 0, ring->multi_push, n, &start);
+
+    /* Hand the cells to consumers. */
+    for (size_t i = 0; i < k; i++) {
+        ring_cell_t *cell = &ring->cells[(start + i) & ring->mask];
+        cell->value = values[i];
+        atomic_store_explicit(&cell->seq, start + i + 1, memory_order_release);
+    }
+
+    return k;
+}
+
+/* Pop the value at the front of RING into VALUE. Returns true on success, and
+   false if RING is empty. */
+bool
+ring_pop(ring_t *ring, size_t *value)
+{
+    return ring_pop_many(ring, value, 1) == 1;
+}
+
+/* Pop up to N values from the front of RING into VALUES, in order, claiming
+   their cells all at once. Returns the number popped, which is less than N if
+   RING empties. */
+size_t
+ring_pop_many(ring_t *ring, size_t *values, size_t n)
+{
+    size_t start;
+    size_t k = ring_claim(ring, &ring->head, 1, ring->multi_pop, n, &start);
+
+    /* Hand the cells back to producers, for when they next wrap around. */
+    for (size_t i = 0; i < k; i++) {
+        ring_cell_t *cell = &ring->cells[(start + i) & ring->mask];
+        values[i] = cell->value;
+        atomic_store_explicit(&cell->seq, start + i + ring->mask + 1, memory_order_release);
+    }
+
+    return k;
+}
+
+/* Returns true if popping from RING would fail right now; whether the value at
+   its head has been fully pushed, unlike RING_SIZE, which counts values still
+   being pushed. */
+bool
+ring_empty(ring_t *ring)
+{
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_acquire);
+    ring_cell_t *cell = &ring->cells[pos & ring->mask];
+
+    return atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1;
+}
+
+/* Number of values in RING. Only a snapshot if RING is in use. */
+size_t
+ring_size(ring_t *ring)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    return tail - head;
+}
@@ -0,0 +1,67 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+#ifndef __UTILS_RING_H_
+#define __UTILS_RING_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define RING_CACHE_LINE (64)
+
+/* Ring cell. SEQ tells producers and consumers whose turn it is to use the
+   cell, so neither side ever takes a lock. */
+typedef struct ring_cell {
+    _Atomic size_t seq;     /* Position the cell is next valid for. */
+    size_t         value;   /* Value stored in the cell. */
+} ring_cell_t;
+
+/* Lock-free, bounded FIFO ring of values (e.g., indices) in shared memory.
+   Each side is either single-threaded, where pushing or popping is a plain
+   load and store, or may be used by several threads (or processes) at once,
+   which costs a compare-and-swap. The configuration, head and tail are each on
+   a cache line of their own. */
+typedef struct ring {
+    ring_cell_t *cells;         /* CAPACITY cells. */
+    size_t       mask;          /* CAPACITY - 1. CAPACITY is a power of two. */
+    bool         multi_push;    /* Several producers may push at once. */
+    bool         multi_pop;     /* Several consumers may pop at once. */
+
+    _Atomic size_t head __attribute__((aligned(RING_CACHE_LINE)));  /* Next
+                                                        position to pop. */
+    _Atomic size_t tail __attribute__((aligned(RING_CACHE_LINE)));  /* Next
+                                                        position to push. */
+} __attribute__((aligned(RING_CACHE_LINE))) ring_t;
+
+size_t ring_capacity(size_t n);
+void ring_init(ring_t *ring, ring_cell_t *cells, size_t capacity, bool multi_push, bool multi_pop);
+bool ring_push(ring_t *ring, size_t value);
+size_t ring_push_many(ring_t *ring, const size_t *values, size_t n);
+bool ring_pop(ring_t *ring, size_t *value);
+size_t ring_pop_many(ring_t *ring, size_t *values, size_t n);
+bool ring_empty(ring_t *ring);
+size_t ring_size(ring_t *ring);
+
+#endif
@@ -13,8 +13,10 @@ module_asyncloader = Extension(
     sources = [
         'csrc/asyncmodule/asyncmodule.c',
         'csrc/async/async.c',
+        'csrc/daemon/daemon.c',
         'csrc/utils/alloc.c',
         'csrc/utils/sort.c',
+        'csrc/utils/ring.c',
     ],
     extra_link_args = [
         '-lpthread',
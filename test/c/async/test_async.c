@@ -21,15 +21,21 @@
    SOFTWARE.
    */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include "../../../csrc/utils/alloc.h"
 #include "../../../csrc/async/async.h"
+#include "../../../csrc/daemon/daemon.h"
 
 
 /* Generic worker process. */
@@ -42,25 +48,68 @@ test_worker_loop(wstate_t *worker,
     struct timespec start, request_end, retrieve_end, release_end;
     entry_t *entries[n_filepaths];
 
-    /* Request all files to loader. */
-    clock_gettime(CLOCK_REALTIME, &start);
+    /* Move to the worker's NUMA node, if it has one. */
+    assert(async_worker_bind(worker) == 0);
+
+    /* Request all files to loader at once, identified by their index. */
+    uint64_t ids[n_filepaths];
     for (size_t i = 0; i < n_filepaths; i++) {
-        while (!async_try_request(worker, filepaths[i])) {}
+        ids[i] = i;
+    }
+    clock_gettime(CLOCK_REALTIME, &start);
+    for (size_t i = 0; i < n_filepaths; ) {
+        i += async_request_many(worker, filepaths + i, ids + i, n_filepaths - i);
     }
     clock_gettime(CLOCK_REALTIME, &request_end);
 
-    /* Retrieve all files from loader. */
+    /* Retrieve all files from loader, as many at a time as have completed. */
+    for (size_t i = 0; i < n_filepaths; ) {
+        i += async_try_get_many(worker, entries + i, n_filepaths - i);
+    }
     for (size_t i = 0; i < n_filepaths; i++) {
-        while ((entries[i] = async_try_get(worker)) == NULL) {}
+        assert(entries[i]->status == 0);
+        assert(strcmp(entries[i]->path, filepaths[entries[i]->id]) == 0);
+        assert(entries[i]->inlined ==
+               (entries[i]->size <= worker->loader->inline_size));
     }
     clock_gettime(CLOCK_REALTIME, &retrieve_end);
 
-    /* Release all entries. */
-    for (size_t i = 0; i < n_filepaths; i++) {
-        async_release(entries[i]);
-    }
+    /* Release all entries at once. */
+    async_release_many(entries, n_filepaths);
     clock_gettime(CLOCK_REALTIME, &release_end);
 
+    /* Failed loads are still delivered, carrying their error. Wait for this
+       one asleep, rather than spinning. */
+    entry_t *missing;
+    while (!async_try_request(worker, "does-not-exist")) {}
+    assert((missing = async_wait_get(worker, 0, NULL)) != NULL);
+    assert(missing->status == -ENOENT);
+    assert(missing->size == 0);
+    async_release(missing);
+
+    /* Completions signal the worker's event fd once it's armed. Signals may
+       be spurious, so check for an entry after each one. */
+    while (!async_try_request(worker, "does-not-exist")) {}
+    while ((missing = async_try_get(worker)) == NULL) {
+        if (async_arm(worker)) {
+            struct pollfd pfd = {.fd = worker->event_fd, .events = POLLIN};
+            assert(poll(&pfd, 1, 10 * 1000) == 1);
+            async_drain(worker);
+        }
+    }
+    assert(missing->status == -ENOENT);
+    async_release(missing);
+
+    /* With nothing outstanding, waiting times out. */
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += 10 * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    assert(async_wait_get(worker, ASYNC_WAIT_SPIN, &deadline) == NULL);
+    assert(async_wait(worker, 0, &deadline) == -ETIMEDOUT);
 
     /* Log timing data. */
     long request_time = request_end.tv_nsec - start.tv_nsec + (request_end.tv_sec - start.tv_sec) * 1e9;
@@ -80,21 +129,49 @@ test_worker_loop(wstate_t *worker,
 
 void
 test_config(size_t queue_depth,
+            size_t max_file_size,
+            size_t arena_size,
+            size_t inline_size,
+            unsigned int flags,
+            const int *nodes,
             size_t n_workers,
+            size_t n_readers,
             size_t dispatch_n,
             size_t idle_iters,
+            size_t max_inflight,
             char **filepaths,
             size_t n_filepaths)
 {
-    printf("\n-- Testing config with %lu worker(s) --\n", n_workers);
+    printf("\n-- Testing config with %lu worker(s)%s, %lu reader(s) (%lu in flight), %lu byte slots, %lu byte arena, %lu byte inline, flags 0x%x --\n",
+           n_workers,
+           nodes != NULL ? " on NUMA nodes" : "",
+           n_readers,
+           max_inflight,
+           max_file_size,
+           arena_size,
+           inline_size,
+           flags);
 
     /* Create the loader. */
-    lstate_t *loader = mmap_alloc(sizeof(lstate_t));
-    assert(loader != NULL);
-
-    /* Initialize the loader. */
-    int status = async_init(loader, queue_depth, n_workers, dispatch_n, idle_iters, 0);
+    lstate_t *loader;
+    int status = async_init(&loader,
+                            NULL,
+                            queue_depth,
+                            max_file_size,
+                            arena_size,
+                            inline_size,
+                            n_workers,
+                            n_readers,
+                            dispatch_n,
+                            idle_iters,
+                            max_inflight,
+                            (flags & ASYNC_IOPOLL) ? O_DIRECT : 0,
+                            flags,
+                            nodes);
     assert(status == 0);
+    for (size_t i = 0; i < n_workers; i++) {
+        assert(loader->states[i].node == (nodes != NULL ? nodes[i] : -1));
+    }
 
     /* Fork, spawning worker processes. */
     pid_t worker_pids[n_workers];
@@ -133,6 +210,393 @@ test_config(size_t queue_depth,
     /* Kill the loader process. */
     printf("All workers have terminated. Killing loader.\n");
     kill(loader_pid, SIGKILL);
+
+    /* Every block taken from the arena should have been returned. */
+    if (loader->buddy != NULL) {
+        buddy_stats_t stats;
+        buddy_get_stats(loader->buddy, &stats);
+        assert(stats.n_allocs == 0 && stats.in_use == 0);
+        assert(stats.largest_free == stats.capacity);
+        assert(stats.high_water > 0);
+    }
+}
+
+/* Run the reader and responder as threads of this process, with a worker in
+   this process too, stopping and relaunching them in between. */
+void
+test_in_process(char **filepaths, size_t n_filepaths)
+{
+    printf("\n-- Testing in-process loader threads --\n");
+
+    lstate_t *loader;
+    int status = async_init(&loader,
+                            NULL,
+                            n_filepaths,
+                            1024 * 1024,
+                            0,
+                            0,
+                            1,
+                            1,
+                            n_filepaths,
+                            64,
+                            0,
+                            0,
+                            0,
+                            NULL);
+    assert(status == 0);
+
+    for (size_t i = 0; i < 2; i++) {
+        assert(async_launch(loader) == 0);
+        test_worker_loop(&loader->states[0], 0, filepaths, n_filepaths);
+        async_stop(loader);
+    }
+
+    /* Every completion was reaped, any number at once. */
+    rstate_t *rd = &loader->readers[0];
+    assert(rd->n_cqes >= 2 * n_filepaths);
+    assert(rd->n_reaps > 0 && rd->n_reaps <= rd->n_cqes);
+
+    /* Requests made while stopped are issued once relaunched. */
+    while (!async_try_request(&loader->states[0], "does-not-exist")) {}
+    assert(async_launch(loader) == 0);
+    entry_t *missing = async_wait_get(&loader->states[0], 0, NULL);
+    assert(missing != NULL && missing->status == -ENOENT);
+    async_release(missing);
+    async_stop(loader);
+}
+
+/* Complete every request WORKER has made, as a responder would, without
+   loading anything. */
+static void
+test_complete_all(wstate_t *worker)
+{
+    size_t indices[64];
+    size_t k;
+    while ((k = ring_pop_many(&worker->ready, indices, 64)) > 0) {
+        atomic_fetch_sub(&worker->n_pending, k);
+        assert(ring_push_many(&worker->completed, indices, k) == k);
+    }
+}
+
+/* Failed requests aren't marked as read inline, even in an entry whose last
+   file was. */
+void
+test_failed_inline(void)
+{
+    printf("\n-- Testing failures in entries last read inline --\n");
+
+    lstate_t *loader;
+    int status = async_init(&loader, NULL, 1, 4096, 0, 4096, 1, 1, 1, 64, 0, 0, 0, NULL);
+    assert(status == 0);
+    assert(async_launch(loader) == 0);
+
+    /* The queue holds one entry, so each request reuses it. The test's source
+       is too large for the loader. */
+    wstate_t *worker = &loader->states[0];
+    char *paths[] = {"Makefile", "does-not-exist", "Makefile", "test_async.c"};
+    int statuses[] = {0, -ENOENT, 0, -EFBIG};
+    for (size_t i = 0; i < 4; i++) {
+        while (!async_try_request(worker, paths[i])) {}
+        entry_t *e = async_wait_get(worker, 0, NULL);
+        assert(e != NULL && e->status == statuses[i]);
+        assert(e->inlined == (statuses[i] == 0));
+        async_release(e);
+    }
+
+    async_stop(loader);
+    async_destroy(loader);
+}
+
+/* Request a whole deep queue at once, from a thread whose stack couldn't hold
+   an index per entry, then get, release and reclaim them. */
+static void *
+test_deep_queue_thread(void *arg)
+{
+    wstate_t *worker = arg;
+    size_t n = worker->capacity;
+    char **paths = malloc(n * sizeof(char *));
+    assert(paths != NULL);
+    for (size_t i = 0; i < n; i++) {
+        paths[i] = "does-not-exist";
+    }
+
+    assert(async_request_many(worker, paths, NULL, n) == n);
+    assert(async_request_many(worker, paths, NULL, 1) == 0);
+
+    /* Complete every request, as a responder would, a few at a time. */
+    test_complete_all(worker);
+
+    /* Get and release them all at once, after which they can all be requested
+       again. */
+    entry_t **entries = malloc(n * sizeof(entry_t *));
+    assert(entries != NULL);
+    assert(async_try_get_many(worker, entries, n + 1) == n);
+    assert(async_try_get_many(worker, entries, 1) == 0);
+    async_release_many(entries, n);
+    assert(async_request_many(worker, paths, NULL, n) == n);
+
+    /* Reclaim the worker with some entries taken and some left completed, as
+       if its process exited, after which they can all be requested again. */
+    test_complete_all(worker);
+    assert(async_try_get_many(worker, entries, n / 2) == n / 2);
+    assert(async_reclaim(worker) == 0);
+    assert(async_try_get_many(worker, entries, 1) == 0);
+    assert(async_request_many(worker, paths, NULL, n) == n);
+
+    free(entries);
+    free(paths);
+    return NULL;
+}
+
+/* Move many entries at once through the batch interfaces of a worker with a
+   deep queue, without loading anything. */
+void
+test_deep_queue(void)
+{
+    printf("\n-- Testing batches over a deep queue --\n");
+
+    lstate_t *loader;
+    size_t depth = 16 * 1024;
+    int status = async_init(&loader, NULL, depth, 0, 1024 * 1024, 0, 1, 1, 64, 64, 0, 0, 0, NULL);
+    assert(status == 0);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    assert(pthread_create(&thread, &attr, test_deep_queue_thread, &loader->states[0]) == 0);
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    async_destroy(loader);
+}
+
+/* With an arena whose size isn't a power of two, files which fit in the arena
+   but not in its largest block fail, rather than waiting for room forever. */
+void
+test_oversized(void)
+{
+    printf("\n-- Testing files larger than the arena's largest block --\n");
+
+    /* The arena's largest block is 4M. */
+    char *paths[] = {"fits.bin", "oversized.bin"};
+    size_t sizes[] = {3 * 1024 * 1024, 5 * 1024 * 1024};
+    for (size_t i = 0; i < 2; i++) {
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        assert(ftruncate(fd, sizes[i]) == 0);
+        close(fd);
+    }
+
+    lstate_t *loader;
+    int status = async_init(&loader, NULL, 2, 0, 6 * 1024 * 1024, 0, 1, 1, 2, 64, 0, 0, 0, NULL);
+    assert(status == 0);
+    assert(buddy_max_block(loader->buddy) == 4 * 1024 * 1024);
+    assert(async_launch(loader) == 0);
+
+    wstate_t *worker = &loader->states[0];
+    uint64_t ids[] = {0, 1};
+    assert(async_request_many(worker, paths, ids, 2) == 2);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += 10;
+    for (size_t i = 0; i < 2; i++) {
+        entry_t *e = async_wait_get(worker, 0, &deadline);
+        assert(e != NULL);
+        assert(e->status == (e->id == 0 ? 0 : -EFBIG));
+        async_release(e);
+    }
+
+    async_stop(loader);
+    async_destroy(loader);
+    for (size_t i = 0; i < 2; i++) {
+        unlink(paths[i]);
+    }
+}
+
+/* Create a named loader, and load files from a process which attaches to it
+   rather than inheriting it. */
+void
+test_named(char **filepaths, size_t n_filepaths)
+{
+    printf("\n-- Testing named loader --\n");
+
+    char name[64];
+    snprintf(name, sizeof(name), "async-loader-test-%d", getpid());
+    lstate_t *loader;
+    int status = async_init(&loader,
+                            name,
+                            n_filepaths,
+                            0,
+                            4 * 1024 * 1024,
+                            4 * 1024,
+                            1,
+                            1,
+                            n_filepaths,
+                            64,
+                            0,
+                            0,
+                            0,
+                            NULL);
+    assert(status == 0);
+    assert(strcmp(loader->name, name) == 0);
+
+    /* The name is taken, and this process already has the loader mapped. */
+    lstate_t *other;
+    assert(async_init(&other, name, 1, 4096, 0, 0, 1, 1, 1, 1, 0, 0, 0, NULL) == -EEXIST);
+    assert(async_attach(&other, name) == -EEXIST);
+    assert(async_attach(&other, "async-loader-test-missing") == -ENOENT);
+
+    /* Fork a worker, which forgets the loader before attaching to it. */
+    fflush(stdout);
+    pid_t worker_pid;
+    if ((worker_pid = fork()) == 0) {
+        async_detach(loader);
+        assert(async_attach(&loader, name) == 0);
+        test_worker_loop(&loader->states[0], 0, filepaths, n_filepaths);
+        async_detach(loader);
+        exit(EXIT_SUCCESS);
+    }
+
+    assert(async_launch(loader) == 0);
+    waitpid(worker_pid, &status, 0);
+    assert(status == EXIT_SUCCESS);
+    async_stop(loader);
+
+    /* Destroying the loader removes its name. */
+    async_destroy(loader);
+    assert(async_attach(&loader, name) == -ENOENT);
+}
+
+/* Serve DAEMON's clients until the process PID exits, checking it succeeded. */
+static void
+test_daemon_serve(daemon_t *daemon, pid_t pid)
+{
+    int status;
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        assert(daemon_poll(daemon, 10) == 0);
+    }
+    assert(status == EXIT_SUCCESS);
+}
+
+/* Lease a daemon's worker from a forked client, with a quota of DEPTH entries.
+   The client waits to read a byte from GO before loading files, and exits
+   without retrieving a final request, which the daemon must reclaim. */
+static pid_t
+test_daemon_client(lstate_t *loader,
+                   const char *path,
+                   size_t depth,
+                   int go,
+                   char **filepaths,
+                   size_t n_filepaths)
+{
+    fflush(stdout);
+    pid_t pid;
+    if ((pid = fork()) != 0) {
+        return pid;
+    }
+
+    daemon_lease_t lease;
+    async_detach(loader);
+    assert(daemon_connect(&lease, path, depth) == 0);
+    assert(lease.depth == (depth == 0 ? n_filepaths : depth));
+    assert(async_attach(&loader, lease.name) == 0);
+    wstate_t *worker = &loader->states[lease.worker];
+
+    char c;
+    assert(read(go, &c, 1) == 1);
+    if (depth == 0) {
+        test_worker_loop(worker, lease.worker, filepaths, n_filepaths);
+    } else {
+        /* No more than DEPTH requests are accepted at once. */
+        entry_t *entries[n_filepaths];
+        assert(async_request_many(worker, filepaths, NULL, n_filepaths) == depth);
+        for (size_t i = 0; i < depth; ) {
+            i += async_try_get_many(worker, entries + i, depth - i);
+        }
+        async_release_many(entries, depth);
+    }
+    while (!async_try_request(worker, filepaths[0])) {}
+
+    daemon_disconnect(&lease);
+    async_detach(loader);
+    exit(EXIT_SUCCESS);
+}
+
+/* Serve a named loader's workers from a daemon, to clients with and without
+   quotas, and reclaim them once their leases end. */
+void
+test_daemon(char **filepaths, size_t n_filepaths)
+{
+    printf("\n-- Testing daemon --\n");
+
+    char name[64], path[64];
+    snprintf(name, sizeof(name), "async-loader-test-%d", getpid());
+    snprintf(path, sizeof(path), "/tmp/async-loader-test-%d.sock", getpid());
+    lstate_t *loader;
+    int status = async_init(&loader,
+                            name,
+                            n_filepaths,
+                            0,
+                            4 * 1024 * 1024,
+                            0,
+                            2,
+                            2,
+                            1,
+                            64,
+                            0,
+                            0,
+                            0,
+                            NULL);
+    assert(status == 0);
+    daemon_t daemon;
+    assert(daemon_init(&daemon, loader, path) == 0);
+    assert(async_launch(loader) == 0);
+
+    /* Lease both workers; one with a quota, and one without. */
+    int go[2];
+    assert(pipe(go) == 0);
+    pid_t limited = test_daemon_client(loader, path, 2, go[0], filepaths, n_filepaths);
+    pid_t full = test_daemon_client(loader, path, 0, go[0], filepaths, n_filepaths);
+    while (!daemon.registered[0] || !daemon.registered[1]) {
+        assert(daemon_poll(&daemon, 10) == 0);
+    }
+
+    /* Further clients are turned away while every worker is leased. */
+    fflush(stdout);
+    pid_t busy;
+    if ((busy = fork()) == 0) {
+        daemon_lease_t lease;
+        assert(daemon_connect(&lease, path, 0) == -EBUSY);
+        exit(EXIT_SUCCESS);
+    }
+    test_daemon_serve(&daemon, busy);
+
+    assert(write(go[1], "gg", 2) == 2);
+    test_daemon_serve(&daemon, limited);
+    test_daemon_serve(&daemon, full);
+
+    /* Once their requests complete, the workers are reclaimed, along with the
+       arena space of the entries the clients never released. */
+    buddy_stats_t stats;
+    do {
+        assert(daemon_poll(&daemon, 10) == 0);
+        buddy_get_stats(loader->buddy, &stats);
+    } while (daemon.draining[0] || daemon.draining[1] || stats.in_use > 0);
+    for (size_t i = 0; i < 2; i++) {
+        assert(ring_size(&loader->states[i].free) == n_filepaths);
+    }
+
+    /* A reclaimed worker can be leased again. */
+    assert(write(go[1], "g", 1) == 1);
+    test_daemon_serve(&daemon, test_daemon_client(loader, path, 0, go[0], filepaths, n_filepaths));
+
+    close(go[0]);
+    close(go[1]);
+    daemon_close(&daemon);
+    async_stop(loader);
+    async_destroy(loader);
+    assert(access(path, F_OK) < 0);
 }
 
 int
@@ -149,20 +613,76 @@ main(int argc, char **argv)
         "test_async.o",
     };
 
-    /* Worker configs to test. */
-    size_t n_workers[] = {1, 2};
-    size_t n_configs = 2;
+    /* Worker configs to test; a reader for all workers, and one each, with all
+       of their entries in flight at once, or one per reader. */
+    size_t n_workers[] = {1, 2, 2, 2};
+    size_t n_readers[] = {1, 1, 2, 2};
+    size_t max_inflights[] = {0, 0, 0, 1};
+    size_t n_configs = 4;
+
+    /* Data configs to test; a fixed slot per entry, and blocks allocated from
+       a shared arena, with and without the arena being registered with
+       io_uring, with small files read inline, with rings that allow threaded
+       workers, with files opened through io_uring, with each profile of
+       io_uring setup (polled reads being O_DIRECT), and with requests sorted
+       whatever the files' device. */
+    size_t max_file_sizes[] = {1024 * 1024, 0, 1024 * 1024, 0, 1024 * 1024, 0, 0, 1024 * 1024, 0,
+                               1024 * 1024, 0, 1024 * 1024, 1024 * 1024, 0, 1024 * 1024};
+    size_t arena_sizes[] = {0, 4 * 1024 * 1024, 0, 4 * 1024 * 1024, 0, 4 * 1024 * 1024, 4 * 1024 * 1024, 0, 4 * 1024 * 1024,
+                            0, 4 * 1024 * 1024, 0, 0, 4 * 1024 * 1024, 0};
+    size_t inline_sizes[] = {0, 0, 0, 0, 16 * 1024, 4 * 1024, 0, 0, 4 * 1024, 0, 0, 0, 0, 0, 0};
+    unsigned int flags[] = {0, 0, ASYNC_FIXED_BUFFERS, ASYNC_FIXED_BUFFERS, 0, ASYNC_FIXED_BUFFERS, ASYNC_THREADED_WORKERS,
+                            ASYNC_URING_OPEN, ASYNC_URING_OPEN | ASYNC_FIXED_BUFFERS,
+                            ASYNC_SQPOLL, ASYNC_SQPOLL | ASYNC_URING_OPEN, ASYNC_COOP_TASKRUN,
+                            ASYNC_IOPOLL | ASYNC_FIXED_BUFFERS, ASYNC_ALWAYS_SORT,
+                            ASYNC_ALWAYS_SORT | ASYNC_URING_OPEN};
+    size_t n_data_configs = 15;
 
     /* Run each test configuration. */
     for (size_t i = 0; i < n_configs; i++) {
+        for (size_t j = 0; j < n_data_configs; j++) {
+            test_config(queue_depth,
+                        max_file_sizes[j],
+                        arena_sizes[j],
+                        inline_sizes[j],
+                        flags[j],
+                        NULL,
+                        n_workers[i],
+                        n_readers[i],
+                        dispatch_n,
+                        idle_iters,
+                        max_inflights[i],
+                        filepaths,
+                        n_filepaths);
+        }
+    }
+
+    /* Run each data config with workers placed on a NUMA node. Node 0 always
+       exists, so this works on single-node machines too. */
+    int nodes[] = {0, 0};
+    for (size_t j = 0; j < n_data_configs; j++) {
         test_config(queue_depth,
-                    n_workers[i],
+                    max_file_sizes[j],
+                    arena_sizes[j],
+                    inline_sizes[j],
+                    flags[j],
+                    nodes,
+                    2,
+                    2,
                     dispatch_n,
                     idle_iters,
+                    0,
                     filepaths,
                     n_filepaths);
     }
 
+    test_in_process(filepaths, n_filepaths);
+    test_oversized();
+    test_deep_queue();
+    test_failed_inline();
+    test_named(filepaths, n_filepaths);
+    test_daemon(filepaths, n_filepaths);
+
     printf("All tests complete.\n");
 
     return EXIT_SUCCESS;
@@ -0,0 +1,1258 @@
+/* MIT License
+
+   Copyright (c) 2023 Gus Waldspurger
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in all
+   copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+   */
+
+/* Benchmarks for the asynchronous loader. Run as ./bench <benchmark> [dir],
+   where DIR is where benchmark files are created (default /tmp). */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include "../../../csrc/utils/alloc.h"
+#include "../../../csrc/async/async.h"
+#include "../../../csrc/daemon/daemon.h"
+#include "../../../csrc/utils/ring.h"
+
+#define MB (1024UL * 1024)
+
+/* Loader configuration to benchmark. */
+typedef struct bench_config {
+    const char   *name;
+    size_t        queue_depth;
+    size_t        max_file_size;
+    size_t        arena_size;
+    size_t        inline_size;
+    unsigned int  flags;
+    size_t        n_workers;
+    bool          numa;         /* Place worker I on NUMA node I % N_NODES. */
+    size_t        n_readers;    /* Readers issuing the workers' IO; 0 for
+                                   one. */
+    int           oflags;       /* Mode to open files with, e.g. O_DIRECT. */
+    size_t        max_inflight; /* Entries each reader has in flight; 0 for
+                                   all of them. */
+} bench_config_t;
+
+/* Results from a single worker, or summed over all of them. */
+typedef struct bench_result {
+    double    seconds;      /* Wall time to load (and touch) every file. */
+    long      minflt;       /* Minor page faults taken by the worker. */
+    int64_t   dtlb_misses;  /* dTLB read misses by the worker, or -1 if they
+                               can't be counted. */
+    size_t    n_files;      /* Files loaded. */
+    uint64_t  checksum;     /* Sum of all data read, so it isn't optimized
+                               away. */
+    size_t    local_pages;  /* Data pages touched on the worker's own NUMA
+                               node, if counted. */
+    size_t    remote_pages; /* Data pages touched on other NUMA nodes, if
+                               counted. */
+    size_t    n_reaps;      /* Times the loader's responders woke to reap
+                               CQEs. */
+    size_t    n_cqes;       /* CQEs the loader's responders reaped. */
+} bench_result_t;
+
+
+/* ----------- */
+/*   HELPERS   */
+/* ----------- */
+
+/* Seconds elapsed since START. */
+static double
+bench_elapsed(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Open a counter for this process' dTLB read misses. Returns -1 if the counter
+   isn't available (e.g., inside a VM without a PMU). */
+static int
+bench_open_dtlb_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Create N files of SIZE bytes in DIR, returning their paths. Existing files of
+   the right size are reused. */
+static char **
+bench_make_files(const char *dir, const char *prefix, size_t n, size_t size)
+{
+    char **paths = malloc(n * sizeof(char *));
+    uint8_t *buf = malloc(size);
+    assert(paths != NULL && buf != NULL);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = (uint8_t) (i * 2654435761UL >> 24);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        paths[i] = malloc(MAX_PATH_LEN + 1);
+        snprintf(paths[i], MAX_PATH_LEN + 1, "%s/%s-%lu", dir, prefix, i);
+
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && (size_t) st.st_size == size) {
+            continue;
+        }
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        assert(write(fd, buf, size) == (ssize_t) size);
+        close(fd);
+    }
+    free(buf);
+
+    return paths;
+}
+
+/* Number of NUMA nodes on this machine (at least 1). */
+static int
+bench_n_nodes(void)
+{
+    int n = 1;
+    char path[64];
+    for (; n < MAX_NUMA_NODES; n++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+        if (access(path, F_OK) != 0) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+/* Count the pages of E's data on the NUMA node this process is running on,
+   and on other nodes, into RESULT. */
+static void
+bench_count_pages(entry_t *e, bench_result_t *result)
+{
+    unsigned int cpu, node;
+    size_t n_pages = e->size / 4096;
+    void *pages[n_pages];
+    int status[n_pages];
+    getcpu(&cpu, &node);
+    for (size_t i = 0; i < n_pages; i++) {
+        pages[i] = async_data(e) + i * 4096;
+    }
+    if (syscall(SYS_move_pages, 0, n_pages, pages, NULL, status, 0) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < n_pages; i++) {
+        if (status[i] == (int) node) {
+            result->local_pages++;
+        } else if (status[i] >= 0) {
+            result->remote_pages++;
+        }
+    }
+}
+
+/* Worker side of a benchmark. Keeps up to DEPTH requests outstanding until all
+   N files in PATHS have been loaded, touching every 8 bytes of each. If
+   COUNT_PAGES, the NUMA node of every page touched is counted too, which is
+   much slower. */
+static void
+bench_worker(wstate_t *worker,
+             char **paths,
+             size_t n,
+             size_t depth,
+             bool count_pages,
+             bench_result_t *result)
+{
+    struct rusage start_usage, end_usage;
+    struct timespec start;
+    memset(result, 0, sizeof(*result));
+    assert(async_worker_bind(worker) == 0);
+
+    int counter = bench_open_dtlb_counter();
+    getrusage(RUSAGE_SELF, &start_usage);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    size_t requested = 0;
+    while (requested < n && requested < depth) {
+        while (!async_try_request(worker, paths[requested])) {}
+        requested++;
+    }
+    while (result->n_files < n) {
+        entry_t *e;
+        while ((e = async_try_get(worker)) == NULL) {}
+
+        uint64_t *data = (uint64_t *) async_data(e);
+        for (size_t i = 0; i < e->file_size / sizeof(uint64_t); i++) {
+            result->checksum += data[i];
+        }
+        if (count_pages) {
+            bench_count_pages(e, result);
+        }
+        async_release(e);
+        result->n_files++;
+
+        if (requested < n) {
+            while (!async_try_request(worker, paths[requested])) {}
+            requested++;
+        }
+    }
+
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    result->seconds = bench_elapsed(&start);
+    getrusage(RUSAGE_SELF, &end_usage);
+    result->minflt = end_usage.ru_minflt - start_usage.ru_minflt;
+    result->dtlb_misses = -1;
+    if (counter >= 0) {
+        long long count;
+        if (read(counter, &count, sizeof(count)) == sizeof(count)) {
+            result->dtlb_misses = count;
+        }
+        close(counter);
+    }
+}
+
+/* Create a loader configured by CONFIG. */
+static lstate_t *
+bench_init_loader(bench_config_t *config)
+{
+    int nodes[config->n_workers];
+    for (size_t i = 0; i < config->n_workers; i++) {
+        nodes[i] = i % bench_n_nodes();
+    }
+
+    lstate_t *loader;
+    int status = async_init(&loader,
+                            NULL,
+                            config->queue_depth,
+                            config->max_file_size,
+                            config->arena_size,
+                            config->inline_size,
+                            config->n_workers,
+                            config->n_readers,
+                            config->queue_depth,
+                            64,
+                            config->max_inflight,
+                            config->oflags,
+                            config->flags,
+                            config->numa ? nodes : NULL);
+    assert(status == 0);
+
+    return loader;
+}
+
+/* Create a loader configured by CONFIG, and fork a process to run it. The
+   loader's PID is written to LOADER_PID. */
+static lstate_t *
+bench_start_loader(bench_config_t *config, pid_t *loader_pid)
+{
+    lstate_t *loader = bench_init_loader(config);
+
+    fflush(stdout);
+    if ((*loader_pid = fork()) == 0) {
+        async_start(loader);
+        exit(EXIT_FAILURE);
+    }
+
+    return loader;
+}
+
+/* Kill the loader process LOADER_PID, and free LOADER. */
+static void
+bench_stop_loader(lstate_t *loader, pid_t loader_pid)
+{
+    kill(loader_pid, SIGKILL);
+    waitpid(loader_pid, NULL, 0);
+
+    async_destroy(loader);
+}
+
+/* Combine the results of N workers in SHARED into RESULT. The time taken is
+   that of the slowest worker. */
+static void
+bench_combine(bench_result_t *shared, size_t n_workers, bench_result_t *result)
+{
+    *result = shared[0];
+    for (size_t i = 1; i < n_workers; i++) {
+        if (shared[i].seconds > result->seconds) {
+            result->seconds = shared[i].seconds;
+        }
+        result->minflt += shared[i].minflt;
+        if (result->dtlb_misses >= 0 && shared[i].dtlb_misses >= 0) {
+            result->dtlb_misses += shared[i].dtlb_misses;
+        } else {
+            result->dtlb_misses = -1;
+        }
+        result->n_files += shared[i].n_files;
+        result->checksum += shared[i].checksum;
+        result->local_pages += shared[i].local_pages;
+        result->remote_pages += shared[i].remote_pages;
+    }
+}
+
+/* Run a loader configured by CONFIG over the N files in PATHS, split evenly
+   between its workers, writing their combined results to RESULT. The time
+   taken is that of the slowest worker. */
+static void
+bench_run(bench_config_t *config,
+          char **paths,
+          size_t n,
+          bool count_pages,
+          bench_result_t *result)
+{
+    size_t n_workers = config->n_workers;
+    bench_result_t *shared = mmap_alloc(n_workers * sizeof(bench_result_t));
+    assert(shared != NULL);
+
+    pid_t loader_pid;
+    lstate_t *loader = bench_start_loader(config, &loader_pid);
+    pid_t worker_pids[n_workers];
+    for (size_t i = 0; i < n_workers; i++) {
+        if ((worker_pids[i] = fork()) == 0) {
+            bench_worker(&loader->states[i],
+                         paths + i * (n / n_workers),
+                         n / n_workers,
+                         config->queue_depth,
+                         count_pages,
+                         &shared[i]);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    for (size_t i = 0; i < n_workers; i++) {
+        int status;
+        waitpid(worker_pids[i], &status, 0);
+        assert(status == EXIT_SUCCESS);
+    }
+    bench_combine(shared, n_workers, result);
+    mmap_free(shared, n_workers * sizeof(bench_result_t));
+
+    result->n_reaps = result->n_cqes = 0;
+    for (size_t i = 0; i < loader->n_readers; i++) {
+        result->n_reaps += loader->readers[i].n_reaps;
+        result->n_cqes += loader->readers[i].n_cqes;
+    }
+    bench_stop_loader(loader, loader_pid);
+}
+
+
+/* Print a table row for RESULT. */
+static void
+bench_print(const char *name, bench_result_t *result)
+{
+    char dtlb[32] = "n/a";
+    if (result->dtlb_misses >= 0) {
+        snprintf(dtlb, sizeof(dtlb), "%ld", result->dtlb_misses);
+    }
+    printf("%-24s %8.3f s %10.0f files/s %10ld faults %14s dTLB misses\n",
+           name,
+           result->seconds,
+           result->n_files / result->seconds,
+           result->minflt,
+           dtlb);
+}
+
+
+/* -------------- */
+/*   BENCHMARKS   */
+/* -------------- */
+
+/* Page faults and dTLB misses when touching large files, with the data arena
+   backed by regular pages and by huge pages. */
+static void
+bench_hugepages(const char *dir)
+{
+    size_t n_files = 64, file_size = 8 * MB, depth = 8;
+    char **paths = bench_make_files(dir, "bench-large", n_files, file_size);
+
+    bench_config_t configs[] = {
+        {"slots, 4K pages", depth, file_size, 0, 0, 0, 1, false},
+        {"slots, huge pages", depth, file_size, 0, 0, ASYNC_HUGEPAGES, 1, false},
+        {"allocator, 4K pages", depth, 0, 2 * depth * file_size, 0, 0, 1, false},
+        {"allocator, huge pages", depth, 0, 2 * depth * file_size, 0, ASYNC_HUGEPAGES, 1, false},
+    };
+    printf("%lu x %lu MB files, queue depth %lu\n", n_files, file_size / MB, depth);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        bench_result_t result;
+        bench_run(&configs[i], paths, n_files, false, &result);
+        bench_print(configs[i].name, &result);
+    }
+}
+
+/* Traced worker for bench_syscalls. Loads the N files in PATHS through WORKER,
+   as bench_worker does, marking the start and end of the load with getppid()
+   so the tracer counts only the system calls made in between. */
+static void
+bench_traced_worker(wstate_t *worker, char **paths, size_t n, size_t depth)
+{
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+
+    uint64_t checksum = 0;
+    size_t requested = 0, loaded = 0;
+    syscall(SYS_getppid);
+    while (requested < n && requested < depth) {
+        while (!async_try_request(worker, paths[requested])) {}
+        requested++;
+    }
+    while (loaded < n) {
+        entry_t *e;
+        while ((e = async_try_get(worker)) == NULL) {}
+
+        uint64_t *data = (uint64_t *) async_data(e);
+        for (size_t i = 0; i < e->file_size / sizeof(uint64_t); i++) {
+            checksum += data[i];
+        }
+        async_release(e);
+        loaded++;
+
+        if (requested < n) {
+            while (!async_try_request(worker, paths[requested])) {}
+            requested++;
+        }
+    }
+    syscall(SYS_getppid);
+
+    exit(checksum == 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Trace the worker PID until it exits, returning the number of system calls it
+   made between its two getppid() markers, or -1 if it can't be traced. */
+static long
+bench_count_syscalls(pid_t pid)
+{
+    int status;
+    long count = 0;
+    int markers = 0;
+
+    waitpid(pid, &status, 0);
+    if (!WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD) < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == 0 &&
+           waitpid(pid, &status, 0) == pid &&
+           WIFSTOPPED(status)) {
+        if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+            continue;
+        }
+        struct __ptrace_syscall_info info;
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) <= 0 ||
+            info.op != PTRACE_SYSCALL_INFO_ENTRY) {
+            continue;
+        }
+        if (info.entry.nr == SYS_getppid) {
+            markers++;
+        } else if (markers == 1) {
+            count++;
+        }
+    }
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    return count;
+}
+
+/* System calls made by a worker per entry loaded. Workers only touch the data
+   arena (mapped once, before they're forked) and the shared queues, so the
+   steady state should make none at all. */
+static void
+bench_syscalls(const char *dir)
+{
+    size_t n_files = 1024, file_size = 64 * 1024, depth = 32;
+    char **paths = bench_make_files(dir, "bench-small", n_files, file_size);
+
+    bench_config_t configs[] = {
+        {"slots", depth, file_size, 0, 0, 0, 1, false},
+        {"allocator", depth, 0, 2 * depth * file_size, 0, 0, 1, false},
+    };
+    printf("%lu x %lu KB files, queue depth %lu\n",
+           n_files,
+           file_size / 1024,
+           depth);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        pid_t loader_pid;
+        lstate_t *loader = bench_start_loader(&configs[i], &loader_pid);
+        pid_t worker_pid;
+        if ((worker_pid = fork()) == 0) {
+            bench_traced_worker(&loader->states[0], paths, n_files, depth);
+        }
+        long count = bench_count_syscalls(worker_pid);
+        bench_stop_loader(loader, loader_pid);
+
+        if (count < 0) {
+            printf("%-24s %14s\n", configs[i].name, "can't trace");
+        } else {
+            printf("%-24s %8ld syscalls %8.3f syscalls/file\n",
+                   configs[i].name,
+                   count,
+                   (double) count / n_files);
+        }
+    }
+}
+
+/* Throughput for small files (labels, metadata, etc.), with and without them
+   being read into entries' inline areas. */
+static void
+bench_small(const char *dir)
+{
+    size_t n_files = 4096, file_size = 2048, depth = 32;
+    char **paths = bench_make_files(dir, "bench-tiny", n_files, file_size);
+
+    bench_config_t configs[] = {
+        {"slots", depth, 64 * 1024, 0, 0, 0, 1, false},
+        {"slots, inline", depth, 64 * 1024, 0, 4096, 0, 1, false},
+        {"allocator", depth, 0, 64 * depth * 4096, 0, 0, 1, false},
+        {"allocator, inline", depth, 0, 64 * depth * 4096, 4096, 0, 1, false},
+    };
+    printf("%lu x %lu KB files, queue depth %lu\n",
+           n_files,
+           file_size / 1024,
+           depth);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        bench_result_t result;
+        bench_run(&configs[i], paths, n_files, false, &result);
+        bench_print(configs[i].name, &result);
+    }
+}
+
+/* Throughput with many workers loading tiny files, so that time goes to the
+   queues shared by the workers, reader and responder rather than to IO. */
+static void
+bench_contention(const char *dir)
+{
+    size_t files_per_worker = 256, file_size = 512, depth = 8;
+    size_t max_workers = 64;
+    char **paths = bench_make_files(dir,
+                                    "bench-tiny",
+                                    files_per_worker * max_workers,
+                                    file_size);
+
+    printf("%lu x %lu B files per worker, queue depth %lu\n",
+           files_per_worker,
+           file_size,
+           depth);
+    for (size_t n_workers = 1; n_workers <= max_workers; n_workers *= 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "%lu worker(s)", n_workers);
+        bench_config_t config = {name, depth, 4096, 0, 0, 0, n_workers, false};
+        bench_result_t result;
+        bench_run(&config, paths, files_per_worker * n_workers, false, &result);
+        bench_print(name, &result);
+    }
+}
+
+/* Throughput for tiny files with deep queues, with each reader's IO in flight
+   (and so its ring) bounded by MAX_INFLIGHT or not, and the memory the ring
+   pins. The rest of the requests wait in the workers' ready rings. */
+static void
+bench_inflight(const char *dir)
+{
+    size_t n_files = 16384, file_size = 512, depth = 4096, n_workers = 4;
+    char **paths = bench_make_files(dir, "bench-tiny", n_files, file_size);
+
+    printf("%lu x %lu B files, %lu workers, queue depth %lu\n", n_files, file_size, n_workers, depth);
+    size_t max_inflights[] = {0, 1024, 64};
+    for (size_t i = 0; i < sizeof(max_inflights) / sizeof(max_inflights[0]); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%lu in flight", max_inflights[i]);
+        bench_config_t config = {name, depth, 4096, 0, 0, 0, n_workers, false};
+        config.max_inflight = max_inflights[i];
+
+        /* Measure the ring as set up, before the loader's forked. */
+        lstate_t *loader = bench_init_loader(&config);
+        struct io_uring *ring = &loader->readers[0].ring;
+        size_t ring_bytes = ring->sq.ring_sz + ring->sq.ring_entries * sizeof(struct io_uring_sqe) +
+                            (ring->cq.ring_ptr != ring->sq.ring_ptr ? ring->cq.ring_sz : 0);
+        size_t max_inflight = loader->max_inflight;
+        async_destroy(loader);
+
+        bench_result_t result;
+        bench_run(&config, paths, n_files, false, &result);
+        printf("%-24s %10.0f files/s %8lu in flight %8lu KB ring\n",
+               name,
+               result.n_files / result.seconds,
+               max_inflight,
+               ring_bytes / 1024);
+    }
+}
+
+/* Completions per second for tiny files with one to four workers at a high
+   queue depth, and how many CQEs the responder reaps each time it wakes. */
+static void
+bench_reaping(const char *dir)
+{
+    size_t n_files = 16384, file_size = 512, depth = 256;
+    char **paths = bench_make_files(dir, "bench-tiny", n_files, file_size);
+
+    printf("%lu x %lu B files, queue depth %lu\n", n_files, file_size, depth);
+    for (size_t n_workers = 1; n_workers <= 4; n_workers *= 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "%lu worker(s)", n_workers);
+        bench_config_t config = {name, depth, 4096, 0, 0, 0, n_workers, false};
+        bench_result_t result;
+        bench_run(&config, paths, n_files, false, &result);
+        printf("%-24s %8.3f s %10.0f files/s %10.1f CQEs/wakeup\n",
+               name,
+               result.seconds,
+               result.n_files / result.seconds,
+               (double) result.n_cqes / result.n_reaps);
+    }
+}
+
+/* Throughput for tiny files opened, stat'd and closed by blocking system calls
+   in the reader and responder, and through io_uring. With the files' dentries
+   and inodes cached, neither blocks for long; this shows the overhead. */
+static void
+bench_open(const char *dir)
+{
+    size_t n_files = 8192, file_size = 512, depth = 64;
+    char **paths = bench_make_files(dir, "bench-tiny", n_files, file_size);
+
+    bench_config_t configs[] = {
+        {"blocking", depth, 4096, 0, 0, 0, 1, false},
+        {"io_uring", depth, 4096, 0, 0, ASYNC_URING_OPEN, 1, false},
+    };
+    printf("%lu x %lu B files, queue depth %lu\n", n_files, file_size, depth);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        bench_result_t result;
+        bench_run(&configs[i], paths, n_files, false, &result);
+        bench_print(configs[i].name, &result);
+    }
+}
+
+/* Throughput for tiny files with requests issued as each device's policy
+   decides (straight away, unless DIR is on a rotational disk), and always
+   queued and sorted by LBA (mapping each file's extents, even where that
+   fails), with files opened by blocking system calls and through io_uring. */
+static void
+bench_devices(const char *dir)
+{
+    size_t n_files = 8192, file_size = 512, depth = 64;
+    char **paths = bench_make_files(dir, "bench-tiny", n_files, file_size);
+
+    bench_config_t configs[] = {
+        {"per device", depth, 4096, 0, 0, 0, 1, false},
+        {"always sorted", depth, 4096, 0, 0, ASYNC_ALWAYS_SORT, 1, false},
+        {"per device, io_uring", depth, 4096, 0, 0, ASYNC_URING_OPEN, 1, false},
+        {"always sorted, io_uring", depth, 4096, 0, 0, ASYNC_URING_OPEN | ASYNC_ALWAYS_SORT, 1, false},
+    };
+    struct stat st;
+    stat(paths[0], &st);
+    printf("%lu x %lu B files on device %u:%u, queue depth %lu\n",
+           n_files,
+           file_size,
+           major(st.st_dev),
+           minor(st.st_dev),
+           depth);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        bench_result_t result;
+        bench_run(&configs[i], paths, n_files, false, &result);
+        bench_print(configs[i].name, &result);
+    }
+}
+
+/* Throughput for many tiny files with one to four readers, each opening and
+   issuing the files of its share of the workers. With fewer CPUs than readers,
+   the readers only take turns. */
+static void
+bench_readers(const char *dir)
+{
+    size_t n_files = 8192, file_size = 512, depth = 32, n_workers = 4;
+    char **paths = bench_make_files(dir, "bench-tiny", n_files, file_size);
+
+    printf("%lu x %lu B files, %lu workers, queue depth %lu, %ld CPU(s)\n",
+           n_files,
+           file_size,
+           n_workers,
+           depth,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (size_t n_readers = 1; n_readers <= n_workers; n_readers *= 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "%lu reader(s)", n_readers);
+        bench_config_t config = {name, depth, 4096, 0, 0, 0, n_workers, false, n_readers};
+        bench_result_t result;
+        bench_run(&config, paths, n_files, false, &result);
+        bench_print(name, &result);
+    }
+}
+
+/* Local and remote NUMA accesses, with and without workers' queues and data
+   placed on their own nodes (and workers bound to them). Accesses are local if
+   the page is on the node the worker is running on. Without placement, data
+   lands wherever the loader's creator happened to fault it in. */
+static void
+bench_numa(const char *dir)
+{
+    size_t n_files = 512, file_size = 256 * 1024, depth = 16;
+    size_t n_workers = 2 * bench_n_nodes();
+    char **paths = bench_make_files(dir, "bench-medium", n_files, file_size);
+
+    bench_config_t configs[] = {
+        {"slots, unplaced", depth, file_size, 0, 0, 0, n_workers, false},
+        {"slots, placed", depth, file_size, 0, 0, 0, n_workers, true},
+        {"allocator, unplaced", depth, 0, 2 * n_workers * depth * file_size, 0, 0, n_workers, false},
+        {"allocator, placed", depth, 0, 2 * n_workers * depth * file_size, 0, 0, n_workers, true},
+    };
+    printf("%lu x %lu KB files, %lu workers over %d node(s), queue depth %lu\n",
+           n_files,
+           file_size / 1024,
+           n_workers,
+           bench_n_nodes(),
+           depth);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        bench_result_t result, pages;
+        bench_run(&configs[i], paths, n_files, false, &result);
+        bench_run(&configs[i], paths, n_files, true, &pages);
+        bench_print(configs[i].name, &result);
+        printf("%-24s %10lu local %10lu remote page accesses (%.1f%% local)\n",
+               "",
+               pages.local_pages,
+               pages.remote_pages,
+               100.0 * pages.local_pages / (pages.local_pages + pages.remote_pages));
+    }
+}
+
+/* Compare two latencies, for QSORT. */
+static int
+bench_compare_latency(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Wakeup latency when waiting for each file in turn, by spinning on
+   ASYNC_TRY_GET (SPIN of -1) or by ASYNC_WAIT_GET checking SPIN times before
+   sleeping. The worker's CPU time per file shows what waiting costs the rest of
+   its process. With a single CPU, a spinning worker competes with the loader's
+   threads for it. */
+static void
+bench_wakeup(const char *dir)
+{
+    size_t n_files = 4096, file_size = 512;
+    char **paths = bench_make_files(dir, "bench-tiny", n_files, file_size);
+    struct {
+        const char *name;
+        long        spin;
+    } configs[] = {
+        {"spin", -1},
+        {"sleep", 0},
+        {"spin, then sleep", ASYNC_WAIT_SPIN},
+    };
+
+    printf("%lu x %lu B files, one outstanding at a time\n", n_files, file_size);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        bench_config_t config = {configs[i].name, 1, 4096, 0, 0, 0, 1, false};
+        double *latencies = mmap_alloc((n_files + 1) * sizeof(double));
+        assert(latencies != NULL);
+
+        pid_t loader_pid, worker_pid;
+        lstate_t *loader = bench_start_loader(&config, &loader_pid);
+        if ((worker_pid = fork()) == 0) {
+            wstate_t *worker = &loader->states[0];
+            struct rusage usage;
+            for (size_t j = 0; j < n_files; j++) {
+                struct timespec start;
+                entry_t *e;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                while (!async_try_request(worker, paths[j])) {}
+                if (configs[i].spin < 0) {
+                    while ((e = async_try_get(worker)) == NULL) {}
+                } else {
+                    e = async_wait_get(worker, configs[i].spin, NULL);
+                }
+                latencies[j] = bench_elapsed(&start);
+                assert(e != NULL && e->status == 0);
+                async_release(e);
+            }
+            getrusage(RUSAGE_SELF, &usage);
+            latencies[n_files] = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                                 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+            exit(EXIT_SUCCESS);
+        }
+        waitpid(worker_pid, NULL, 0);
+        bench_stop_loader(loader, loader_pid);
+
+        double mean = 0;
+        for (size_t j = 0; j < n_files; j++) {
+            mean += latencies[j] / n_files;
+        }
+        qsort(latencies, n_files, sizeof(double), bench_compare_latency);
+        printf("%-24s %8.1f us mean %8.1f us p99 %8.1f us CPU/file\n",
+               configs[i].name,
+               mean * 1e6,
+               latencies[n_files * 99 / 100] * 1e6,
+               latencies[n_files] / n_files * 1e6);
+        mmap_free(latencies, (n_files + 1) * sizeof(double));
+    }
+}
+
+/* Start tracing the loader LOADER_PID, which stops itself once traced, and each
+   thread it creates. Returns true if the loader could be traced. */
+static bool
+bench_trace_loader(pid_t loader_pid)
+{
+    int status;
+    waitpid(loader_pid, &status, 0);
+    if (!WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS,
+               loader_pid,
+               NULL,
+               PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) < 0) {
+        kill(loader_pid, SIGKILL);
+        waitpid(loader_pid, NULL, 0);
+        return false;
+    }
+
+    return ptrace(PTRACE_SYSCALL, loader_pid, NULL, NULL) == 0;
+}
+
+/* Count the system calls made by every thread of the loader LOADER_PID, traced
+   by BENCH_TRACE_LOADER, until WORKER_PID exits. The loader is then killed. */
+static long
+bench_count_loader_syscalls(pid_t loader_pid, pid_t worker_pid)
+{
+    long count = 0;
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+        if (pid == worker_pid) {
+            assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+            break;
+        }
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        /* Count entries to system calls, and pass on any real signals. New
+           threads start stopped, and are traced too. */
+        int signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                count++;
+            }
+        } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+            signal = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, signal);
+    }
+
+    /* The loader is only reaped once each of its traced threads has been. */
+    kill(loader_pid, SIGKILL);
+    while ((pid = waitpid(-1, &status, __WALL)) > 0 &&
+           (pid != loader_pid || !(WIFEXITED(status) || WIFSIGNALED(status)))) {}
+
+    return count;
+}
+
+/* Latency from request to completion for 4K files with DEPTH outstanding, and
+   the system calls the loader makes per file, with each profile of io_uring
+   setup. The loader is traced for the latter in a separate run, since tracing
+   slows it down. Polled reads need O_DIRECT, and a device with polled queues;
+   without them, the loader falls back to blocking reads. */
+static void
+bench_profiles(const char *dir)
+{
+    size_t n_files = 4096, file_size = 4096, depth = 64;
+    char **paths = bench_make_files(dir, "bench-page", n_files, file_size);
+
+    bench_config_t configs[] = {
+        {"default", depth, file_size, 0, 0, 0, 1, false},
+        {"sqpoll", depth, file_size, 0, 0, ASYNC_SQPOLL, 1, false},
+        {"taskrun", depth, file_size, 0, 0, ASYNC_COOP_TASKRUN, 1, false},
+        {"iopoll", depth, file_size, 0, 0, ASYNC_IOPOLL, 1, false, 0, O_DIRECT},
+    };
+    printf("%lu x %lu KB files, queue depth %lu\n", n_files, file_size / 1024, depth);
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        double *latencies = mmap_alloc((n_files + 1) * sizeof(double));
+        assert(latencies != NULL);
+
+        /* Time each file from its request to its completion. */
+        pid_t loader_pid, worker_pid;
+        lstate_t *loader = bench_start_loader(&configs[i], &loader_pid);
+        bool supported = loader->ring_flags != 0 || configs[i].flags == 0;
+        if ((worker_pid = fork()) == 0) {
+            wstate_t *worker = &loader->states[0];
+            struct timespec start, *requested = malloc(n_files * sizeof(struct timespec));
+            size_t n_requested = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (size_t j = 0; j < n_files; j++) {
+                while (n_requested < n_files && n_requested < j + depth) {
+                    uint64_t id = n_requested;
+                    clock_gettime(CLOCK_MONOTONIC, &requested[n_requested]);
+                    while (async_request_many(worker, &paths[n_requested], &id, 1) == 0) {}
+                    n_requested++;
+                }
+
+                entry_t *e;
+                while ((e = async_try_get(worker)) == NULL) {}
+                assert(e->status == 0);
+                latencies[e->id] = bench_elapsed(&requested[e->id]);
+                async_release(e);
+            }
+            latencies[n_files] = bench_elapsed(&start);
+            exit(EXIT_SUCCESS);
+        }
+        waitpid(worker_pid, NULL, 0);
+        bench_stop_loader(loader, loader_pid);
+
+        /* Count the loader's system calls over the same load. */
+        long count = -1;
+        loader = bench_init_loader(&configs[i]);
+        fflush(stdout);
+        if ((loader_pid = fork()) == 0) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+            async_start(loader);
+            exit(EXIT_FAILURE);
+        }
+        if (bench_trace_loader(loader_pid)) {
+            if ((worker_pid = fork()) == 0) {
+                bench_result_t result;
+                bench_worker(&loader->states[0], paths, n_files, depth, false, &result);
+                exit(EXIT_SUCCESS);
+            }
+            count = bench_count_loader_syscalls(loader_pid, worker_pid);
+        }
+        async_destroy(loader);
+
+        char syscalls[32] = "can't trace";
+        if (count >= 0) {
+            snprintf(syscalls, sizeof(syscalls), "%.3f", (double) count / n_files);
+        }
+        qsort(latencies, n_files, sizeof(double), bench_compare_latency);
+        printf("%-24s %10.0f files/s %8.1f us p50 %8.1f us p99 %12s syscalls/file%s\n",
+               configs[i].name,
+               n_files / latencies[n_files],
+               latencies[n_files / 2] * 1e6,
+               latencies[n_files * 99 / 100] * 1e6,
+               syscalls,
+               supported ? "" : " (unsupported)");
+        mmap_free(latencies, (n_files + 1) * sizeof(double));
+    }
+}
+
+/* Spinlocked FIFO of values, as the worker queues were before they became
+   rings; the baseline for the handoff benchmark. */
+typedef struct bench_locked_fifo {
+    pthread_spinlock_t lock;
+    size_t             head;
+    size_t             size;
+    size_t             capacity;
+    size_t             values[];
+} bench_locked_fifo_t;
+
+static bool
+bench_locked_push(bench_locked_fifo_t *fifo, size_t value)
+{
+    pthread_spin_lock(&fifo->lock);
+    bool pushed = fifo->size < fifo->capacity;
+    if (pushed) {
+        fifo->values[(fifo->head + fifo->size++) % fifo->capacity] = value;
+    }
+    pthread_spin_unlock(&fifo->lock);
+
+    return pushed;
+}
+
+static bool
+bench_locked_pop(bench_locked_fifo_t *fifo, size_t *value)
+{
+    pthread_spin_lock(&fifo->lock);
+    bool popped = fifo->size > 0;
+    if (popped) {
+        *value = fifo->values[fifo->head];
+        fifo->head = (fifo->head + 1) % fifo->capacity;
+        fifo->size--;
+    }
+    pthread_spin_unlock(&fifo->lock);
+
+    return popped;
+}
+
+/* Push (or pop) VALUE, through the ring in SHARED or, if LOCKED, the fifo. */
+static bool
+bench_handoff_push(void *shared, bool locked, size_t value)
+{
+    return locked ? bench_locked_push(shared, value) : ring_push(shared, value);
+}
+
+static bool
+bench_handoff_pop(void *shared, bool locked, size_t *value)
+{
+    return locked ? bench_locked_pop(shared, value) : ring_pop(shared, value);
+}
+
+/* Hand N values from N_PRODUCERS processes to this one through a queue of
+   CAPACITY, as workers hand entries to the reader. Returns handoffs per
+   second. Both sides yield when the queue is full (or empty), so this still
+   completes on a single CPU, where it mostly measures context switches. */
+static double
+bench_handoff_run(bool locked, bool multi, size_t n_producers, size_t capacity, size_t n)
+{
+    size_t bytes = locked ?
+        sizeof(bench_locked_fifo_t) + capacity * sizeof(size_t) :
+        sizeof(ring_t) + capacity * sizeof(ring_cell_t);
+    void *shared = mmap_alloc(bytes);
+    assert(shared != NULL);
+    if (locked) {
+        bench_locked_fifo_t *fifo = shared;
+        pthread_spin_init(&fifo->lock, PTHREAD_PROCESS_SHARED);
+        fifo->capacity = capacity;
+    } else {
+        ring_init(shared, (ring_cell_t *) ((ring_t *) shared + 1), capacity, multi, false);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pids[n_producers];
+    fflush(stdout);
+    for (size_t p = 0; p < n_producers; p++) {
+        if ((pids[p] = fork()) == 0) {
+            for (size_t i = p; i < n; i += n_producers) {
+                while (!bench_handoff_push(shared, locked, i)) {
+                    sched_yield();
+                }
+            }
+            exit(EXIT_SUCCESS);
+        }
+    }
+    size_t value, sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        while (!bench_handoff_pop(shared, locked, &value)) {
+            sched_yield();
+        }
+        sum += value;
+    }
+    double seconds = bench_elapsed(&start);
+    for (size_t p = 0; p < n_producers; p++) {
+        waitpid(pids[p], NULL, 0);
+    }
+    assert(sum == n * (n - 1) / 2);
+    mmap_free(shared, bytes);
+
+    return n / seconds;
+}
+
+/* Handoffs per second through a worker queue, for the spinlocked FIFO the
+   queues used to be and for rings with one or several producers. */
+static void
+bench_handoff(const char *dir)
+{
+    size_t n = 4 * 1024 * 1024, capacity = 256;
+    struct {
+        const char *name;
+        bool        locked;
+        bool        multi;
+        size_t      n_producers;
+    } configs[] = {
+        {"spinlocked, 1 producer", true, false, 1},
+        {"ring SPSC, 1 producer", false, false, 1},
+        {"ring MPSC, 1 producer", false, true, 1},
+        {"spinlocked, 4 producers", true, false, 4},
+        {"ring MPSC, 4 producers", false, true, 4},
+    };
+
+    printf("%lu handoffs, capacity %lu, %ld CPU(s)\n",
+           n,
+           capacity,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        double rate = bench_handoff_run(configs[i].locked,
+                                        configs[i].multi,
+                                        configs[i].n_producers,
+                                        capacity,
+                                        n);
+        printf("%-24s %10.2f M handoffs/s\n", configs[i].name, rate / 1e6);
+    }
+}
+
+/* Throughput of two jobs loading their own files at once, each with a loader
+   of its own, and sharing one daemon's loader; one ring (and reader, and
+   responder) rather than two, with all of their IO sorted together. */
+static void
+bench_jobs(const char *dir)
+{
+    size_t n_jobs = 2, files_per_job = 1024, file_size = 64 * 1024, depth = 32;
+    char **paths = bench_make_files(dir,
+                                    "bench-small",
+                                    n_jobs * files_per_job,
+                                    file_size);
+    bench_result_t *shared = mmap_alloc(n_jobs * sizeof(bench_result_t));
+    assert(shared != NULL);
+    bench_result_t result;
+
+    printf("%lu jobs, %lu x %lu KB files each, queue depth %lu\n",
+           n_jobs,
+           files_per_job,
+           file_size / 1024,
+           depth);
+
+    /* A loader (process) per job. */
+    bench_config_t config = {"independent", depth, file_size, 0, 0, 0, 1, false};
+    lstate_t *loaders[n_jobs];
+    pid_t loader_pids[n_jobs], job_pids[n_jobs];
+    for (size_t i = 0; i < n_jobs; i++) {
+        loaders[i] = bench_start_loader(&config, &loader_pids[i]);
+    }
+    for (size_t i = 0; i < n_jobs; i++) {
+        if ((job_pids[i] = fork()) == 0) {
+            bench_worker(&loaders[i]->states[0],
+                         paths + i * files_per_job,
+                         files_per_job,
+                         depth,
+                         false,
+                         &shared[i]);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    for (size_t i = 0; i < n_jobs; i++) {
+        waitpid(job_pids[i], NULL, 0);
+    }
+    for (size_t i = 0; i < n_jobs; i++) {
+        bench_stop_loader(loaders[i], loader_pids[i]);
+    }
+    bench_combine(shared, n_jobs, &result);
+    bench_print(config.name, &result);
+
+    /* One daemon, run by this process, leasing a worker to each job. */
+    char name[64], path[64];
+    snprintf(name, sizeof(name), "async-loader-bench-%d", getpid());
+    snprintf(path, sizeof(path), "%s/async-loader-bench-%d.sock", dir, getpid());
+    lstate_t *loader;
+    int status = async_init(&loader,
+                            name,
+                            depth,
+                            file_size,
+                            0,
+                            0,
+                            n_jobs,
+                            1,
+                            depth,
+                            64,
+                            0,
+                            0,
+                            0,
+                            NULL);
+    assert(status == 0);
+    daemon_t daemon;
+    assert(daemon_init(&daemon, loader, path) == 0);
+    assert(async_launch(loader) == 0);
+    fflush(stdout);
+    for (size_t i = 0; i < n_jobs; i++) {
+        if ((job_pids[i] = fork()) == 0) {
+            daemon_lease_t lease;
+            async_detach(loader);
+            assert(daemon_connect(&lease, path, depth) == 0);
+            assert(async_attach(&loader, lease.name) == 0);
+            bench_worker(&loader->states[lease.worker],
+                         paths + i * files_per_job,
+                         files_per_job,
+                         depth,
+                         false,
+                         &shared[i]);
+            daemon_disconnect(&lease);
+            async_detach(loader);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    for (size_t n_exited = 0; n_exited < n_jobs; ) {
+        assert(daemon_poll(&daemon, 10) == 0);
+        n_exited += waitpid(-1, NULL, WNOHANG) > 0;
+    }
+    daemon_close(&daemon);
+    async_stop(loader);
+    async_destroy(loader);
+    bench_combine(shared, n_jobs, &result);
+    bench_print("daemon", &result);
+
+    mmap_free(shared, n_jobs * sizeof(bench_result_t));
+}
+
+/* Available benchmarks. */
+static struct {
+    const char *name;
+    void      (*run)(const char *dir);
+} benchmarks[] = {
+    {"hugepages", bench_hugepages},
+    {"syscalls", bench_syscalls},
+    {"numa", bench_numa},
+    {"small", bench_small},
+    {"contention", bench_contention},
+    {"readers", bench_readers},
+    {"open", bench_open},
+    {"devices", bench_devices},
+    {"reaping", bench_reaping},
+    {"inflight", bench_inflight},
+    {"profiles", bench_profiles},
+    {"handoff", bench_handoff},
+    {"wakeup", bench_wakeup},
+    {"jobs", bench_jobs},
+};
+
+int
+main(int argc, char **argv)
+{
+    size_t n_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+
+    for (size_t i = 0; i < n_benchmarks; i++) {
+        if (argc < 2 || strcmp(argv[1], benchmarks[i].name) == 0) {
+            printf("\n-- Benchmark: %s --\n", benchmarks[i].name);
+            fflush(stdout);
+            benchmarks[i].run(dir);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
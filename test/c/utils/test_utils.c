@@ -22,15 +22,25 @@
    */
 
 #include "../../../csrc/utils/sort.h"
+#include "../../../csrc/utils/alloc.h"
+#include "../../../csrc/utils/ring.h"
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
 
 #define N_KEYS (35)
+#define N_BLOCKS (64)
+#define N_PRODUCERS (4)
+#define N_PUSHES (10000)
 
-int
-main(int argc, char **argv)
+static int
+test_sort(void)
 {
     printf("Testing sorting...");
 
@@ -67,5 +77,257 @@ main(int argc, char **argv)
     }
 
     printf("success\n");
+    return EXIT_SUCCESS;
+}
+
+static int
+test_buddy(void)
+{
+    printf("Testing buddy allocator...");
+
+    /* Use a size which isn't a power of two, so some blocks lack buddies. */
+    size_t min_block = 4096;
+    size_t size = 1000 * min_block;
+    buddy_t *buddy = buddy_create(size, min_block, false);
+    assert(buddy != NULL);
+
+    buddy_stats_t stats;
+    buddy_get_stats(buddy, &stats);
+    assert(stats.capacity == size);
+    assert(stats.in_use == 0);
+    assert(buddy_max_block(buddy) == 512 * min_block);
+
+    /* Allocate a mix of sizes, and check that blocks don't overlap. */
+    size_t sizes[N_BLOCKS];
+    uint8_t *blocks[N_BLOCKS];
+    for (size_t i = 0; i < N_BLOCKS; i++) {
+        sizes[i] = (i % 4 == 0) ? 20 * 1024 + i : 100 + i * 37;
+        blocks[i] = buddy_alloc(buddy, sizes[i]);
+        assert(blocks[i] != NULL);
+        assert((blocks[i] - buddy->base) % min_block == 0);
+        memset(blocks[i], (int) i, sizes[i]);
+    }
+    for (size_t i = 0; i < N_BLOCKS; i++) {
+        for (size_t j = 0; j < sizes[i]; j++) {
+            if (blocks[i][j] != (uint8_t) i) {
+                printf("failed; block %lu overwritten\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* Check statistics. 20K requests round up to 32K blocks. */
+    buddy_get_stats(buddy, &stats);
+    size_t expected = (N_BLOCKS / 4) * 32 * 1024 + (N_BLOCKS - N_BLOCKS / 4) * min_block;
+    assert(stats.n_allocs == N_BLOCKS);
+    assert(stats.in_use == expected);
+    assert(stats.high_water == expected);
+    assert(stats.internal_frag > 0.0);
+
+    /* Requests larger than anything free must fail. */
+    assert(buddy_alloc(buddy, size) == NULL);
+    buddy_get_stats(buddy, &stats);
+    assert(stats.n_failed == 1);
+
+    /* Free half of the blocks in a forked child, as a worker would. */
+    pid_t pid;
+    fflush(stdout);
+    if ((pid = fork()) == 0) {
+        for (size_t i = 0; i < N_BLOCKS; i += 2) {
+            buddy_free(buddy, blocks[i]);
+        }
+        exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(status == EXIT_SUCCESS);
+    buddy_get_stats(buddy, &stats);
+    assert(stats.n_allocs == N_BLOCKS / 2);
+    assert(stats.high_water == expected);
+
+    /* Free the rest. Everything should coalesce back together. */
+    for (size_t i = 1; i < N_BLOCKS; i += 2) {
+        buddy_free(buddy, blocks[i]);
+    }
+    buddy_get_stats(buddy, &stats);
+    assert(stats.n_allocs == 0);
+    assert(stats.in_use == 0);
+    assert(stats.requested == 0);
+    assert(stats.largest_free == 512 * min_block);
+    assert(buddy_alloc(buddy, 512 * min_block) != NULL);
+
+    buddy_destroy(buddy);
+
+    printf("success\n");
+    return EXIT_SUCCESS;
+}
+
+static int
+test_ring(void)
+{
+    printf("Testing rings...");
+
+    /* Capacities round up to a power of two. */
+    assert(ring_capacity(1) == 1);
+    assert(ring_capacity(5) == 8);
+    assert(ring_capacity(64) == 64);
+
+    /* Values come out in the order they went in, including across
+       wraparound, and a full (empty) ring refuses pushes (pops). */
+    ring_cell_t cells[8];
+    ring_t ring;
+    ring_init(&ring, cells, 8, false, false);
+    size_t value;
+    assert(!ring_pop(&ring, &value));
+    assert(ring_empty(&ring));
+    for (size_t round = 0; round < 3; round++) {
+        for (size_t i = 0; i < 8; i++) {
+            assert(ring_push(&ring, round * 8 + i));
+        }
+        assert(!ring_push(&ring, 0));
+        assert(ring_size(&ring) == 8 && !ring_empty(&ring));
+        for (size_t i = 0; i < 5; i++) {
+            assert(ring_pop(&ring, &value));
+            assert(value == round * 8 + i);
+        }
+        for (size_t i = 0; i < 5; i++) {
+            assert(ring_push(&ring, 100 + i));
+        }
+        for (size_t i = 5; i < 8; i++) {
+            assert(ring_pop(&ring, &value) && value == round * 8 + i);
+        }
+        for (size_t i = 0; i < 5; i++) {
+            assert(ring_pop(&ring, &value) && value == 100 + i);
+        }
+        assert(!ring_pop(&ring, &value));
+        assert(ring_size(&ring) == 0 && ring_empty(&ring));
+    }
+
+    /* Values pushed and popped in bulk keep their order, and bulk operations
+       stop when the ring fills or empties. */
+    size_t values[12], popped[12];
+    for (size_t i = 0; i < 12; i++) {
+        values[i] = 200 + i;
+    }
+    assert(ring_push_many(&ring, values, 5) == 5);
+    assert(ring_push_many(&ring, values + 5, 7) == 3);
+    assert(ring_pop_many(&ring, popped, 12) == 8);
+    assert(ring_push_many(&ring, values + 8, 4) == 4);
+    assert(ring_pop_many(&ring, popped + 8, 12) == 4);
+    for (size_t i = 0; i < 12; i++) {
+        assert(popped[i] == values[i]);
+    }
+    assert(ring_pop_many(&ring, popped, 1) == 0);
+    assert(ring_push_many(&ring, values, 0) == 0);
+    assert(ring_pop_many(&ring, popped, 0) == 0);
+
+    /* Several forked producers push into a shared ring at once. Every value
+       must arrive exactly once, and each producer's values in order. */
+    size_t cap = 64;
+    size_t bytes = sizeof(ring_t) + cap * sizeof(ring_cell_t);
+    ring_t *shared = mmap_alloc(bytes);
+    assert(shared != NULL);
+    ring_init(shared, (ring_cell_t *) &shared[1], cap, true, false);
+
+    pid_t pids[N_PRODUCERS];
+    fflush(stdout);
+    for (size_t p = 0; p < N_PRODUCERS; p++) {
+        if ((pids[p] = fork()) == 0) {
+            for (size_t i = 0; i < N_PUSHES; i++) {
+                while (!ring_push(shared, p * N_PUSHES + i)) {
+                    sched_yield();
+                }
+            }
+            exit(EXIT_SUCCESS);
+        }
+    }
+    size_t next[N_PRODUCERS] = {0};
+    for (size_t n = 0; n < N_PRODUCERS * N_PUSHES; n++) {
+        while (!ring_pop(shared, &value)) {
+            sched_yield();
+        }
+        size_t p = value / N_PUSHES;
+        if (p >= N_PRODUCERS || value % N_PUSHES != next[p]) {
+            printf("failed; got %lu out of order\n", value);
+            return EXIT_FAILURE;
+        }
+        next[p]++;
+    }
+    for (size_t p = 0; p < N_PRODUCERS; p++) {
+        int status;
+        waitpid(pids[p], &status, 0);
+        assert(status == EXIT_SUCCESS);
+    }
+    assert(!ring_pop(shared, &value));
+    mmap_free(shared, bytes);
+
+    printf("success\n");
+    return EXIT_SUCCESS;
+}
+
+static int
+test_shm(void)
+{
+    printf("Testing named shared memory...");
+
+    char name[64];
+    snprintf(name, sizeof(name), "async-loader-test-utils-%d", getpid());
+    uint64_t tag = 42;
+    size_t size = 1024 * 1024;
+
+    /* Names must be usable as a single /dev/shm file. */
+    void *ptr;
+    assert(shm_create("", size, tag, &ptr) == -ENAMETOOLONG);
+    assert(shm_create("a/b", size, tag, &ptr) == -ENAMETOOLONG);
+
+    uint8_t *mem;
+    assert(shm_create(name, size, tag, (void **) &mem) == 0);
+    assert(shm_create(name, size, tag, &ptr) == -EEXIST);
+    mem[0] = 1;
+    mem[size - 1] = 2;
+
+    /* A child which unmaps the segment can attach to it once it's published,
+       at the same address, but only with the same tag. */
+    fflush(stdout);
+    pid_t pid;
+    if ((pid = fork()) == 0) {
+        shm_detach(mem);
+        assert(shm_attach(name, tag, &ptr) == -EAGAIN);
+        while (shm_attach(name, tag, &ptr) == -EAGAIN) {
+            sched_yield();
+        }
+        assert(ptr == mem && mem[0] == 1 && mem[size - 1] == 2);
+        mem[0] = 3;
+        shm_detach(mem);
+        assert(shm_attach(name, tag + 1, &ptr) == -EPROTO);
+        exit(EXIT_SUCCESS);
+    }
+    usleep(10 * 1000);
+    shm_publish(mem);
+    int status;
+    waitpid(pid, &status, 0);
+    assert(status == EXIT_SUCCESS);
+    assert(mem[0] == 3);
+
+    /* The segment is already mapped here, and is gone once removed. */
+    assert(shm_attach(name, tag, &ptr) == -EEXIST);
+    assert(shm_remove(name) == 0);
+    assert(shm_attach(name, tag, &ptr) == -ENOENT);
+    shm_detach(mem);
+
+    printf("success\n");
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (test_sort() != EXIT_SUCCESS ||
+        test_buddy() != EXIT_SUCCESS ||
+        test_ring() != EXIT_SUCCESS ||
+        test_shm() != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -22,8 +22,13 @@
    SOFTWARE.
 """
 
+import gc
 import os
 import sys
+import signal
+import pickle
+import asyncio
+import weakref
 import time
 import math
 import numpy as np
@@ -50,31 +55,47 @@ def load_normal(filepaths: List[str]):
 
     return end - begin
 
-# Load all files in FILEPATHS using an AsyncLoader worker context.
-def load_async_worker_loop(filepaths: List[str], batch_size: int, worker: al.Worker):
+# Load all files in FILEPATHS using an AsyncLoader worker context. If BULK,
+# each batch is requested with a single call to request_many, and retrieved
+# with get_batch.
+def load_async_worker_loop(filepaths: List[str], batch_size: int, worker: al.Worker, bulk: bool):
     # Read everything, one batch at a time.
     while filepaths:
         # Submit requests
         n_this_batch = min(batch_size, len(filepaths))
         partial_batch = n_this_batch < batch_size
-        for _ in range(n_this_batch):
-            if worker.request(filepath = filepaths.pop()) != True:
+        if bulk:
+            batch = filepaths[-n_this_batch:]
+            del filepaths[-n_this_batch:]
+            if worker.request_many(batch) != n_this_batch:
                 print("Worker request failed")
+        else:
+            for _ in range(n_this_batch):
+                if worker.request(filepath = filepaths.pop()) != True:
+                    print("Worker request failed")
 
         # Retrieve results
-        for _ in range(n_this_batch):
-            entry = worker.wait_get()
-            entry.release()
+        if bulk:
+            n_retrieved = 0
+            while n_retrieved < n_this_batch:
+                batch = worker.get_batch(n_this_batch - n_retrieved)
+                n_retrieved += len(batch)
+                worker.release_batch(batch)
+        else:
+            for _ in range(n_this_batch):
+                entry = worker.wait_get()
+                entry.release()
 
 # Load all files in FILEPATHS using AsyncLoader with N_WORKERS worker threads.
-def load_async(filepaths: List[str], batch_size: int, max_idle_iters: int, n_workers: int):
+def load_async(filepaths: List[str], batch_size: int, max_idle_iters: int, n_workers: int, bulk: bool = False):
     n_files = len(filepaths)
     files_per_loader = int(math.ceil(n_files / n_workers))
     loader = al.Loader(queue_depth=batch_size,
                        n_workers=n_workers,
                        dispatch_n=batch_size,
                        max_idle_iters=max_idle_iters,
-                       direct=False)
+                       direct=False,
+                       max_file_size=max([os.path.getsize(filepath) for filepath in filepaths]))
     
     # Spawn the loader
     loader_process = mp.Process(target=loader.become_loader)
@@ -85,7 +106,8 @@ def load_async(filepaths: List[str], batch_size: int, max_idle_iters: int, n_wor
         process = mp.Process(target=load_async_worker_loop, args=(
             filepaths[i * files_per_loader : (i + 1) * files_per_loader].copy(),
             batch_size,
-            loader.get_worker_context(id=i)
+            loader.get_worker_context(id=i),
+            bulk
         ))
         processes.append(process)
 
@@ -129,16 +151,13 @@ def verify_worker_loop(filepaths: List[str], batch_size: int, worker: al.Worker,
             filepath = entry.get_filepath().decode('utf-8')
             data = entry.get_data()
 
-            matched = True
-            for i, (ref, ours) in enumerate(zip(reference_data[filepath], data)):
-                if ref != ours:
-                    matched = False
-
-            if matched:
+            if data == reference_data[filepath]:
                 match_count += 1
             else:
                 mismatch_count += 1
 
+            # Drop our view of the data, so the entry is released immediately.
+            del data
             entry.release()
     
     print("Worker end. {} matches, {} mismatches".format(match_count, mismatch_count))
@@ -155,7 +174,8 @@ def verify_integrity(filepaths: List[str], batch_size: int, max_idle_iters: int,
                        n_workers=n_workers,
                        dispatch_n=batch_size,
                        max_idle_iters=max_idle_iters,
-                       direct=False)
+                       direct=False,
+                       max_file_size=max([os.path.getsize(filepath) for filepath in filepaths]))
     loader_process = mp.Process(target=loader.become_loader)
     worker_process =  mp.Process(target=verify_worker_loop, args=(filepaths, batch_size, loader.get_worker_context(id=0), data))
 
@@ -164,6 +184,371 @@ def verify_integrity(filepaths: List[str], batch_size: int, max_idle_iters: int,
     worker_process.join()
     loader_process.kill()
 
+# Check that calling F with ARGS raises an exception.
+def assert_raises(f, *args, **kwargs):
+    try:
+        f(*args, **kwargs)
+    except Exception:
+        return
+    raise AssertionError("{} didn't raise".format(f.__name__))
+
+# Create a loader for FILEPATHS, with its threads running in this process.
+def start_loader(filepaths: List[str], queue_depth: int = 8, n_workers: int = 1, **kwargs):
+    loader = al.Loader(queue_depth=queue_depth,
+                       n_workers=n_workers,
+                       dispatch_n=1,
+                       max_idle_iters=4,
+                       max_file_size=max([4096] + [os.path.getsize(filepath) for filepath in filepaths]),
+                       **kwargs)
+    loader.start()
+
+    return loader
+
+# Releasing an entry is deferred while views of its data are alive, and it can
+# only be released once. Views keep the loader mapped after it's dropped.
+def test_release(filepaths: List[str], data):
+    loader = start_loader(filepaths, queue_depth=2)
+    worker = loader.get_worker_context(id=0)
+    assert worker.request(filepath=filepaths[0])
+    entry = worker.wait_get()
+    view = entry.get_data()
+    assert view.readonly and view == data[filepaths[0]]
+
+    entry.release()
+    assert_raises(entry.release)
+    assert_raises(entry.get_data)
+    assert_raises(entry.get_filepath)
+    assert worker.request_many([filepaths[1]] * 2) == 1
+    assert bytes(view) == data[filepaths[0]]
+    del view
+    assert worker.request(filepath=filepaths[1])
+    for _ in range(2):
+        worker.wait_get().release()
+
+    assert worker.request(filepath=filepaths[2])
+    entry = worker.wait_get()
+    view = entry.get_data()
+    loader.stop()
+    del worker, loader
+    gc.collect()
+    assert bytes(view) == data[filepaths[2]]
+    entry.release()
+    del view, entry
+    gc.collect()
+
+# NumPy arrays and DLPack tensors over an entry's data hold the entry, and so
+# the loader, until they're gone.
+def test_numpy(filepaths: List[str], data):
+    loader = start_loader(filepaths, queue_depth=1)
+    worker = loader.get_worker_context(id=0)
+    assert worker.request(filepath=filepaths[0])
+    entry = worker.wait_get()
+    array = entry.as_numpy()
+    assert array.dtype == np.uint8 and not array.flags.writeable
+    assert array.tobytes() == data[filepaths[0]]
+    words = entry.as_numpy(dtype=np.uint32, shape=(2, 2), offset=4)
+    assert words.shape == (2, 2) and words.tobytes() == data[filepaths[0]][4:20]
+    assert entry.__dlpack_device__() == (1, 0)
+    tensor = np.from_dlpack(entry)
+    assert tensor.tobytes() == data[filepaths[0]]
+
+    entry.release()
+    assert_raises(entry.as_numpy)
+    assert_raises(np.from_dlpack, entry)
+    del array, words
+    assert not worker.request(filepath=filepaths[1])
+    loader.stop()
+    del entry, worker, loader
+    gc.collect()
+    assert tensor.tobytes() == data[filepaths[0]]
+    del tensor
+    gc.collect()
+
+# WAIT_GET sleeps until a file is loaded, or returns None once its timeout
+# passes. Files which fail to load raise.
+def test_wait(filepaths: List[str], data):
+    loader = start_loader(filepaths)
+    worker = loader.get_worker_context(id=0)
+    begin = time.time()
+    assert worker.wait_get(timeout=0.2) is None
+    assert time.time() - begin >= 0.2
+    assert worker.wait_get(timeout=0, spin=0) is None
+
+    assert worker.request(filepath=filepaths[0])
+    entry = worker.wait_get(timeout=10)
+    assert entry is not None and entry.get_data() == data[filepaths[0]]
+    entry.release()
+    assert worker.request(filepath=filepaths[0] + ".does-not-exist")
+    assert_raises(worker.wait_get, timeout=10)
+    assert_raises(worker.wait_get, timeout=-1)
+    loader.stop()
+
+# Fork a process running LOADER's threads, returning its PID.
+def fork_loader(loader: al.Loader):
+    pid = os.fork()
+    if pid == 0:
+        loader.become_loader()
+
+    return pid
+
+# Kill the process running a loader's threads, forked by FORK_LOADER.
+def kill_loader(pid: int):
+    os.kill(pid, signal.SIGKILL)
+    os.waitpid(pid, 0)
+
+# Futures from GET resolve in order as files are loaded, skipping those which
+# were cancelled, and workers can be iterated with async for.
+def test_asyncio(filepaths: List[str], data):
+    loader = start_loader(filepaths)
+    worker = loader.get_worker_context(id=0)
+
+    async def load():
+        assert worker.request_many(filepaths[:4]) == 4
+        entries = await asyncio.gather(*[worker.get() for _ in range(4)])
+        assert sorted([entry.get_filepath().decode() for entry in entries]) == sorted(filepaths[:4])
+        for entry in entries:
+            assert entry.get_data() == data[entry.get_filepath().decode()]
+            entry.release()
+
+        worker.get().cancel()
+        assert worker.request(filepath=filepaths[4])
+        entry = await asyncio.wait_for(worker.get(), 10)
+        assert entry.get_data() == data[filepaths[4]]
+        entry.release()
+
+        assert worker.request(filepath=filepaths[5])
+        async for entry in worker:
+            assert entry.get_data() == data[filepaths[5]]
+            entry.release()
+            break
+
+        assert worker.request(filepath=filepaths[0] + ".does-not-exist")
+        try:
+            await asyncio.wait_for(worker.get(), 10)
+        except asyncio.TimeoutError:
+            raise
+        except Exception:
+            pass
+        else:
+            raise AssertionError("get() didn't raise")
+
+    asyncio.run(load())
+    assert_raises(worker.get)
+    loader.stop()
+
+# Processes forked from the loader's creator share its workers' event fds. One
+# dropping its copy of the loader leaves the others' fds alone.
+def test_fork_events(filepaths: List[str], data):
+    loader = al.Loader(queue_depth=8, n_workers=1, dispatch_n=1, max_idle_iters=4, max_file_size=64 * 1024)
+    loader_pid = fork_loader(loader)
+    try:
+        worker = loader.get_worker_context(id=0)
+        fd = worker.fileno()
+        pid = os.fork()
+        if pid == 0:
+            ref = weakref.ref(loader)
+            del worker, loader
+            gc.collect()
+            os._exit(0 if ref() is None else 1)
+        assert os.waitpid(pid, 0)[1] == 0
+        assert worker.fileno() == fd
+
+        async def load():
+            assert worker.request(filepath=filepaths[0])
+            return await asyncio.wait_for(worker.get(), 10)
+
+        entry = asyncio.run(load())
+        assert entry.get_data() == data[filepaths[0]]
+        entry.release()
+    finally:
+        kill_loader(loader_pid)
+
+# START runs the loader's threads in this process until STOP, or until the
+# loader is deleted. Processes forked from it don't inherit the threads, and
+# deleting their copy of the loader leaves the threads running.
+def test_start_stop(filepaths: List[str], data):
+    loader = start_loader(filepaths)
+    worker = loader.get_worker_context(id=0)
+    assert_raises(loader.start)
+    pid = os.fork()
+    if pid == 0:
+        stopped = True
+        try:
+            loader.stop()
+        except Exception:
+            stopped = False
+        ref = weakref.ref(loader)
+        del worker, loader
+        gc.collect()
+        os._exit(0 if not stopped and ref() is None else 1)
+    assert os.waitpid(pid, 0)[1] == 0
+    assert worker.request(filepath=filepaths[0])
+    entry = worker.wait_get(timeout=10)
+    assert entry is not None and entry.get_data() == data[filepaths[0]]
+    entry.release()
+
+    loader.stop()
+    assert_raises(loader.stop)
+    assert worker.request(filepath=filepaths[1])
+    assert worker.wait_get(timeout=0.2) is None
+    loader.start()
+    entry = worker.wait_get(timeout=10)
+    assert entry is not None and entry.get_data() == data[filepaths[1]]
+    entry.release()
+    del worker, loader
+    gc.collect()
+
+# Batches describe each entry's data, and whether it's in the data arena or the
+# inline areas. Views of either keep the loader mapped.
+def test_batch(filepaths: List[str], data):
+    loader = start_loader(filepaths, queue_depth=16, inline_size=4096)
+    worker = loader.get_worker_context(id=0)
+    assert worker.get_batch(4, timeout=0.1) is None
+    paths = filepaths[:8] + [filepaths[0] + ".does-not-exist"]
+    assert worker.request_many(paths, ids=list(range(len(paths)))) == len(paths)
+    ids = []
+    while len(ids) < len(paths):
+        batch = worker.get_batch(len(paths), timeout=10)
+        descriptors = np.asarray(batch.get_descriptors())
+        assert descriptors.shape == (len(batch), 5)
+        arena, inline = batch.get_data(), batch.get_inline_data()
+        for id, offset, length, status, inlined in descriptors.tolist():
+            ids.append(id)
+            if status < 0:
+                assert paths[id] not in data and length == 0 and not inlined
+                continue
+            assert inlined == (len(data[paths[id]]) <= 4096)
+            view = inline if inlined else arena
+            assert view[offset:offset + length] == data[paths[id]]
+        worker.release_batch(batch)
+        assert_raises(worker.release_batch, batch)
+        assert_raises(batch.get_data)
+    assert sorted(ids) == list(range(len(paths)))
+
+    path = next(path for path in filepaths if len(data[path]) > 4096)
+    assert worker.request(filepath=path)
+    batch = worker.get_batch(1, timeout=10)
+    _, offset, length, _, inlined = np.asarray(batch.get_descriptors())[0].tolist()
+    arena = batch.get_data()
+    loader.stop()
+    del batch, worker, loader
+    gc.collect()
+    assert not inlined and arena[offset:offset + length] == data[path]
+    del arena
+    gc.collect()
+
+# Load FILEPATHS through WORKER, a worker of a named loader unpickled in a
+# process which wasn't forked from the loader's creator, returning their data.
+def load_named(worker: al.Worker, filepaths: List[str]):
+    assert_raises(worker.fileno)
+    assert worker.request_many(filepaths) == len(filepaths)
+    data = {}
+    for _ in filepaths:
+        entry = worker.wait_get(timeout=10)
+        data[entry.get_filepath().decode()] = bytes(entry.get_data())
+        entry.release()
+
+    return data
+
+# Named loaders can be attached to by any process, and their workers pickled;
+# anonymous loaders' can't. The segment is removed with the loader.
+def test_named(filepaths: List[str], data):
+    name = "al-test-{}".format(os.getpid())
+    loader = start_loader(filepaths, n_workers=2, name=name)
+    assert loader.get_name() == name
+    assert al.Loader.attach(name) is loader
+    worker = loader.get_worker_context(id=1)
+    unpickled = pickle.loads(pickle.dumps(worker))
+    assert unpickled.request(filepath=filepaths[0])
+    entry = worker.wait_get(timeout=10)
+    assert entry.get_data() == data[filepaths[0]]
+    entry.release()
+
+    with mp.get_context("spawn").Pool(1) as pool:
+        assert pool.apply(load_named, (worker, filepaths[:4])) == {path: data[path] for path in filepaths[:4]}
+    assert_raises(al.Loader, queue_depth=1, n_workers=1, dispatch_n=1, max_idle_iters=1,
+                  max_file_size=4096, name=name)
+    loader.stop()
+    del entry, worker, unpickled, loader
+    gc.collect()
+    assert_raises(al.Loader.attach, name)
+
+    anonymous = start_loader(filepaths)
+    assert anonymous.get_name() is None
+    assert_raises(pickle.dumps, anonymous.get_worker_context(id=0))
+    anonymous.stop()
+
+# Jobs lease workers from a daemon serving a named loader, and each lease is
+# held until the worker and every entry gotten from it are gone.
+def test_serve(filepaths: List[str], data):
+    name = "al-serve-{}".format(os.getpid())
+    path = "/tmp/{}.sock".format(name)
+    pid = os.fork()
+    if pid == 0:
+        loader = al.Loader(queue_depth=8, n_workers=1, dispatch_n=1, max_idle_iters=4,
+                           max_file_size=64 * 1024, name=name)
+        try:
+            loader.serve(path)
+        except KeyboardInterrupt:
+            pass
+        del loader
+        os._exit(0)
+
+    # Retry while the daemon is starting up, or yet to reclaim the worker.
+    def connect():
+        for _ in range(1000):
+            try:
+                return al.Loader.connect(path)
+            except Exception:
+                time.sleep(0.01)
+        return al.Loader.connect(path)
+
+    try:
+        worker = connect()
+        assert_raises(worker.fileno)
+        assert worker.request(filepath=filepaths[0])
+        entry = worker.wait_get(timeout=10)
+        del worker
+        gc.collect()
+
+        # The entry holds the lease, so the only worker is still in use.
+        assert_raises(al.Loader.connect, path)
+        assert entry.get_data() == data[filepaths[0]]
+        entry.release()
+        assert_raises(entry.release)
+        del entry
+        gc.collect()
+
+        # The daemon reclaims the worker once it sees the lease end.
+        worker = connect()
+        assert worker.request(filepath=filepaths[1])
+        entry = worker.wait_get(timeout=10)
+        assert entry.get_data() == data[filepaths[1]]
+        entry.release()
+        del entry, worker
+    finally:
+        os.kill(pid, signal.SIGINT)
+        assert os.waitpid(pid, 0)[1] == 0
+    assert_raises(al.Loader.attach, name)
+
+# Check the Python API against the data in FILEPATHS.
+def test_api(filepaths: List[str]):
+    data = {}
+    for filepath in filepaths:
+        with open(filepath, 'rb') as file:
+            data[filepath] = file.read(-1)
+
+    test_release(filepaths, data)
+    test_numpy(filepaths, data)
+    test_wait(filepaths, data)
+    test_asyncio(filepaths, data)
+    test_fork_events(filepaths, data)
+    test_batch(filepaths, data)
+    test_start_stop(filepaths, data)
+    test_named(filepaths, data)
+    test_serve(filepaths, data)
+    print("All API tests passed.")
+
 def main():
     np.random.seed(42)
 
@@ -195,11 +580,18 @@ def main():
             os.system("sudo ./clear_cache.sh")
             time_async = load_async(filepaths.copy(), batch_size, max_idle_iters, n_workers)
             print("AsyncLoader ({} workers, {} batch size): {:.04}s ({:.04} MB/s)".format(n_workers, batch_size, time_async, size / (1024 * 1024 * time_async)))
+            os.system("sudo ./clear_cache.sh")
+            time_async = load_async(filepaths.copy(), batch_size, max_idle_iters, n_workers, bulk=True)
+            print("AsyncLoader ({} workers, {} batch size, request_many/get_batch): {:.04}s ({:.04} MB/s)".format(n_workers, batch_size, time_async, size / (1024 * 1024 * time_async)))
     
     # Check integrity...
     print("\nChecking integrity with 1 worker/32 batch size...")
     verify_integrity(filepaths.copy(), 32, max_idle_iters, 1)
 
+    # Check the Python API...
+    print("\nChecking the Python API...")
+    test_api(filepaths[:16])
+
 
 if __name__ == "__main__":
     main()
\ No newline at end of file